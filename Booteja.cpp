@@ -1,22 +1,42 @@
 // Booteja.cpp  Windows-only single-file CLI to manage UEFI boot vars
 // Build (Developer Command Prompt for VS 2022):
-//   cl /EHsc /W4 /O2 /DUNICODE /D_UNICODE Booteja.cpp
+//   cl /EHsc /W4 /O2 /MT /DUNICODE /D_UNICODE Booteja.cpp
 // Run as Administrator.
 
 #include <windows.h>
+#include <winioctl.h>
+#include <sddl.h>
+#include <aclapi.h>
+#include <wincrypt.h>
+#include <bcrypt.h>
+#include <TraceLoggingProvider.h>
+#include <intrin.h>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define BOOTEJA_HAVE_SSE2 1
+#endif
 
 #include <algorithm>
+#include <atomic>
 #include <cwctype>
 #include <fcntl.h>
 #include <iomanip>
 #include <io.h>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 // Link against Advapi32 for token privilege APIs
 #pragma comment(lib, "Advapi32.lib")
+// Bcrypt for SHA-256 image hashes, Crypt32 for certificate subjects
+#pragma comment(lib, "Bcrypt.lib")
+#pragma comment(lib, "Crypt32.lib")
 
 // Some Windows SDKs don't expose EFI variable attribute flags in headers.
 // Define them if missing so SetFirmwareEnvironmentVariableExW gets valid attrs.
@@ -31,6 +51,8 @@
 #endif
 
 static const wchar_t* EFI_GLOBAL_VARIABLE_GUID = L"{8BE4DF61-93CA-11D2-AA0D-00E098032B8C}";
+// db and dbx live here; PK and KEK are global variables.
+static const wchar_t* EFI_IMAGE_SECURITY_DATABASE_GUID = L"{D719B2CB-3D3A-4596-A3BC-DAD00E67656F}";
 
 // UEFI Load Option Attributes (subset)
 constexpr UINT32 LOAD_OPTION_ACTIVE = 0x00000001;
@@ -40,11 +62,39 @@ constexpr UINT32 LOAD_OPTION_HIDDEN = 0x00000008;
 constexpr DWORD DEFAULT_EFI_READ_BUFFER_SIZE = 4096;
 constexpr size_t BOOT_OPTION_HEADER_SIZE = 6;
 
+// Exit code for write commands whose target already held the requested state.
+constexpr int EXIT_UNCHANGED = 10;
+// Exit code for 'check' when an image's hash is listed in dbx.
+constexpr int EXIT_REVOKED = 5;
+
 static DWORD g_varAttrsRW =
     EFI_VARIABLE_NON_VOLATILE |
     EFI_VARIABLE_BOOTSERVICE_ACCESS |
     EFI_VARIABLE_RUNTIME_ACCESS;
 
+enum class WriteResult {
+    Failed,
+    Written,
+    Unchanged,
+};
+
+// Non-owning byte range; C++14 has no std::span.
+struct ByteSpan {
+    const BYTE* Data = nullptr;
+    size_t Size = 0;
+};
+
+// Read-only view of an EFI_LOAD_OPTION that points into the variable buffer,
+// used by the enumeration paths. Valid only while that buffer is alive; the
+// edit paths use the owning ParsedLoadOption instead.
+struct LoadOptionView {
+    UINT32 Attributes = 0;
+    UINT16 FilePathListLength = 0;
+    ByteSpan Description;     // UCS-2 code units, terminator excluded
+    ByteSpan DevicePath;
+    ByteSpan OptionalData;
+};
+
 struct ParsedLoadOption {
     UINT32 Attributes = 0;
     UINT16 FilePathListLength = 0;
@@ -54,6 +104,24 @@ struct ParsedLoadOption {
 };
 
 // ----------------- Utilities -----------------
+// Commands write through Out() and Err(). Every thread starts on std::wcout and
+// std::wcerr; an --images worker or a service request points its own thread at
+// private streams, so format flags set by one command never reach another.
+struct ThreadStreams {
+    std::wostream* Out = &std::wcout;
+    std::wostream* Err = &std::wcerr;
+};
+
+thread_local ThreadStreams t_streams;
+
+std::wostream& Out() {
+    return *t_streams.Out;
+}
+
+std::wostream& Err() {
+    return *t_streams.Err;
+}
+
 std::wstring LastErrorMessage(DWORD err = GetLastError()) {
     LPWSTR buf = nullptr;
     const DWORD flags = FORMAT_MESSAGE_ALLOCATE_BUFFER |
@@ -76,549 +144,8074 @@ std::wstring LastErrorMessage(DWORD err = GetLastError()) {
     return ss.str();
 }
 
+// SE_SYSTEM_ENVIRONMENT_PRIVILEGE from wdm.h; the user-mode headers only
+// carry the privilege's name. Well-known privilege LUIDs are fixed, so the
+// value is used as is and LookupPrivilegeValueW (an LSA round trip) only
+// runs if the token does not accept it.
+constexpr LUID SYSTEM_ENVIRONMENT_PRIVILEGE_LUID = { 22, 0 };
+
 bool EnableSystemEnvironmentPrivilege() {
     HANDLE hToken = nullptr;
     if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken)) {
-        std::wcerr << L"OpenProcessToken failed: " << LastErrorMessage() << L"\n";
+        Err() << L"OpenProcessToken failed: " << LastErrorMessage() << L"\n";
         return false;
     }
 
-    TOKEN_PRIVILEGES tp{};
-    tp.PrivilegeCount = 1;
-
-    if (!LookupPrivilegeValueW(nullptr, SE_SYSTEM_ENVIRONMENT_NAME, &tp.Privileges[0].Luid)) {
-        std::wcerr << L"LookupPrivilegeValueW failed: " << LastErrorMessage() << L"\n";
-        CloseHandle(hToken);
-        return false;
-    }
+    auto enable = [&](const LUID& luid) {
+        TOKEN_PRIVILEGES tp{};
+        tp.PrivilegeCount = 1;
+        tp.Privileges[0].Luid = luid;
+        tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        return AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), nullptr, nullptr) &&
+               GetLastError() != ERROR_NOT_ALL_ASSIGNED;
+    };
 
-    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
-    if (!AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), nullptr, nullptr)) {
-        std::wcerr << L"AdjustTokenPrivileges failed: " << LastErrorMessage() << L"\n";
-        CloseHandle(hToken);
-        return false;
+    bool ok = enable(SYSTEM_ENVIRONMENT_PRIVILEGE_LUID);
+    if (!ok) {
+        LUID looked = {};
+        if (!LookupPrivilegeValueW(nullptr, SE_SYSTEM_ENVIRONMENT_NAME, &looked)) {
+            Err() << L"LookupPrivilegeValueW failed: " << LastErrorMessage() << L"\n";
+        } else if (looked.LowPart != SYSTEM_ENVIRONMENT_PRIVILEGE_LUID.LowPart ||
+                   looked.HighPart != SYSTEM_ENVIRONMENT_PRIVILEGE_LUID.HighPart) {
+            ok = enable(looked);
+        }
     }
 
     CloseHandle(hToken);
-    return GetLastError() != ERROR_NOT_ALL_ASSIGNED;
+    return ok;
+}
+
+// "Boot####" held inline, so naming a variable never touches the heap.
+// Converts to std::wstring where an owning string is needed.
+struct BootVarName {
+    wchar_t Text[9];
+
+    const wchar_t* c_str() const { return Text; }
+    operator std::wstring() const { return std::wstring(Text, 8); }
+};
+
+std::wostream& operator<<(std::wostream& os, const BootVarName& name) {
+    return os.write(name.Text, 8);
+}
+
+constexpr wchar_t UPPER_HEX_DIGITS[] = L"0123456789ABCDEF";
+
+constexpr BootVarName MakeBootVarName(UINT16 id) {
+    return BootVarName{ {
+        L'B', L'o', L'o', L't',
+        UPPER_HEX_DIGITS[(id >> 12) & 0xF], UPPER_HEX_DIGITS[(id >> 8) & 0xF],
+        UPPER_HEX_DIGITS[(id >> 4) & 0xF], UPPER_HEX_DIGITS[id & 0xF],
+        L'\0',
+    } };
 }
 
-std::wstring MakeBootVarName(UINT16 id) {
-    std::wstringstream var;
-    var << L"Boot" << std::uppercase << std::hex << std::setw(4) << std::setfill(L'0') << id;
-    return var.str();
+static_assert(MakeBootVarName(0x0A1F).Text[4] == L'0' && MakeBootVarName(0x0A1F).Text[5] == L'A' &&
+              MakeBootVarName(0x0A1F).Text[7] == L'F' && MakeBootVarName(0x0A1F).Text[8] == L'\0',
+              "MakeBootVarName formats four uppercase hex digits");
+
+constexpr int HexDigitValue(wchar_t ch) {
+    return (ch >= L'0' && ch <= L'9') ? ch - L'0'
+         : (ch >= L'a' && ch <= L'f') ? ch - L'a' + 10
+         : (ch >= L'A' && ch <= L'F') ? ch - L'A' + 10
+         : -1;
 }
 
+// Accepts a hex ID with an optional "Boot" or "0x" prefix (any case). The
+// whole token must be digits, so "00G1" or "1 2" are rejected.
 bool ParseBootId(const std::wstring& text, UINT16& outId) {
-    std::wstring token = text;
+    const wchar_t* p = text.c_str();
+    const wchar_t* end = p + text.size();
 
-    if (token.rfind(L"Boot", 0) == 0 || token.rfind(L"boot", 0) == 0) {
-        token = token.substr(4);
+    if (end - p >= 4 && (p[0] | 0x20) == L'b' && (p[1] | 0x20) == L'o' && (p[2] | 0x20) == L'o' &&
+        (p[3] | 0x20) == L't') {
+        p += 4;
+    } else if (end - p >= 2 && p[0] == L'0' && (p[1] | 0x20) == L'x') {
+        p += 2;
     }
 
-    unsigned value = 0;
-    std::wstringstream hs;
-    hs << std::hex << token;
-    if (!(hs >> value) || value > 0xFFFF) {
+    if (p == end) {
         return false;
     }
 
+    unsigned value = 0;
+    for (; p != end; ++p) {
+        const int digit = HexDigitValue(*p);
+        if (digit < 0) {
+            return false;
+        }
+        value = (value << 4) | static_cast<unsigned>(digit);
+        if (value > 0xFFFF) {
+            return false;
+        }
+    }
+
     outId = static_cast<UINT16>(value);
     return true;
 }
 
-std::vector<BYTE> ReadEfiVar(const std::wstring& name, DWORD& attrsOut) {
-    DWORD required = GetFirmwareEnvironmentVariableExW(
-        name.c_str(), EFI_GLOBAL_VARIABLE_GUID, nullptr, 0, &attrsOut);
+std::wstring FormatGuid(const GUID& g) {
+    wchar_t buf[40] = {};
+    swprintf_s(buf, L"{%08lX-%04hX-%04hX-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+        g.Data1, g.Data2, g.Data3,
+        g.Data4[0], g.Data4[1], g.Data4[2], g.Data4[3],
+        g.Data4[4], g.Data4[5], g.Data4[6], g.Data4[7]);
+    return buf;
+}
 
-    if (required == 0 && GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
-        return {};
+// GUIDs as stored by firmware and on disk: Data1-Data3 little-endian, then
+// Data4 as bytes.
+void StoreGuid(BYTE* dst, const GUID& g) {
+    const UINT32 d1 = g.Data1;
+    memcpy(dst, &d1, sizeof(d1));
+    memcpy(dst + 4, &g.Data2, sizeof(g.Data2));
+    memcpy(dst + 6, &g.Data3, sizeof(g.Data3));
+    memcpy(dst + 8, g.Data4, sizeof(g.Data4));
+}
+
+GUID LoadGuid(const BYTE* src) {
+    GUID g = {};
+    UINT32 d1 = 0;
+    memcpy(&d1, src, sizeof(d1));
+    g.Data1 = d1;
+    memcpy(&g.Data2, src + 4, sizeof(g.Data2));
+    memcpy(&g.Data3, src + 6, sizeof(g.Data3));
+    memcpy(g.Data4, src + 8, sizeof(g.Data4));
+    return g;
+}
+
+// Inverse of FormatGuid; accepts either case.
+bool ParseGuid(const std::wstring& text, GUID& g) {
+    static const size_t digitAt[16] = { 1, 3, 5, 7, 10, 12, 15, 17, 20, 22, 25, 27, 29, 31, 33, 35 };
+    if (text.size() != 38 || text[0] != L'{' || text[37] != L'}' ||
+        text[9] != L'-' || text[14] != L'-' || text[19] != L'-' || text[24] != L'-') {
+        return false;
     }
 
-    if (required == 0) {
-        required = DEFAULT_EFI_READ_BUFFER_SIZE;
+    BYTE b[16];
+    for (size_t i = 0; i < 16; ++i) {
+        const int hi = HexDigitValue(text[digitAt[i]]);
+        const int lo = HexDigitValue(text[digitAt[i] + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        b[i] = static_cast<BYTE>((hi << 4) | lo);
     }
 
-    std::vector<BYTE> buf(required);
-    DWORD gotAttrs = 0;
+    g.Data1 = (static_cast<unsigned long>(b[0]) << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+    g.Data2 = static_cast<unsigned short>((b[4] << 8) | b[5]);
+    g.Data3 = static_cast<unsigned short>((b[6] << 8) | b[7]);
+    memcpy(g.Data4, b + 8, sizeof(g.Data4));
+    return true;
+}
+
+// Hex helpers used by capture files and diagnostics. Bytes are encoded
+// through a 256-entry table of digit pairs written straight into a pre-sized
+// buffer; on SSE2 targets the unspaced form converts 16 bytes per step.
+struct HexDigitTable {
+    wchar_t Pairs[256][2];
+};
+
+constexpr HexDigitTable MakeHexDigitTable() {
+    HexDigitTable t{};
+    for (unsigned i = 0; i < 256; ++i) {
+        t.Pairs[i][0] = L"0123456789abcdef"[i >> 4];
+        t.Pairs[i][1] = L"0123456789abcdef"[i & 0x0F];
+    }
+    return t;
+}
+
+constexpr HexDigitTable HEX_DIGITS = MakeHexDigitTable();
+static_assert(HEX_DIGITS.Pairs[0xA7][0] == L'a' && HEX_DIGITS.Pairs[0xA7][1] == L'7', "hex digit table");
 
-    DWORD read = GetFirmwareEnvironmentVariableExW(
-        name.c_str(), EFI_GLOBAL_VARIABLE_GUID, buf.data(), required, &gotAttrs);
+// Writes 2 * n digits at dst and returns the end.
+wchar_t* EncodeHex(wchar_t* dst, const BYTE* src, size_t n) {
+    size_t i = 0;
 
-    if (read == 0 && GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
-        const DWORD newSize = GetFirmwareEnvironmentVariableExW(
-            name.c_str(), EFI_GLOBAL_VARIABLE_GUID, nullptr, 0, &gotAttrs);
+#ifdef BOOTEJA_HAVE_SSE2
+    if (sizeof(wchar_t) == sizeof(UINT16)) {
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        const __m128i nine = _mm_set1_epi8(9);
+        const __m128i digitZero = _mm_set1_epi8('0');
+        const __m128i letterGap = _mm_set1_epi8('a' - '0' - 10);
+        const __m128i zero = _mm_setzero_si128();
+        auto toDigits = [&](__m128i v) {
+            return _mm_add_epi8(_mm_add_epi8(v, digitZero), _mm_and_si128(_mm_cmpgt_epi8(v, nine), letterGap));
+        };
 
-        if (newSize > buf.size()) {
-            buf.resize(newSize);
-            read = GetFirmwareEnvironmentVariableExW(
-                name.c_str(), EFI_GLOBAL_VARIABLE_GUID, buf.data(), newSize, &gotAttrs);
+        for (; i + 16 <= n; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            const __m128i hi = toDigits(_mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+            const __m128i lo = toDigits(_mm_and_si128(v, nibble));
+            const __m128i first = _mm_unpacklo_epi8(hi, lo);
+            const __m128i second = _mm_unpackhi_epi8(hi, lo);
+            __m128i* out = reinterpret_cast<__m128i*>(dst + i * 2);
+            _mm_storeu_si128(out, _mm_unpacklo_epi8(first, zero));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi8(first, zero));
+            _mm_storeu_si128(out + 2, _mm_unpacklo_epi8(second, zero));
+            _mm_storeu_si128(out + 3, _mm_unpackhi_epi8(second, zero));
         }
     }
+#endif
 
-    if (read == 0) {
-        return {};
+    for (; i < n; ++i) {
+        dst[i * 2] = HEX_DIGITS.Pairs[src[i]][0];
+        dst[i * 2 + 1] = HEX_DIGITS.Pairs[src[i]][1];
     }
+    return dst + n * 2;
+}
 
-    buf.resize(read);
-    attrsOut = gotAttrs;
-    return buf;
+// Writes "xx " for each byte (3 * n characters) and returns the end.
+wchar_t* EncodeHexSpaced(wchar_t* dst, const BYTE* src, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        *dst++ = HEX_DIGITS.Pairs[src[i]][0];
+        *dst++ = HEX_DIGITS.Pairs[src[i]][1];
+        *dst++ = L' ';
+    }
+    return dst;
+}
+
+void AppendHexBytes(std::wstring& out, const BYTE* p, size_t n) {
+    const size_t at = out.size();
+    out.resize(at + n * 2);
+    EncodeHex(&out[at], p, n);
+}
+
+std::wstring ToHex(const BYTE* p, size_t n) {
+    std::wstring out;
+    AppendHexBytes(out, p, n);
+    return out;
 }
 
-bool WriteEfiVar(const std::wstring& name, const void* data, DWORD size, DWORD attrs) {
-    if (!SetFirmwareEnvironmentVariableExW(name.c_str(), EFI_GLOBAL_VARIABLE_GUID, (PVOID)data, size, attrs)) {
-        std::wcerr << L"Write '" << name << L"' failed: " << LastErrorMessage() << L"\n";
+bool FromHex(const std::wstring& text, std::vector<BYTE>& out) {
+    auto nibble = [](wchar_t ch) -> int {
+        if (ch >= L'0' && ch <= L'9') return ch - L'0';
+        if (ch >= L'a' && ch <= L'f') return ch - L'a' + 10;
+        if (ch >= L'A' && ch <= L'F') return ch - L'A' + 10;
+        return -1;
+    };
+
+    if (text.size() % 2 != 0) {
         return false;
     }
+
+    out.resize(text.size() / 2);
+    for (size_t i = 0; i < out.size(); ++i) {
+        const int hi = nibble(text[i * 2]);
+        const int lo = nibble(text[i * 2 + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = static_cast<BYTE>((hi << 4) | lo);
+    }
     return true;
 }
 
-std::wstring ReadUcs2String(const std::vector<BYTE>& data, size_t start, size_t& nextOffset) {
-    std::wstring out;
-    size_t i = start;
+// Reads a UTF-8 or UTF-16LE (with BOM) text file; "-" reads standard input.
+bool ReadTextFile(const std::wstring& path, std::wstring& text) {
+    const bool useStdin = (path == L"-");
+    HANDLE h = useStdin
+        ? GetStdHandle(STD_INPUT_HANDLE)
+        : CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE || h == nullptr) {
+        Err() << L"Cannot open '" << path << L"': " << LastErrorMessage() << L"\n";
+        return false;
+    }
 
-    while (i + 1 < data.size()) {
-        const wchar_t ch = static_cast<wchar_t>(data[i] | (data[i + 1] << 8));
-        i += 2;
-        if (ch == L'\0') {
-            break;
-        }
-        out.push_back(ch);
+    std::vector<BYTE> raw;
+    BYTE chunk[DEFAULT_EFI_READ_BUFFER_SIZE];
+    DWORD got = 0;
+    while (ReadFile(h, chunk, sizeof(chunk), &got, nullptr) && got > 0) {
+        raw.insert(raw.end(), chunk, chunk + got);
     }
 
-    if (i & 1) {
-        ++i;
+    if (!useStdin) {
+        CloseHandle(h);
     }
 
-    nextOffset = i;
-    return out;
-}
+    text.clear();
+    if (raw.size() >= 2 && raw[0] == 0xFF && raw[1] == 0xFE) {
+        for (size_t i = 2; i + 1 < raw.size(); i += 2) {
+            text.push_back(static_cast<wchar_t>(raw[i] | (raw[i + 1] << 8)));
+        }
+        return true;
+    }
 
-std::wstring HexPreview(const BYTE* p, size_t n) {
-    std::wstringstream ss;
-    ss << std::hex << std::setfill(L'0');
+    size_t start = 0;
+    if (raw.size() >= 3 && raw[0] == 0xEF && raw[1] == 0xBB && raw[2] == 0xBF) {
+        start = 3;
+    }
 
-    const size_t count = std::min<size_t>(n, 64);
-    for (size_t i = 0; i < count; ++i) {
-        ss << std::setw(2) << static_cast<unsigned>(p[i]) << L' ';
+    if (raw.size() > start) {
+        const char* src = reinterpret_cast<const char*>(raw.data() + start);
+        const int srcLen = static_cast<int>(raw.size() - start);
+        const int n = MultiByteToWideChar(CP_UTF8, 0, src, srcLen, nullptr, 0);
+        text.resize(n);
+        MultiByteToWideChar(CP_UTF8, 0, src, srcLen, &text[0], n);
     }
 
-    return ss.str();
+    return true;
 }
 
-bool ParseLoadOption(const std::vector<BYTE>& buf, ParsedLoadOption& plo) {
-    if (buf.size() < BOOT_OPTION_HEADER_SIZE) {
+// Writes the bytes as they are, replacing the file. A durable write reaches
+// the disk before this returns.
+bool WriteBinaryFile(const std::wstring& path, const void* data, size_t size, bool durable = false) {
+    const DWORD flags = durable ? FILE_ATTRIBUTE_NORMAL | FILE_FLAG_WRITE_THROUGH : FILE_ATTRIBUTE_NORMAL;
+    HANDLE h = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, flags, nullptr);
+    if (h == INVALID_HANDLE_VALUE) {
+        Err() << L"Cannot create '" << path << L"': " << LastErrorMessage() << L"\n";
         return false;
     }
 
-    memcpy(&plo.Attributes, buf.data(), sizeof(UINT32));
-    memcpy(&plo.FilePathListLength, buf.data() + sizeof(UINT32), sizeof(UINT16));
+    DWORD written = 0;
+    const bool ok = WriteFile(h, data, static_cast<DWORD>(size), &written, nullptr) && written == size &&
+                    (!durable || FlushFileBuffers(h));
+    if (!ok) {
+        Err() << L"Write '" << path << L"' failed: " << LastErrorMessage() << L"\n";
+    }
+    CloseHandle(h);
+    return ok;
+}
 
-    size_t offset = BOOT_OPTION_HEADER_SIZE;
-    size_t next = 0;
-    plo.Description = ReadUcs2String(buf, offset, next);
-    offset = next;
+// Writes text as UTF-8 (no BOM), replacing the file.
+bool WriteTextFile(const std::wstring& path, const std::wstring& text, bool durable = false) {
+    std::string utf8;
+    if (!text.empty()) {
+        const int n = WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), nullptr, 0, nullptr, nullptr);
+        utf8.resize(n);
+        WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), &utf8[0], n, nullptr, nullptr);
+    }
+    return WriteBinaryFile(path, utf8.data(), utf8.size(), durable);
+}
 
-    if (offset + plo.FilePathListLength > buf.size()) {
-        return false;
+// View of a whole file through a file mapping, read-only unless opened
+// writable. Empty files map to an empty view.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { Close(); }
+
+    bool Open(const std::wstring& path, bool writable = false) {
+        Close();
+        const DWORD access = writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+        file_ = CreateFileW(path.c_str(), access, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) {
+            Err() << L"Cannot open '" << path << L"': " << LastErrorMessage() << L"\n";
+            return false;
+        }
+
+        LARGE_INTEGER size = {};
+        if (!GetFileSizeEx(file_, &size)) {
+            Err() << L"Cannot size '" << path << L"': " << LastErrorMessage() << L"\n";
+            Close();
+            return false;
+        }
+        size_ = static_cast<size_t>(size.QuadPart);
+        if (size_ == 0) {
+            return true;
+        }
+
+        mapping_ = CreateFileMappingW(file_, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+        view_ = mapping_ ? static_cast<BYTE*>(MapViewOfFile(mapping_, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0)) : nullptr;
+        if (!view_) {
+            Err() << L"Cannot map '" << path << L"': " << LastErrorMessage() << L"\n";
+            Close();
+            return false;
+        }
+        writable_ = writable;
+        return true;
     }
 
-    plo.DevicePath.assign(buf.begin() + offset, buf.begin() + offset + plo.FilePathListLength);
-    offset += plo.FilePathListLength;
+    const BYTE* Data() const { return view_; }
+    BYTE* MutableData() const { return writable_ ? view_ : nullptr; }
+    size_t Size() const { return size_; }
 
-    if (offset <= buf.size()) {
-        plo.OptionalData.assign(buf.begin() + offset, buf.end());
+    // Pushes dirty pages of a writable view to disk.
+    bool Flush() const {
+        if (!writable_ || !view_) {
+            return true;
+        }
+        return FlushViewOfFile(view_, 0) && FlushFileBuffers(file_);
     }
 
-    return true;
-}
+private:
+    void Close() {
+        if (view_) {
+            UnmapViewOfFile(view_);
+            view_ = nullptr;
+        }
+        if (mapping_) {
+            CloseHandle(mapping_);
+            mapping_ = nullptr;
+        }
+        if (file_ != INVALID_HANDLE_VALUE) {
+            CloseHandle(file_);
+            file_ = INVALID_HANDLE_VALUE;
+        }
+        size_ = 0;
+        writable_ = false;
+    }
 
-std::vector<BYTE> BuildLoadOption(const ParsedLoadOption& plo) {
-    std::vector<BYTE> out;
-    out.reserve(
-        BOOT_OPTION_HEADER_SIZE +
-        (plo.Description.size() + 1) * sizeof(UINT16) +
-        plo.DevicePath.size() +
-        plo.OptionalData.size());
-
-    auto push32 = [&](UINT32 v) {
-        const size_t i = out.size();
-        out.resize(i + sizeof(UINT32));
-        memcpy(out.data() + i, &v, sizeof(UINT32));
-    };
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+    BYTE* view_ = nullptr;
+    size_t size_ = 0;
+    bool writable_ = false;
+};
 
-    auto push16 = [&](UINT16 v) {
-        const size_t i = out.size();
-        out.resize(i + sizeof(UINT16));
-        memcpy(out.data() + i, &v, sizeof(UINT16));
-    };
+// CRC-32 (IEEE 802.3, reflected), as used by zip and GPT.
+struct Crc32Table {
+    UINT32 Entries[256];
+};
 
-    push32(plo.Attributes);
-    push16(static_cast<UINT16>(plo.DevicePath.size()));
+constexpr Crc32Table MakeCrc32Table() {
+    Crc32Table t{};
+    for (UINT32 i = 0; i < 256; ++i) {
+        UINT32 c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        }
+        t.Entries[i] = c;
+    }
+    return t;
+}
 
-    // Description (UTF-16LE null-terminated)
-    for (wchar_t ch : plo.Description) {
-        push16(static_cast<UINT16>(ch));
+constexpr Crc32Table CRC32_TABLE = MakeCrc32Table();
+
+UINT32 Crc32(const BYTE* p, size_t n, UINT32 crc = 0) {
+    crc = ~crc;
+    for (size_t i = 0; i < n; ++i) {
+        crc = CRC32_TABLE.Entries[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
     }
-    push16(0);
+    return ~crc;
+}
 
-    out.insert(out.end(), plo.DevicePath.begin(), plo.DevicePath.end());
-    out.insert(out.end(), plo.OptionalData.begin(), plo.OptionalData.end());
+// XXH64 (xxHash, 64-bit). Fast and well distributed; used to spot changes,
+// not to resist tampering.
+constexpr UINT64 XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+constexpr UINT64 XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr UINT64 XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+constexpr UINT64 XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr UINT64 XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
 
-    return out;
+inline UINT64 Rotl64(UINT64 x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline UINT64 XxhRound(UINT64 acc, UINT64 input) {
+    return Rotl64(acc + input * XXH_PRIME64_2, 31) * XXH_PRIME64_1;
 }
 
-void PrintEntry(UINT16 id, size_t index, size_t total, const ParsedLoadOption& plo) {
-    std::wcout << L"\n[" << index << L"/" << total << L"] " << MakeBootVarName(id) << L"\n";
-    std::wcout << L"    Attributes: 0x" << std::hex << plo.Attributes << std::dec << L"\n";
-    std::wcout << L"      - Active: " << ((plo.Attributes & LOAD_OPTION_ACTIVE) ? L"yes" : L"no") << L"\n";
-    std::wcout << L"      - ForceReconnect: " << ((plo.Attributes & LOAD_OPTION_FORCE_RECONNECT) ? L"yes" : L"no") << L"\n";
-    std::wcout << L"      - Hidden: " << ((plo.Attributes & LOAD_OPTION_HIDDEN) ? L"yes" : L"no") << L"\n";
-    std::wcout << L"    Description: " << (plo.Description.empty() ? L"(none)" : plo.Description) << L"\n";
-    std::wcout << L"    DevicePath bytes: " << plo.DevicePath.size() << L"\n";
-    std::wcout << L"    DevicePath hex preview: " << HexPreview(plo.DevicePath.data(), plo.DevicePath.size()) << L"\n";
-    std::wcout << L"    OptionalData bytes: " << plo.OptionalData.size() << L"\n";
+inline UINT64 XxhMerge(UINT64 acc, UINT64 v) {
+    return (acc ^ XxhRound(0, v)) * XXH_PRIME64_1 + XXH_PRIME64_4;
 }
 
-// ----------------- Helpers -----------------
-std::vector<UINT16> GetBootOrder() {
-    DWORD attrs = 0;
-    const auto v = ReadEfiVar(L"BootOrder", attrs);
+UINT64 Xxh64(const BYTE* p, size_t n, UINT64 seed = 0) {
+    const BYTE* const end = p + n;
+    UINT64 lane = 0;
+    UINT32 word = 0;
+    UINT64 h = 0;
 
-    std::vector<UINT16> ids;
-    if (v.size() % sizeof(UINT16) != 0) {
-        return ids;
+    if (n >= 32) {
+        UINT64 v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        UINT64 v2 = seed + XXH_PRIME64_2;
+        UINT64 v3 = seed;
+        UINT64 v4 = seed - XXH_PRIME64_1;
+        for (; end - p >= 32; p += 32) {
+            memcpy(&lane, p, 8);
+            v1 = XxhRound(v1, lane);
+            memcpy(&lane, p + 8, 8);
+            v2 = XxhRound(v2, lane);
+            memcpy(&lane, p + 16, 8);
+            v3 = XxhRound(v3, lane);
+            memcpy(&lane, p + 24, 8);
+            v4 = XxhRound(v4, lane);
+        }
+        h = Rotl64(v1, 1) + Rotl64(v2, 7) + Rotl64(v3, 12) + Rotl64(v4, 18);
+        h = XxhMerge(h, v1);
+        h = XxhMerge(h, v2);
+        h = XxhMerge(h, v3);
+        h = XxhMerge(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
     }
 
-    ids.reserve(v.size() / sizeof(UINT16));
-    for (size_t i = 0; i < v.size(); i += sizeof(UINT16)) {
-        UINT16 id = 0;
-        memcpy(&id, v.data() + i, sizeof(UINT16));
-        ids.push_back(id);
+    h += n;
+    for (; end - p >= 8; p += 8) {
+        memcpy(&lane, p, 8);
+        h = Rotl64(h ^ XxhRound(0, lane), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (end - p >= 4) {
+        memcpy(&word, p, 4);
+        h = Rotl64(h ^ (word * XXH_PRIME64_1), 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h = Rotl64(h ^ (*p * XXH_PRIME64_5), 11) * XXH_PRIME64_1;
     }
 
-    return ids;
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
 }
 
-bool SetBootOrder(const std::vector<UINT16>& order) {
-    return WriteEfiVar(
-        L"BootOrder",
-        order.data(),
-        static_cast<DWORD>(order.size() * sizeof(UINT16)),
-        g_varAttrsRW);
+// ----------------- Timing -----------------
+LONGLONG QpcNow() {
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
 }
 
-bool ReadBootEntry(UINT16 id, ParsedLoadOption& plo, DWORD& attrsOut) {
-    const auto name = MakeBootVarName(id);
-    const auto data = ReadEfiVar(name, attrsOut);
-    if (data.empty()) {
-        return false;
-    }
-    return ParseLoadOption(data, plo);
+double QpcToMicros(LONGLONG ticks) {
+    static const LONGLONG freq = [] {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        return f.QuadPart;
+    }();
+    return static_cast<double>(ticks) * 1e6 / static_cast<double>(freq);
 }
 
-bool WriteBootEntry(UINT16 id, const ParsedLoadOption& plo) {
-    const auto name = MakeBootVarName(id);
-    const auto blob = BuildLoadOption(plo);
-    return WriteEfiVar(name, blob.data(), static_cast<DWORD>(blob.size()), g_varAttrsRW);
+// Sleeps for the bulk of long waits and spins for the rest, so replayed
+// latencies stay accurate down to a few microseconds.
+void SpinWaitMicros(double micros) {
+    const LONGLONG start = QpcNow();
+    if (micros > 2000.0) {
+        Sleep(static_cast<DWORD>((micros - 1000.0) / 1000.0));
+    }
+    while (QpcToMicros(QpcNow() - start) < micros) {
+        YieldProcessor();
+    }
 }
 
-// ----------------- Commands -----------------
-int cmd_list() {
-    DWORD attrs = 0;
-    const auto order = ReadEfiVar(L"BootOrder", attrs);
+// ----------------- Tracing -----------------
+// ETW provider "Booteja" {E1C5B0A3-6F2D-4B8E-9C71-3A5D2F08B6E4}; enable it in
+// WPR/xperf to see firmware calls next to kernel activity.
+TRACELOGGING_DEFINE_PROVIDER(g_etwProvider, "Booteja",
+    (0xe1c5b0a3, 0x6f2d, 0x4b8e, 0x9c, 0x71, 0x3a, 0x5d, 0x2f, 0x08, 0xb6, 0xe4));
 
-    if (order.empty() || (order.size() % sizeof(UINT16) != 0)) {
-        std::wcerr << L"Could not read BootOrder: " << LastErrorMessage() << L"\n";
-        return 1;
+enum class TracePhase {
+    Privilege,
+    Enumerate,
+    Read,
+    Write,
+    Output,
+    Count,
+};
+
+// Collects per-phase call counts and time for --trace. Calls are no-ops until
+// Enable(), so the instrumentation costs nothing in normal runs.
+class Tracer {
+public:
+    void Enable(bool logToStderr) {
+        enabled_ = true;
+        log_ = logToStderr;
+        start_ = QpcNow();
+        TraceLoggingRegister(g_etwProvider);
     }
 
-    const size_t n = order.size() / sizeof(UINT16);
+    bool Enabled() const { return enabled_; }
 
-    auto showU16 = [&](const std::wstring& varName) {
-        DWORD varAttrs = 0;
-        const auto value = ReadEfiVar(varName, varAttrs);
-        if (value.size() < sizeof(UINT16)) {
+    void Record(TracePhase phase, double micros) {
+        if (!enabled_) {
             return;
         }
+        ++calls_[static_cast<size_t>(phase)];
+        micros_[static_cast<size_t>(phase)] += micros;
+    }
 
-        UINT16 id = 0;
-        memcpy(&id, value.data(), sizeof(UINT16));
-        std::wcout << varName << L": " << MakeBootVarName(id) << L"\n";
-    };
+    void FirmwareCall(TracePhase phase, const wchar_t* name, const wchar_t* guid,
+                      DWORD bytes, DWORD attrs, double micros, DWORD error) {
+        if (!enabled_) {
+            return;
+        }
 
-    showU16(L"BootCurrent");
-    showU16(L"BootNext");
+        Record(phase, micros);
 
-    for (size_t i = 0; i < n; ++i) {
-        UINT16 id = 0;
-        memcpy(&id, order.data() + i * sizeof(UINT16), sizeof(UINT16));
+        TraceLoggingWrite(g_etwProvider, "FirmwareCall",
+            TraceLoggingWideString(PhaseName(phase), "Op"),
+            TraceLoggingWideString(name, "Name"),
+            TraceLoggingWideString(guid, "VendorGuid"),
+            TraceLoggingUInt32(bytes, "Bytes"),
+            TraceLoggingHexUInt32(attrs, "Attributes"),
+            TraceLoggingFloat64(micros, "DurationUs"),
+            TraceLoggingUInt32(error, "Error"));
 
-        ParsedLoadOption plo;
-        DWORD entryAttrs = 0;
-        if (ReadBootEntry(id, plo, entryAttrs)) {
-            PrintEntry(id, i + 1, n, plo);
-        } else {
-            std::wcout << L"\n[" << i + 1 << L"/" << n << L"] " << MakeBootVarName(id) << L": (unreadable)\n";
+        if (log_) {
+            Err() << std::fixed << std::setprecision(1)
+                       << L"[trace] " << std::left << std::setw(9) << PhaseName(phase) << std::right
+                       << L" " << name
+                       << L" bytes=" << bytes
+                       << L" attrs=0x" << std::hex << attrs << std::dec
+                       << L" " << micros << L" us";
+            if (error != ERROR_SUCCESS) {
+                Err() << L" error=" << error;
+            }
+            Err() << L"\n";
+            Err().unsetf(std::ios::floatfield);
         }
     }
 
-    return 0;
-}
+    // Prints the per-phase totals and closes the ETW session.
+    void Summary() {
+        if (!enabled_) {
+            return;
+        }
 
-int cmd_order_show() {
-    const auto order = GetBootOrder();
-    if (order.empty()) {
-        std::wcerr << L"BootOrder empty: " << LastErrorMessage() << L"\n";
-        return 1;
+        const double wall = QpcToMicros(QpcNow() - start_);
+
+        for (size_t i = 0; i < static_cast<size_t>(TracePhase::Count); ++i) {
+            const auto phase = static_cast<TracePhase>(i);
+            TraceLoggingWrite(g_etwProvider, "PhaseSummary",
+                TraceLoggingWideString(PhaseName(phase), "Phase"),
+                TraceLoggingUInt32(static_cast<UINT32>(calls_[i]), "Calls"),
+                TraceLoggingFloat64(micros_[i], "TotalUs"));
+
+            if (log_) {
+                Err() << std::fixed << std::setprecision(3)
+                           << L"[trace] " << std::left << std::setw(9) << PhaseName(phase) << std::right
+                           << std::setw(6) << calls_[i] << L" call(s) "
+                           << std::setw(10) << micros_[i] / 1000.0 << L" ms\n";
+            }
+        }
+
+        if (log_) {
+            Err() << L"[trace] " << std::left << std::setw(9) << L"wall" << std::right
+                       << std::setw(24) << wall / 1000.0 << L" ms\n";
+            Err().unsetf(std::ios::floatfield);
+        }
+
+        TraceLoggingUnregister(g_etwProvider);
+        enabled_ = false;
     }
 
-    std::wcout << L"BootOrder (" << order.size() << L"):";
-    for (const auto id : order) {
-        std::wcout << L" " << MakeBootVarName(id);
+private:
+    static const wchar_t* PhaseName(TracePhase phase) {
+        switch (phase) {
+        case TracePhase::Privilege: return L"privilege";
+        case TracePhase::Enumerate: return L"enumerate";
+        case TracePhase::Read: return L"read";
+        case TracePhase::Write: return L"write";
+        case TracePhase::Output: return L"output";
+        default: return L"?";
+        }
     }
-    std::wcout << L"\n";
 
-    return 0;
-}
+    bool enabled_ = false;
+    bool log_ = false;
+    LONGLONG start_ = 0;
+    size_t calls_[static_cast<size_t>(TracePhase::Count)] = {};
+    double micros_[static_cast<size_t>(TracePhase::Count)] = {};
+};
 
-int cmd_order_set(const std::wstring& csv) {
-    std::vector<UINT16> newOrder;
-    std::wstringstream ss(csv);
-    std::wstring token;
+static Tracer g_trace;
 
-    while (std::getline(ss, token, L',')) {
-        token.erase(std::remove_if(token.begin(), token.end(), [](wchar_t ch) { return std::iswspace(ch) != 0; }), token.end());
+// Forwards to another stream buffer and charges the time to the output phase,
+// so console cost shows up separately from firmware cost.
+class TimedWideStreamBuf : public std::wstreambuf {
+public:
+    explicit TimedWideStreamBuf(std::wstreambuf* inner) : inner_(inner) {}
 
-        UINT16 id = 0;
-        if (!ParseBootId(token, id)) {
-            std::wcerr << L"Bad id: " << token << L"\n";
-            return 2;
+protected:
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof())) {
+            return traits_type::not_eof(ch);
         }
-
-        newOrder.push_back(id);
+        const LONGLONG start = QpcNow();
+        const int_type r = inner_->sputc(traits_type::to_char_type(ch));
+        g_trace.Record(TracePhase::Output, QpcToMicros(QpcNow() - start));
+        return r;
     }
 
-    if (newOrder.empty()) {
-        std::wcerr << L"No IDs provided.\n";
-        return 2;
+    std::streamsize xsputn(const wchar_t* s, std::streamsize n) override {
+        const LONGLONG start = QpcNow();
+        const std::streamsize r = inner_->sputn(s, n);
+        g_trace.Record(TracePhase::Output, QpcToMicros(QpcNow() - start));
+        return r;
     }
 
-    if (!SetBootOrder(newOrder)) {
-        return 3;
+    int sync() override {
+        const LONGLONG start = QpcNow();
+        const int r = inner_->pubsync();
+        g_trace.Record(TracePhase::Output, QpcToMicros(QpcNow() - start));
+        return r;
     }
 
-    std::wcout << L"BootOrder updated.\n";
-    return 0;
-}
+private:
+    std::wstreambuf* inner_;
+};
 
-int cmd_select(const std::wstring& idhex) {
-    auto order = GetBootOrder();
-    if (order.empty()) {
-        return 1;
-    }
+// ----------------- Variable backends -----------------
+// NtEnumerateSystemEnvironmentValuesEx is exported by ntdll but not declared in
+// the SDK headers. With the value information class it returns every variable
+// (name, vendor GUID, attributes and data) in a single call, which lets us
+// replace one firmware transition per variable with one per command.
+constexpr ULONG SYSTEM_ENVIRONMENT_VALUE_INFORMATION = 2;
+constexpr NTSTATUS STATUS_SUCCESS_VALUE = 0;
+constexpr NTSTATUS STATUS_BUFFER_TOO_SMALL_VALUE = static_cast<NTSTATUS>(0xC0000023L);
+constexpr ULONG DEFAULT_EFI_ENUM_BUFFER_SIZE = 64 * 1024;
 
-    UINT16 target = 0;
-    if (!ParseBootId(idhex, target)) {
-        std::wcerr << L"Bad id.\n";
-        return 2;
-    }
+typedef NTSTATUS(NTAPI* NtEnumerateSystemEnvironmentValuesExFn)(ULONG, PVOID, PULONG);
 
-    auto it = std::find(order.begin(), order.end(), target);
-    if (it == order.end()) {
-        std::wcerr << L"ID not found in BootOrder.\n";
-        return 3;
-    }
+// Fixed part of VARIABLE_NAME_AND_VALUE; the NUL-terminated name follows it and
+// the data sits at ValueOffset, both relative to the start of the entry.
+struct VariableNameAndValueHeader {
+    ULONG NextEntryOffset;
+    ULONG ValueOffset;
+    ULONG ValueLength;
+    ULONG Attributes;
+    GUID VendorGuid;
+};
 
-    std::rotate(order.begin(), it, it + 1); // bring to front
-    if (!SetBootOrder(order)) {
-        return 4;
-    }
+struct EfiVariable {
+    std::wstring Guid;    // "{...}" form, as taken by the Win32 firmware APIs
+    std::wstring Name;
+    DWORD Attributes = 0;
+    std::vector<BYTE> Data;
+};
 
-    std::wcout << L"Default boot set to " << MakeBootVarName(target) << L".\n";
-    return 0;
+// Variables are keyed by vendor GUID plus name; GUID text is case-insensitive.
+// Fills key in place so callers that keep the string around probe without
+// allocating once its capacity has grown.
+void AssignEfiVarKey(std::wstring& key, const wchar_t* guid, const wchar_t* name) {
+    key.assign(guid);
+    std::transform(key.begin(), key.end(), key.begin(), ::towupper);
+    key.append(name);
 }
 
-int cmd_next(const std::wstring& idhex) {
-    UINT16 target = 0;
+std::wstring MakeEfiVarKey(const wchar_t* guid, const std::wstring& name) {
+    std::wstring key;
+    AssignEfiVarKey(key, guid, name.c_str());
+    return key;
+}
+
+void ParseVariableEnumeration(const BYTE* base, size_t length, std::vector<EfiVariable>& vars) {
+    size_t offset = 0;
+
+    while (offset + sizeof(VariableNameAndValueHeader) <= length) {
+        VariableNameAndValueHeader hdr{};
+        memcpy(&hdr, base + offset, sizeof(hdr));
+
+        const size_t entryEnd = hdr.NextEntryOffset ? offset + hdr.NextEntryOffset : length;
+        const size_t nameStart = offset + sizeof(VariableNameAndValueHeader);
+        const size_t valueStart = offset + hdr.ValueOffset;
+
+        if (entryEnd > length || valueStart < nameStart || valueStart + hdr.ValueLength > length) {
+            break;
+        }
+
+        EfiVariable v;
+        v.Guid = FormatGuid(hdr.VendorGuid);
+        v.Attributes = hdr.Attributes;
+
+        for (size_t i = nameStart; i + 1 < valueStart; i += sizeof(UINT16)) {
+            const wchar_t ch = static_cast<wchar_t>(base[i] | (base[i + 1] << 8));
+            if (ch == L'\0') {
+                break;
+            }
+            v.Name.push_back(ch);
+        }
+
+        v.Data.assign(base + valueStart, base + valueStart + hdr.ValueLength);
+        vars.push_back(std::move(v));
+
+        if (hdr.NextEntryOffset == 0) {
+            break;
+        }
+        offset = entryEnd;
+    }
+}
+
+// Everything that touches variable storage goes through this interface. Read
+// and Write follow the GetFirmwareEnvironmentVariableExW /
+// SetFirmwareEnvironmentVariableExW contracts, including SetLastError codes.
+class EfiVarBackend {
+public:
+    virtual ~EfiVarBackend() = default;
+
+    // Returns false when the backend cannot list its variables in one call.
+    virtual bool Enumerate(std::vector<EfiVariable>& vars) = 0;
+    virtual DWORD Read(const wchar_t* name, const wchar_t* guid, void* buf, DWORD size, DWORD* attrs) = 0;
+    virtual bool Write(const wchar_t* name, const wchar_t* guid, const void* data, DWORD size, DWORD attrs) = 0;
+};
+
+// Taken on the first firmware call rather than at startup, so help, offline
+// backends and file-only commands never touch the process token.
+void EnsureSystemEnvironmentPrivilege() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        const DWORD err = GetLastError();
+        const LONGLONG start = QpcNow();
+        const bool ok = EnableSystemEnvironmentPrivilege();
+        g_trace.Record(TracePhase::Privilege, QpcToMicros(QpcNow() - start));
+        if (!ok) {
+            Err() << L"Warning: Could not enable SeSystemEnvironmentPrivilege. Run elevated on a UEFI system.\n";
+        }
+        SetLastError(err);
+    });
+}
+
+// The real firmware, through the Win32 and ntdll APIs.
+class Win32EfiBackend : public EfiVarBackend {
+public:
+    bool Enumerate(std::vector<EfiVariable>& vars) override {
+        EnsureSystemEnvironmentPrivilege();
+        const HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+        const auto enumerate = ntdll
+            ? reinterpret_cast<NtEnumerateSystemEnvironmentValuesExFn>(
+                  GetProcAddress(ntdll, "NtEnumerateSystemEnvironmentValuesEx"))
+            : nullptr;
+        if (!enumerate) {
+            return false;
+        }
+
+        std::vector<BYTE> buf(DEFAULT_EFI_ENUM_BUFFER_SIZE);
+        NTSTATUS status = STATUS_BUFFER_TOO_SMALL_VALUE;
+        ULONG length = 0;
+
+        // The store can grow between the size report and the retry, so allow a
+        // couple of rounds before giving up.
+        for (int attempt = 0; attempt < 3; ++attempt) {
+            length = static_cast<ULONG>(buf.size());
+            status = enumerate(SYSTEM_ENVIRONMENT_VALUE_INFORMATION, buf.data(), &length);
+            if (status != STATUS_BUFFER_TOO_SMALL_VALUE) {
+                break;
+            }
+            buf.resize(std::max<size_t>(length, buf.size() * 2));
+        }
+
+        if (status != STATUS_SUCCESS_VALUE) {
+            return false;
+        }
+
+        ParseVariableEnumeration(buf.data(), std::min<size_t>(length, buf.size()), vars);
+        return true;
+    }
+
+    DWORD Read(const wchar_t* name, const wchar_t* guid, void* buf, DWORD size, DWORD* attrs) override {
+        EnsureSystemEnvironmentPrivilege();
+        return GetFirmwareEnvironmentVariableExW(name, guid, buf, size, attrs);
+    }
+
+    bool Write(const wchar_t* name, const wchar_t* guid, const void* data, DWORD size, DWORD attrs) override {
+        EnsureSystemEnvironmentPrivilege();
+        return SetFirmwareEnvironmentVariableExW(name, guid, const_cast<PVOID>(data), size, attrs) != FALSE;
+    }
+};
+
+// A variable store held entirely in memory.
+class MemoryEfiBackend : public EfiVarBackend {
+public:
+    void Put(const EfiVariable& v) {
+        const auto key = MakeEfiVarKey(v.Guid.c_str(), v.Name);
+        if (store_.find(key) == store_.end()) {
+            order_.push_back(key);
+        }
+        store_[key] = v;
+    }
+
+    bool Enumerate(std::vector<EfiVariable>& vars) override {
+        for (const auto& key : order_) {
+            vars.push_back(store_[key]);
+        }
+        return true;
+    }
+
+    DWORD Read(const wchar_t* name, const wchar_t* guid, void* buf, DWORD size, DWORD* attrs) override {
+        const auto it = store_.find(MakeEfiVarKey(guid, name));
+        if (it == store_.end()) {
+            SetLastError(ERROR_ENVVAR_NOT_FOUND);
+            return 0;
+        }
+
+        const auto& data = it->second.Data;
+        if (data.size() > size || !buf) {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return 0;
+        }
+
+        memcpy(buf, data.data(), data.size());
+        if (attrs) {
+            *attrs = it->second.Attributes;
+        }
+        return static_cast<DWORD>(data.size());
+    }
+
+    bool Write(const wchar_t* name, const wchar_t* guid, const void* data, DWORD size, DWORD attrs) override {
+        const auto key = MakeEfiVarKey(guid, name);
+
+        if (size == 0) {
+            if (store_.erase(key) == 0) {
+                SetLastError(ERROR_ENVVAR_NOT_FOUND);
+                return false;
+            }
+            order_.erase(std::remove(order_.begin(), order_.end(), key), order_.end());
+            return true;
+        }
+
+        EfiVariable v;
+        v.Guid = guid;
+        v.Name = name;
+        v.Attributes = attrs;
+        v.Data.assign(static_cast<const BYTE*>(data), static_cast<const BYTE*>(data) + size);
+        Put(v);
+        return true;
+    }
+
+private:
+    std::unordered_map<std::wstring, EfiVariable> store_;
+    std::vector<std::wstring> order_;    // enumeration order, as first seen
+};
+
+// Per-call latency observed for one variable, in microseconds.
+struct CallLatency {
+    double ReadMicros = 0;
+    double WriteMicros = 0;
+};
+
+constexpr const wchar_t* CAPTURE_MAGIC = L"booteja-capture 1";
+
+// Passes everything through to another backend while recording the variable
+// set and how long each call took, so a slow machine can be replayed offline.
+// Capture file (UTF-8, one record per line):
+//   booteja-capture 1
+//   enum <micros>
+//   var <guid> <attrs-hex> <read-micros> <write-micros> <data-hex|-> <name>
+class RecordingEfiBackend : public EfiVarBackend {
+public:
+    explicit RecordingEfiBackend(EfiVarBackend& inner) : inner_(inner) {}
+
+    bool Enumerate(std::vector<EfiVariable>& vars) override {
+        const size_t first = vars.size();
+        const LONGLONG start = QpcNow();
+        const bool ok = inner_.Enumerate(vars);
+        enumMicros_ = QpcToMicros(QpcNow() - start);
+
+        for (size_t i = first; ok && i < vars.size(); ++i) {
+            Remember(vars[i]);
+        }
+        return ok;
+    }
+
+    DWORD Read(const wchar_t* name, const wchar_t* guid, void* buf, DWORD size, DWORD* attrs) override {
+        DWORD gotAttrs = 0;
+        const LONGLONG start = QpcNow();
+        const DWORD read = inner_.Read(name, guid, buf, size, &gotAttrs);
+        const double micros = QpcToMicros(QpcNow() - start);
+        const DWORD err = GetLastError();
+
+        if (read > 0) {
+            EfiVariable v;
+            v.Guid = guid;
+            v.Name = name;
+            v.Attributes = gotAttrs;
+            v.Data.assign(static_cast<const BYTE*>(buf), static_cast<const BYTE*>(buf) + read);
+            Remember(v);
+            latency_[MakeEfiVarKey(guid, name)].ReadMicros = micros;
+        }
+
+        if (attrs) {
+            *attrs = gotAttrs;
+        }
+        SetLastError(err);
+        return read;
+    }
+
+    bool Write(const wchar_t* name, const wchar_t* guid, const void* data, DWORD size, DWORD attrs) override {
+        const LONGLONG start = QpcNow();
+        const bool ok = inner_.Write(name, guid, data, size, attrs);
+        latency_[MakeEfiVarKey(guid, name)].WriteMicros = QpcToMicros(QpcNow() - start);
+        return ok;
+    }
+
+    const std::vector<EfiVariable>& Variables() const { return vars_; }
+
+    bool Save(const std::wstring& path) const {
+        std::wstringstream ss;
+        ss << CAPTURE_MAGIC << L"\n";
+        ss << L"enum " << enumMicros_ << L"\n";
+
+        for (const auto& v : vars_) {
+            const auto it = latency_.find(MakeEfiVarKey(v.Guid.c_str(), v.Name));
+            const CallLatency lat = it == latency_.end() ? CallLatency{} : it->second;
+            ss << L"var " << v.Guid
+               << L" " << std::hex << v.Attributes << std::dec
+               << L" " << lat.ReadMicros
+               << L" " << lat.WriteMicros
+               << L" " << (v.Data.empty() ? std::wstring(L"-") : ToHex(v.Data.data(), v.Data.size()))
+               << L" " << v.Name << L"\n";
+        }
+
+        return WriteTextFile(path, ss.str());
+    }
+
+private:
+    void Remember(const EfiVariable& v) {
+        const auto key = MakeEfiVarKey(v.Guid.c_str(), v.Name);
+        const auto it = index_.find(key);
+        if (it == index_.end()) {
+            index_[key] = vars_.size();
+            vars_.push_back(v);
+        } else {
+            vars_[it->second] = v;
+        }
+    }
+
+    EfiVarBackend& inner_;
+    double enumMicros_ = 0;
+    std::vector<EfiVariable> vars_;
+    std::unordered_map<std::wstring, size_t> index_;
+    std::unordered_map<std::wstring, CallLatency> latency_;
+};
+
+// Serves a capture from memory, optionally waiting as long as the captured
+// machine took for each call. Writes only change the in-memory copy.
+class ReplayEfiBackend : public MemoryEfiBackend {
+public:
+    bool Load(const std::wstring& path, bool withLatency) {
+        withLatency_ = withLatency;
+
+        std::wstring text;
+        if (!ReadTextFile(path, text)) {
+            return false;
+        }
+
+        std::wstringstream lines(text);
+        std::wstring line;
+        if (!std::getline(lines, line) || line.compare(0, wcslen(CAPTURE_MAGIC), CAPTURE_MAGIC) != 0) {
+            Err() << L"'" << path << L"' is not a booteja capture.\n";
+            return false;
+        }
+
+        double readTotal = 0;
+        size_t readCount = 0;
+
+        while (std::getline(lines, line)) {
+            if (!line.empty() && line.back() == L'\r') {
+                line.pop_back();
+            }
+
+            std::wstringstream ls(line);
+            std::wstring tag;
+            ls >> tag;
+
+            if (tag == L"enum") {
+                ls >> enumMicros_;
+                continue;
+            }
+            if (tag != L"var") {
+                continue;
+            }
+
+            EfiVariable v;
+            CallLatency lat;
+            std::wstring hex;
+            ls >> v.Guid >> std::hex >> v.Attributes >> std::dec >> lat.ReadMicros >> lat.WriteMicros >> hex;
+            if (ls) {
+                ls.get();    // single separator before the name
+                std::getline(ls, v.Name);
+            }
+
+            if (v.Name.empty() || (hex != L"-" && !FromHex(hex, v.Data))) {
+                Err() << L"Skipping malformed capture line: " << line << L"\n";
+                continue;
+            }
+
+            if (lat.ReadMicros > 0) {
+                readTotal += lat.ReadMicros;
+                ++readCount;
+            }
+            latency_[MakeEfiVarKey(v.Guid.c_str(), v.Name)] = lat;
+            Put(v);
+        }
+
+        // Variables that were only seen through enumeration cost a typical read.
+        defaultReadMicros_ = readCount ? readTotal / readCount : 0;
+        return true;
+    }
+
+    bool Enumerate(std::vector<EfiVariable>& vars) override {
+        Wait(enumMicros_);
+        return MemoryEfiBackend::Enumerate(vars);
+    }
+
+    DWORD Read(const wchar_t* name, const wchar_t* guid, void* buf, DWORD size, DWORD* attrs) override {
+        const auto it = latency_.find(MakeEfiVarKey(guid, name));
+        Wait(it != latency_.end() && it->second.ReadMicros > 0 ? it->second.ReadMicros : defaultReadMicros_);
+        return MemoryEfiBackend::Read(name, guid, buf, size, attrs);
+    }
+
+    bool Write(const wchar_t* name, const wchar_t* guid, const void* data, DWORD size, DWORD attrs) override {
+        const auto it = latency_.find(MakeEfiVarKey(guid, name));
+        // Without a recorded write, assume it costs at least as much as a read.
+        Wait(it != latency_.end() && it->second.WriteMicros > 0 ? it->second.WriteMicros : defaultReadMicros_);
+        return MemoryEfiBackend::Write(name, guid, data, size, attrs);
+    }
+
+private:
+    void Wait(double micros) const {
+        const DWORD err = GetLastError();
+        if (withLatency_ && micros > 0) {
+            SpinWaitMicros(micros);
+        }
+        SetLastError(err);
+    }
+
+    bool withLatency_ = true;
+    double enumMicros_ = 0;
+    double defaultReadMicros_ = 0;
+    std::unordered_map<std::wstring, CallLatency> latency_;
+};
+
+// Logs every call of another backend to the tracer (--trace).
+class TracingEfiBackend : public EfiVarBackend {
+public:
+    explicit TracingEfiBackend(EfiVarBackend& inner) : inner_(inner) {}
+
+    bool Enumerate(std::vector<EfiVariable>& vars) override {
+        const size_t first = vars.size();
+        const LONGLONG start = QpcNow();
+        const bool ok = inner_.Enumerate(vars);
+        const double micros = QpcToMicros(QpcNow() - start);
+        const DWORD err = ok ? ERROR_SUCCESS : GetLastError();
+
+        DWORD bytes = 0;
+        for (size_t i = first; i < vars.size(); ++i) {
+            bytes += static_cast<DWORD>(vars[i].Data.size());
+        }
+        g_trace.FirmwareCall(TracePhase::Enumerate, L"(all)", L"", bytes, 0, micros, err);
+        SetLastError(err);
+        return ok;
+    }
+
+    DWORD Read(const wchar_t* name, const wchar_t* guid, void* buf, DWORD size, DWORD* attrs) override {
+        DWORD gotAttrs = 0;
+        const LONGLONG start = QpcNow();
+        const DWORD read = inner_.Read(name, guid, buf, size, &gotAttrs);
+        const double micros = QpcToMicros(QpcNow() - start);
+        const DWORD err = read ? ERROR_SUCCESS : GetLastError();
+
+        g_trace.FirmwareCall(TracePhase::Read, name, guid, read, gotAttrs, micros, err);
+        if (attrs) {
+            *attrs = gotAttrs;
+        }
+        SetLastError(err);
+        return read;
+    }
+
+    bool Write(const wchar_t* name, const wchar_t* guid, const void* data, DWORD size, DWORD attrs) override {
+        const LONGLONG start = QpcNow();
+        const bool ok = inner_.Write(name, guid, data, size, attrs);
+        const double micros = QpcToMicros(QpcNow() - start);
+        const DWORD err = ok ? ERROR_SUCCESS : GetLastError();
+
+        g_trace.FirmwareCall(TracePhase::Write, name, guid, size, attrs, micros, err);
+        SetLastError(err);
+        return ok;
+    }
+
+private:
+    EfiVarBackend& inner_;
+};
+
+static Win32EfiBackend g_win32Backend;
+// Per thread, like the snapshot and transaction below, so --images workers
+// each run against their own store.
+thread_local EfiVarBackend* g_backend = &g_win32Backend;
+
+// ----------------- Firmware snapshot -----------------
+class FirmwareSnapshot {
+public:
+    // Pulls the full variable set in one enumeration call. Returns false when
+    // enumeration is unavailable (old OS, missing privilege); callers then fall
+    // back to per-variable reads.
+    bool Load() {
+        attempted_ = true;
+        loaded_ = false;
+        vars_.clear();
+        index_.clear();
+
+        if (!g_backend->Enumerate(vars_)) {
+            vars_.clear();
+            return false;
+        }
+
+        for (size_t i = 0; i < vars_.size(); ++i) {
+            index_[MakeEfiVarKey(vars_[i].Guid.c_str(), vars_[i].Name)] = i;
+        }
+        loaded_ = true;
+        return true;
+    }
+
+    bool Attempted() const { return attempted_; }
+    bool IsLoaded() const { return loaded_; }
+
+    const EfiVariable* Find(const wchar_t* name, const wchar_t* guid = EFI_GLOBAL_VARIABLE_GUID) const {
+        AssignEfiVarKey(probe_, guid, name);
+        const auto it = index_.find(probe_);
+        return it == index_.end() ? nullptr : &vars_[it->second];
+    }
+
+    // Keeps the snapshot coherent with our own writes; size 0 means deletion.
+    void Update(const std::wstring& name, const wchar_t* guid, const void* data, DWORD size, DWORD attrs) {
+        if (!loaded_) {
+            return;
+        }
+
+        const auto key = MakeEfiVarKey(guid, name);
+        auto it = index_.find(key);
+
+        if (size == 0) {
+            if (it != index_.end()) {
+                const size_t pos = it->second;
+                index_.erase(it);
+                if (pos != vars_.size() - 1) {
+                    vars_[pos] = std::move(vars_.back());
+                    index_[MakeEfiVarKey(vars_[pos].Guid.c_str(), vars_[pos].Name)] = pos;
+                }
+                vars_.pop_back();
+            }
+            return;
+        }
+
+        if (it == index_.end()) {
+            EfiVariable v;
+            v.Guid = guid;
+            v.Name = name;
+            vars_.push_back(std::move(v));
+            it = index_.emplace(key, vars_.size() - 1).first;
+        }
+
+        EfiVariable& v = vars_[it->second];
+        v.Attributes = attrs;
+        v.Data.assign(static_cast<const BYTE*>(data), static_cast<const BYTE*>(data) + size);
+    }
+
+    const std::vector<EfiVariable>& Variables() const { return vars_; }
+
+private:
+    bool attempted_ = false;
+    bool loaded_ = false;
+    std::vector<EfiVariable> vars_;
+    std::unordered_map<std::wstring, size_t> index_;
+    mutable std::wstring probe_;
+};
+
+thread_local FirmwareSnapshot g_snapshot;
+
+// Direct reads go into one per-thread buffer so the common case costs a
+// single firmware call; the buffer only grows when a variable does not fit.
+// Sizes seen per variable are kept as hints for later reads of the same name.
+constexpr DWORD MAX_EFI_READ_BUFFER_SIZE = 1024 * 1024;
+
+thread_local std::vector<BYTE> g_readBuffer;
+thread_local std::unordered_map<std::wstring, DWORD> g_readSizeHints;
+
+std::vector<BYTE> ReadEfiVarDirect(const std::wstring& name, DWORD& attrsOut,
+                                   const wchar_t* guid = EFI_GLOBAL_VARIABLE_GUID) {
+    const auto key = MakeEfiVarKey(guid, name);
+    DWORD wanted = DEFAULT_EFI_READ_BUFFER_SIZE;
+    const auto hint = g_readSizeHints.find(key);
+    if (hint != g_readSizeHints.end()) {
+        wanted = std::max(wanted, hint->second);
+    }
+
+    if (g_readBuffer.size() < wanted) {
+        g_readBuffer.resize(wanted);
+    }
+
+    DWORD gotAttrs = 0;
+    DWORD read = g_backend->Read(
+        name.c_str(), guid, g_readBuffer.data(),
+        static_cast<DWORD>(g_readBuffer.size()), &gotAttrs);
+
+    // The API does not report the needed size, so grow geometrically.
+    while (read == 0 && GetLastError() == ERROR_INSUFFICIENT_BUFFER &&
+           g_readBuffer.size() < MAX_EFI_READ_BUFFER_SIZE) {
+        g_readBuffer.resize(g_readBuffer.size() * 2);
+        read = g_backend->Read(
+            name.c_str(), guid, g_readBuffer.data(),
+            static_cast<DWORD>(g_readBuffer.size()), &gotAttrs);
+    }
+
+    if (read == 0) {
+        return {};
+    }
+
+    g_readSizeHints[key] = read;
+    attrsOut = gotAttrs;
+    return std::vector<BYTE>(g_readBuffer.begin(), g_readBuffer.begin() + read);
+}
+
+// Serves reads from the snapshot, loading it on first use. Variables missing
+// from a loaded snapshot do not exist, so no firmware call is made for them.
+std::vector<BYTE> ReadEfiVarStored(const std::wstring& name, DWORD& attrsOut,
+                                   const wchar_t* guid = EFI_GLOBAL_VARIABLE_GUID) {
+    if (!g_snapshot.Attempted()) {
+        g_snapshot.Load();
+    }
+
+    if (!g_snapshot.IsLoaded()) {
+        return ReadEfiVarDirect(name, attrsOut, guid);
+    }
+
+    const EfiVariable* v = g_snapshot.Find(name.c_str(), guid);
+    if (!v) {
+        SetLastError(ERROR_ENVVAR_NOT_FOUND);
+        return {};
+    }
+
+    attrsOut = v->Attributes;
+    return v->Data;
+}
+
+bool SameEfiValue(const std::vector<BYTE>& current, DWORD curAttrs, const void* data, DWORD size, DWORD attrs) {
+    if (size == 0) {
+        return current.empty();
+    }
+    return curAttrs == attrs && current.size() == size && memcmp(current.data(), data, size) == 0;
+}
+
+// Compares against the stored bytes first and skips the write when nothing
+// would change, so idempotent edits cost no NVRAM flash cycle.
+WriteResult WriteEfiVarStored(const std::wstring& name, const void* data, DWORD size, DWORD attrs) {
+    DWORD curAttrs = 0;
+    const auto current = ReadEfiVarStored(name, curAttrs);
+    if (SameEfiValue(current, curAttrs, data, size, attrs)) {
+        return WriteResult::Unchanged;
+    }
+
+    if (!g_backend->Write(name.c_str(), EFI_GLOBAL_VARIABLE_GUID, data, size, attrs)) {
+        Err() << L"Write '" << name << L"' failed: " << LastErrorMessage() << L"\n";
+        return WriteResult::Failed;
+    }
+    g_snapshot.Update(name, EFI_GLOBAL_VARIABLE_GUID, data, size, attrs);
+    return WriteResult::Written;
+}
+
+// ----------------- Commit journal -----------------
+// Before a commit touches the firmware it records the old and new value of
+// every variable it is about to change:
+//   booteja-journal 1
+//   var <old attrs> <old hex|-> <new attrs> <new hex|-> <name>
+//   ...
+//   end
+// The file is written through to disk and renamed into place, so it is either
+// absent or complete. One left behind means a commit was cut off, and the next
+// run puts the old values back before it does anything else.
+constexpr const wchar_t* JOURNAL_MAGIC = L"booteja-journal 1";
+// Owned by Administrators, protected DACL for Administrators and SYSTEM only.
+constexpr const wchar_t* JOURNAL_DIR_SDDL = L"O:BAD:P(A;OICI;GA;;;BA)(A;OICI;GA;;;SY)";
+
+// Empty unless the real firmware is in use: replayed and file-backed stores
+// have nothing to recover after a crash.
+static std::wstring g_journalPath;
+
+struct JournalRecord {
+    std::wstring Name;
+    DWORD OldAttributes = 0;
+    std::vector<BYTE> OldData;    // empty means the variable did not exist
+    DWORD NewAttributes = 0;
+    std::vector<BYTE> NewData;    // empty means delete
+};
+
+std::wstring DefaultJournalPath() {
+    wchar_t base[MAX_PATH];
+    const DWORD n = GetEnvironmentVariableW(L"ProgramData", base, MAX_PATH);
+    if (n == 0 || n >= MAX_PATH) {
+        return {};
+    }
+    return std::wstring(base) + L"\\Booteja\\journal.txt";
+}
+
+bool JournalExists() {
+    return !g_journalPath.empty() && GetFileAttributesW(g_journalPath.c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+std::wstring JournalDirectory() {
+    return g_journalPath.substr(0, g_journalPath.find_last_of(L'\\'));
+}
+
+// True when the object is owned by Administrators or SYSTEM and its DACL
+// allows no one else. The directory's DACL must also be protected, since
+// ProgramData's inheritable entries let users create and own subfolders.
+bool AdminOnlySecurity(HANDLE h, bool requireProtected) {
+    PSID owner = nullptr;
+    PACL dacl = nullptr;
+    PSECURITY_DESCRIPTOR sd = nullptr;
+    if (GetSecurityInfo(h, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION,
+                        &owner, nullptr, &dacl, nullptr, &sd) != ERROR_SUCCESS) {
+        return false;
+    }
+
+    auto adminOrSystem = [](PSID sid) {
+        return IsWellKnownSid(sid, WinBuiltinAdministratorsSid) || IsWellKnownSid(sid, WinLocalSystemSid);
+    };
+    SECURITY_DESCRIPTOR_CONTROL control = 0;
+    DWORD revision = 0;
+    bool trusted = adminOrSystem(owner) && dacl != nullptr &&
+                   GetSecurityDescriptorControl(sd, &control, &revision) &&
+                   (!requireProtected || (control & SE_DACL_PROTECTED) != 0);
+    for (DWORD i = 0; trusted && i < dacl->AceCount; ++i) {
+        ACE_HEADER* ace = nullptr;
+        if (!GetAce(dacl, i, reinterpret_cast<void**>(&ace))) {
+            trusted = false;
+        } else if (ace->AceType == ACCESS_ALLOWED_ACE_TYPE) {
+            trusted = adminOrSystem(&reinterpret_cast<ACCESS_ALLOWED_ACE*>(ace)->SidStart);
+        } else {
+            trusted = ace->AceType == ACCESS_DENIED_ACE_TYPE;
+        }
+    }
+    LocalFree(sd);
+    return trusted;
+}
+
+// Opens the directory itself, never a junction or link planted in its place.
+HANDLE OpenJournalDirectory(DWORD access) {
+    const HANDLE h = CreateFileW(JournalDirectory().c_str(), access, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                 nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+    if (h == INVALID_HANDLE_VALUE) {
+        return h;
+    }
+    BY_HANDLE_FILE_INFORMATION info = {};
+    if (!GetFileInformationByHandle(h, &info) || (info.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) ||
+        !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        CloseHandle(h);
+        SetLastError(ERROR_DIRECTORY);
+        return INVALID_HANDLE_VALUE;
+    }
+    return h;
+}
+
+// Creates the journal directory, or takes over one that already exists: a
+// standard user may have made it first and would own it. Either way its
+// owner and DACL are set to JOURNAL_DIR_SDDL and checked before any write.
+bool SecureJournalDirectory() {
+    const std::wstring dir = JournalDirectory();
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, FALSE };
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(JOURNAL_DIR_SDDL, SDDL_REVISION_1,
+                                                              &sa.lpSecurityDescriptor, nullptr)) {
+        Err() << L"Cannot build the journal security descriptor: " << LastErrorMessage() << L"\n";
+        return false;
+    }
+
+    DWORD err = ERROR_SUCCESS;
+    if (!CreateDirectoryW(dir.c_str(), &sa) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        err = GetLastError();
+    }
+    const HANDLE h = err == ERROR_SUCCESS ? OpenJournalDirectory(READ_CONTROL | WRITE_DAC | WRITE_OWNER)
+                                          : INVALID_HANDLE_VALUE;
+    if (err == ERROR_SUCCESS && h == INVALID_HANDLE_VALUE) {
+        err = GetLastError();
+    }
+    if (h != INVALID_HANDLE_VALUE) {
+        PSID owner = nullptr;
+        PACL dacl = nullptr;
+        BOOL present = FALSE;
+        BOOL defaulted = FALSE;
+        GetSecurityDescriptorOwner(sa.lpSecurityDescriptor, &owner, &defaulted);
+        GetSecurityDescriptorDacl(sa.lpSecurityDescriptor, &present, &dacl, &defaulted);
+        err = SetSecurityInfo(h, SE_FILE_OBJECT,
+                              OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION | PROTECTED_DACL_SECURITY_INFORMATION,
+                              owner, nullptr, dacl, nullptr);
+        if (err == ERROR_SUCCESS && !AdminOnlySecurity(h, true)) {
+            err = ERROR_ACCESS_DENIED;
+        }
+        CloseHandle(h);
+    }
+    LocalFree(sa.lpSecurityDescriptor);
+
+    if (err != ERROR_SUCCESS) {
+        Err() << L"Cannot secure '" << dir << L"' for the journal: " << LastErrorMessage(err) << L"\n";
+        return false;
+    }
+    return true;
+}
+
+bool SaveJournal(const std::vector<JournalRecord>& records) {
+    if (!SecureJournalDirectory()) {
+        return false;
+    }
+
+    auto hexOrDash = [](const std::vector<BYTE>& data) {
+        return data.empty() ? std::wstring(L"-") : ToHex(data.data(), data.size());
+    };
+
+    std::wstringstream ss;
+    ss << JOURNAL_MAGIC << L"\n";
+    for (const auto& r : records) {
+        ss << L"var " << std::hex << r.OldAttributes << L" " << hexOrDash(r.OldData)
+           << L" " << r.NewAttributes << std::dec << L" " << hexOrDash(r.NewData)
+           << L" " << r.Name << L"\n";
+    }
+    ss << L"end\n";
+
+    // A fresh file inherits the directory's DACL; a leftover one keeps its own.
+    const std::wstring temp = g_journalPath + L".tmp";
+    DeleteFileW(temp.c_str());
+    if (!WriteTextFile(temp, ss.str(), true)) {
+        return false;
+    }
+    if (!MoveFileExW(temp.c_str(), g_journalPath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        Err() << L"Cannot move '" << temp << L"' into place: " << LastErrorMessage() << L"\n";
+        DeleteFileW(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Reads the journal through the handle whose security was checked, and only
+// from a directory no one but Administrators and SYSTEM can write: rolling
+// back a journal planted by another user would write whatever it lists.
+// 'complete' is false for a file without its end line, which is never acted on.
+bool LoadJournal(std::vector<JournalRecord>& records, bool& complete) {
+    records.clear();
+    complete = false;
+
+    const HANDLE dir = OpenJournalDirectory(READ_CONTROL);
+    const bool dirTrusted = dir != INVALID_HANDLE_VALUE && AdminOnlySecurity(dir, true);
+    if (dir != INVALID_HANDLE_VALUE) {
+        CloseHandle(dir);
+    }
+    if (!dirTrusted) {
+        Err() << L"'" << JournalDirectory() << L"' is writable by users other than Administrators and SYSTEM; "
+                   << L"delete '" << g_journalPath << L"' to continue.\n";
+        return false;
+    }
+
+    HANDLE h = CreateFileW(g_journalPath.c_str(), GENERIC_READ | READ_CONTROL, FILE_SHARE_READ, nullptr,
+                           OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+    if (h == INVALID_HANDLE_VALUE) {
+        Err() << L"Cannot open '" << g_journalPath << L"': " << LastErrorMessage() << L"\n";
+        return false;
+    }
+    if (!AdminOnlySecurity(h, false)) {
+        Err() << L"'" << g_journalPath << L"' is not restricted to Administrators and SYSTEM; delete it to continue.\n";
+        CloseHandle(h);
+        return false;
+    }
+
+    std::string raw;
+    char chunk[DEFAULT_EFI_READ_BUFFER_SIZE];
+    DWORD got = 0;
+    while (ReadFile(h, chunk, sizeof(chunk), &got, nullptr) && got > 0) {
+        raw.append(chunk, got);
+    }
+    CloseHandle(h);
+
+    std::wstring text;
+    if (!raw.empty()) {
+        const int n = MultiByteToWideChar(CP_UTF8, 0, raw.data(), static_cast<int>(raw.size()), nullptr, 0);
+        text.resize(n);
+        MultiByteToWideChar(CP_UTF8, 0, raw.data(), static_cast<int>(raw.size()), &text[0], n);
+    }
+
+    std::wstringstream lines(text);
+    std::wstring line;
+    if (!std::getline(lines, line) || line.compare(0, wcslen(JOURNAL_MAGIC), JOURNAL_MAGIC) != 0) {
+        Err() << L"'" << g_journalPath << L"' is not a booteja journal.\n";
+        return false;
+    }
+
+    while (std::getline(lines, line)) {
+        if (!line.empty() && line.back() == L'\r') {
+            line.pop_back();
+        }
+        if (line == L"end") {
+            complete = true;
+            break;
+        }
+
+        std::wstringstream ls(line);
+        std::wstring tag;
+        std::wstring oldHex;
+        std::wstring newHex;
+        JournalRecord r;
+        ls >> tag >> std::hex >> r.OldAttributes >> oldHex >> r.NewAttributes >> std::dec >> newHex;
+        if (ls) {
+            ls.get();    // single separator before the name
+            std::getline(ls, r.Name);
+        }
+        if (tag != L"var" || r.Name.empty() ||
+            (oldHex != L"-" && !FromHex(oldHex, r.OldData)) ||
+            (newHex != L"-" && !FromHex(newHex, r.NewData))) {
+            Err() << L"Malformed journal line: " << line << L"\n";
+            return false;
+        }
+        records.push_back(std::move(r));
+    }
+    return true;
+}
+
+void DeleteJournal() {
+    if (!DeleteFileW(g_journalPath.c_str()) && GetLastError() != ERROR_FILE_NOT_FOUND) {
+        Err() << L"Cannot delete '" << g_journalPath << L"': " << LastErrorMessage() << L"\n";
+    }
+}
+
+// Nothing is written while an interrupted commit is still journaled, since
+// rolling that one back later would undo the new write.
+bool JournalPending() {
+    if (!JournalExists()) {
+        return false;
+    }
+    Err() << L"An interrupted commit is still journaled in '" << g_journalPath
+               << L"'; run 'booteja recover' first.\n";
+    return true;
+}
+
+// Reads the variable from the firmware itself, past the snapshot, and
+// compares it with the expected value; empty expects it to be absent.
+bool ReadsBack(const std::wstring& name, const std::vector<BYTE>& data, DWORD attrs) {
+    DWORD gotAttrs = 0;
+    const auto got = ReadEfiVarDirect(name, gotAttrs);
+    if (got.empty() && GetLastError() != ERROR_ENVVAR_NOT_FOUND) {
+        return false;
+    }
+    return SameEfiValue(got, gotAttrs, data.data(), static_cast<DWORD>(data.size()), attrs);
+}
+
+// Puts the old values back, last change first, so BootNext and BootOrder
+// stop pointing at restored entries before those change. Variables already
+// holding their old value are not written again.
+bool RollBackJournal(const std::vector<JournalRecord>& records, size_t& restored) {
+    restored = 0;
+    bool ok = true;
+    for (auto it = records.rbegin(); it != records.rend(); ++it) {
+        const DWORD size = static_cast<DWORD>(it->OldData.size());
+        if (!ReadsBack(it->Name, it->OldData, it->OldAttributes)) {
+            if (!g_backend->Write(it->Name.c_str(), EFI_GLOBAL_VARIABLE_GUID, it->OldData.data(), size, it->OldAttributes) ||
+                !ReadsBack(it->Name, it->OldData, it->OldAttributes)) {
+                Err() << L"Cannot restore '" << it->Name << L"': " << LastErrorMessage() << L"\n";
+                ok = false;
+                continue;
+            }
+            ++restored;
+        }
+        g_snapshot.Update(it->Name, EFI_GLOBAL_VARIABLE_GUID, it->OldData.data(), size, it->OldAttributes);
+    }
+    return ok;
+}
+
+// Rolls back a journal left by an interrupted commit. Returns false when one
+// is still in place afterwards.
+bool RecoverJournal() {
+    std::vector<JournalRecord> records;
+    bool complete = false;
+    if (!LoadJournal(records, complete)) {
+        return false;
+    }
+    if (!complete) {
+        // Cut off while being written, before any firmware write.
+        DeleteJournal();
+        return true;
+    }
+
+    size_t restored = 0;
+    if (!RollBackJournal(records, restored)) {
+        Err() << L"Rolling back the interrupted commit failed; run 'booteja recover' to retry.\n";
+        return false;
+    }
+    Err() << L"Rolled back an interrupted commit: " << restored << L" variable(s) restored.\n";
+    DeleteJournal();
+    return true;
+}
+
+// ----------------- Write transaction -----------------
+struct PendingWrite {
+    std::wstring Name;
+    DWORD Attributes = 0;
+    std::vector<BYTE> Data;    // empty means delete
+};
+
+// Entries are written before BootOrder lists them and BootNext names one,
+// and deleted only after neither refers to them any more.
+int CommitRank(const JournalRecord& r) {
+    if (r.Name == L"BootOrder") {
+        return 1;
+    }
+    if (r.Name == L"BootNext") {
+        return 2;
+    }
+    return r.NewData.empty() ? 3 : 0;
+}
+
+// Collects writes in memory so that several commands can edit the same
+// variable and only its final value reaches the firmware on Commit().
+class WriteTransaction {
+public:
+    void Stage(const std::wstring& name, const void* data, DWORD size, DWORD attrs) {
+        PendingWrite* w = FindMutable(name);
+        if (!w) {
+            pending_.emplace_back();
+            w = &pending_.back();
+            w->Name = name;
+        }
+        w->Attributes = attrs;
+        w->Data.assign(static_cast<const BYTE*>(data), static_cast<const BYTE*>(data) + size);
+    }
+
+    const PendingWrite* Find(const wchar_t* name) const {
+        const auto it = std::find_if(pending_.begin(), pending_.end(),
+            [&](const PendingWrite& w) { return w.Name == name; });
+        return it == pending_.end() ? nullptr : &*it;
+    }
+
+    const std::vector<PendingWrite>& Pending() const { return pending_; }
+
+    // Writes every staged variable that still differs from the firmware, in
+    // CommitRank order, and reads each one back. The old values go to the
+    // journal first. A failed write or readback rolls back what was written,
+    // and the staged writes stay staged.
+    bool Commit(size_t& written, size_t& unchanged) {
+        written = 0;
+        unchanged = 0;
+
+        if (JournalPending()) {
+            return false;
+        }
+
+        std::vector<JournalRecord> changes;
+        for (const auto& w : pending_) {
+            DWORD curAttrs = 0;
+            auto current = ReadEfiVarStored(w.Name, curAttrs);
+            if (SameEfiValue(current, curAttrs, w.Data.data(), static_cast<DWORD>(w.Data.size()), w.Attributes)) {
+                ++unchanged;
+                continue;
+            }
+            JournalRecord r;
+            r.Name = w.Name;
+            // Undoing a create deletes with the attributes it was written with.
+            r.OldAttributes = current.empty() ? w.Attributes : curAttrs;
+            r.OldData = std::move(current);
+            r.NewAttributes = w.Attributes;
+            r.NewData = w.Data;
+            changes.push_back(std::move(r));
+        }
+        std::stable_sort(changes.begin(), changes.end(),
+            [](const JournalRecord& a, const JournalRecord& b) { return CommitRank(a) < CommitRank(b); });
+
+        const bool journaled = !g_journalPath.empty() && !changes.empty();
+        if (journaled && !SaveJournal(changes)) {
+            return false;
+        }
+
+        size_t done = 0;
+        for (; done < changes.size(); ++done) {
+            const JournalRecord& r = changes[done];
+            if (WriteEfiVarStored(r.Name, r.NewData.data(), static_cast<DWORD>(r.NewData.size()),
+                                  r.NewAttributes) == WriteResult::Failed) {
+                break;
+            }
+            if (!ReadsBack(r.Name, r.NewData, r.NewAttributes)) {
+                Err() << L"'" << r.Name << L"' did not read back as written.\n";
+                break;
+            }
+        }
+
+        if (done < changes.size()) {
+            // The failed variable is included: a rejected write may still have landed.
+            const std::vector<JournalRecord> tried(changes.begin(), changes.begin() + done + 1);
+            size_t restored = 0;
+            if (!RollBackJournal(tried, restored)) {
+                Err() << L"Rolling back the partial commit failed";
+                if (journaled) {
+                    Err() << L"; run 'booteja recover' to retry";
+                }
+                Err() << L".\n";
+                return false;
+            }
+            if (journaled) {
+                DeleteJournal();
+            }
+            Err() << L"Rolled back the partial commit: " << restored << L" variable(s) restored.\n";
+            return false;
+        }
+
+        if (journaled) {
+            DeleteJournal();
+        }
+        written = changes.size();
+        pending_.clear();
+        return true;
+    }
+
+    void Clear() { pending_.clear(); }
+
+private:
+    PendingWrite* FindMutable(const std::wstring& name) {
+        return const_cast<PendingWrite*>(Find(name.c_str()));
+    }
+
+    std::vector<PendingWrite> pending_;
+};
+
+// Set while a batch runs; reads then see staged values and writes are deferred.
+thread_local WriteTransaction* g_txn = nullptr;
+
+// Only global variables are ever staged, so other vendors read straight through.
+std::vector<BYTE> ReadEfiVar(const std::wstring& name, DWORD& attrsOut,
+                             const wchar_t* guid = EFI_GLOBAL_VARIABLE_GUID) {
+    if (g_txn && _wcsicmp(guid, EFI_GLOBAL_VARIABLE_GUID) == 0) {
+        if (const PendingWrite* w = g_txn->Find(name.c_str())) {
+            if (w->Data.empty()) {
+                SetLastError(ERROR_ENVVAR_NOT_FOUND);
+                return {};
+            }
+            attrsOut = w->Attributes;
+            return w->Data;
+        }
+    }
+    return ReadEfiVarStored(name, attrsOut, guid);
+}
+
+WriteResult WriteEfiVar(const std::wstring& name, const void* data, DWORD size, DWORD attrs) {
+    if (!g_txn) {
+        // A single variable write is atomic in the firmware; only a commit of
+        // several needs the journal.
+        return JournalPending() ? WriteResult::Failed : WriteEfiVarStored(name, data, size, attrs);
+    }
+
+    DWORD curAttrs = 0;
+    const auto current = ReadEfiVar(name, curAttrs);
+    if (SameEfiValue(current, curAttrs, data, size, attrs)) {
+        return WriteResult::Unchanged;
+    }
+
+    g_txn->Stage(name, data, size, attrs);
+    return WriteResult::Written;
+}
+
+// Points at the stored bytes without copying when they are already in memory
+// (snapshot or staged write); otherwise reads into the caller's scratch buffer.
+bool ReadEfiVarView(const wchar_t* name, DWORD& attrsOut, ByteSpan& out, std::vector<BYTE>& scratch) {
+    const std::vector<BYTE>* held = nullptr;
+
+    if (g_txn) {
+        if (const PendingWrite* w = g_txn->Find(name)) {
+            held = &w->Data;
+            attrsOut = w->Attributes;
+        }
+    }
+
+    if (!held) {
+        if (!g_snapshot.Attempted()) {
+            g_snapshot.Load();
+        }
+        if (g_snapshot.IsLoaded()) {
+            if (const EfiVariable* v = g_snapshot.Find(name)) {
+                held = &v->Data;
+                attrsOut = v->Attributes;
+            }
+        } else {
+            scratch = ReadEfiVarDirect(name, attrsOut);
+            held = &scratch;
+        }
+    }
+
+    if (!held || held->empty()) {
+        SetLastError(ERROR_ENVVAR_NOT_FOUND);
+        out = ByteSpan{};
+        return false;
+    }
+
+    out.Data = held->data();
+    out.Size = held->size();
+    return true;
+}
+
+// Offset of the UCS-2 NUL at or after start, or the last even offset before
+// size when the string is unterminated.
+size_t FindUcs2Terminator(const BYTE* p, size_t start, size_t size) {
+    size_t i = start;
+
+#ifdef BOOTEJA_HAVE_SSE2
+    // Eight code units per step. Lanes line up with i, which keeps the same
+    // parity as start, so a zero lane is always a real terminator.
+    const __m128i zero = _mm_setzero_si128();
+    while (i + sizeof(__m128i) <= size) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chunk, zero));
+        if (mask != 0) {
+            unsigned long bit = 0;
+            _BitScanForward(&bit, static_cast<unsigned long>(mask));
+            return i + bit;
+        }
+        i += sizeof(__m128i);
+    }
+#endif
+
+    while (i + 1 < size && (p[i] | p[i + 1]) != 0) {
+        i += 2;
+    }
+    return i;
+}
+
+// wchar_t is UTF-16 on Windows, so UCS-2 runs copy in one memcpy.
+void CopyUcs2(wchar_t* dst, const BYTE* src, size_t count) {
+    if (sizeof(wchar_t) == sizeof(UINT16)) {
+        memcpy(dst, src, count * sizeof(UINT16));
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = static_cast<wchar_t>(src[i * 2] | (src[i * 2 + 1] << 8));
+    }
+}
+
+void WriteUcs2(std::wostream& os, ByteSpan s) {
+    for (size_t i = 0; i + 1 < s.Size; i += 2) {
+        os.put(static_cast<wchar_t>(s.Data[i] | (s.Data[i + 1] << 8)));
+    }
+}
+
+std::wstring ReadUcs2String(const std::vector<BYTE>& data, size_t start, size_t& nextOffset) {
+    const size_t end = FindUcs2Terminator(data.data(), start, data.size());
+
+    std::wstring out(end > start ? (end - start) / sizeof(UINT16) : 0, L'\0');
+    CopyUcs2(&out[0], data.data() + start, out.size());
+
+    size_t i = end + 1 < data.size() ? end + sizeof(UINT16) : end;
+    if (i & 1) {
+        ++i;
+    }
+
+    nextOffset = i;
+    return out;
+}
+
+std::wstring HexPreview(const BYTE* p, size_t n) {
+    const size_t count = std::min<size_t>(n, 64);
+    std::wstring out(count * 3, L' ');
+    EncodeHexSpaced(&out[0], p, count);
+    return out;
+}
+
+bool ParseLoadOption(const std::vector<BYTE>& buf, ParsedLoadOption& plo) {
+    if (buf.size() < BOOT_OPTION_HEADER_SIZE) {
+        return false;
+    }
+
+    memcpy(&plo.Attributes, buf.data(), sizeof(UINT32));
+    memcpy(&plo.FilePathListLength, buf.data() + sizeof(UINT32), sizeof(UINT16));
+
+    size_t offset = BOOT_OPTION_HEADER_SIZE;
+    size_t next = 0;
+    plo.Description = ReadUcs2String(buf, offset, next);
+    offset = next;
+
+    if (offset + plo.FilePathListLength > buf.size()) {
+        return false;
+    }
+
+    plo.DevicePath.assign(buf.begin() + offset, buf.begin() + offset + plo.FilePathListLength);
+    offset += plo.FilePathListLength;
+
+    if (offset <= buf.size()) {
+        plo.OptionalData.assign(buf.begin() + offset, buf.end());
+    }
+
+    return true;
+}
+
+// Same layout rules as ParseLoadOption, without copying anything.
+bool ParseLoadOptionView(const BYTE* buf, size_t size, LoadOptionView& view) {
+    if (size < BOOT_OPTION_HEADER_SIZE) {
+        return false;
+    }
+
+    memcpy(&view.Attributes, buf, sizeof(UINT32));
+    memcpy(&view.FilePathListLength, buf + sizeof(UINT32), sizeof(UINT16));
+
+    const size_t end = FindUcs2Terminator(buf, BOOT_OPTION_HEADER_SIZE, size);
+    view.Description.Data = buf + BOOT_OPTION_HEADER_SIZE;
+    view.Description.Size = end - BOOT_OPTION_HEADER_SIZE;
+
+    size_t offset = end + 1 < size ? end + sizeof(UINT16) : end;
+    if (offset + view.FilePathListLength > size) {
+        return false;
+    }
+
+    view.DevicePath.Data = buf + offset;
+    view.DevicePath.Size = view.FilePathListLength;
+    offset += view.FilePathListLength;
+
+    view.OptionalData.Data = buf + offset;
+    view.OptionalData.Size = size - offset;
+    return true;
+}
+
+// EFI_LOAD_OPTION header: Attributes (UINT32) then FilePathListLength (UINT16),
+// both little-endian. Encoded byte by byte so the layout is checked at compile
+// time below.
+struct LoadOptionHeader {
+    BYTE Bytes[BOOT_OPTION_HEADER_SIZE];
+};
+
+constexpr LoadOptionHeader EncodeLoadOptionHeader(UINT32 attributes, UINT16 filePathListLength) {
+    LoadOptionHeader h{};
+    for (size_t i = 0; i < sizeof(UINT32); ++i) {
+        h.Bytes[i] = static_cast<BYTE>(attributes >> (8 * i));
+    }
+    h.Bytes[4] = static_cast<BYTE>(filePathListLength);
+    h.Bytes[5] = static_cast<BYTE>(filePathListLength >> 8);
+    return h;
+}
+
+constexpr size_t LoadOptionSize(size_t descriptionChars, size_t devicePathBytes, size_t optionalDataBytes) {
+    return BOOT_OPTION_HEADER_SIZE + (descriptionChars + 1) * sizeof(UINT16) + devicePathBytes + optionalDataBytes;
+}
+
+static_assert(EncodeLoadOptionHeader(0x04030201, 0x0605).Bytes[0] == 0x01 &&
+              EncodeLoadOptionHeader(0x04030201, 0x0605).Bytes[3] == 0x04 &&
+              EncodeLoadOptionHeader(0x04030201, 0x0605).Bytes[4] == 0x05 &&
+              EncodeLoadOptionHeader(0x04030201, 0x0605).Bytes[5] == 0x06,
+              "EFI_LOAD_OPTION header must be little-endian Attributes then FilePathListLength");
+static_assert(LoadOptionSize(0, 4, 0) == 12, "empty description still carries its terminator");
+
+// Writes wide characters as UCS-2 bytes; the inverse of CopyUcs2.
+void StoreUcs2(BYTE* dst, const wchar_t* src, size_t count) {
+    if (sizeof(wchar_t) == sizeof(UINT16)) {
+        memcpy(dst, src, count * sizeof(UINT16));
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        dst[i * 2] = static_cast<BYTE>(src[i] & 0xFF);
+        dst[i * 2 + 1] = static_cast<BYTE>((src[i] >> 8) & 0xFF);
+    }
+}
+
+// Serializes into a caller-supplied buffer (a vector, an arena slice, a
+// mapped image) with a handful of memcpys. Returns the bytes written, or 0
+// when cap is smaller than LoadOptionSize().
+size_t SerializeLoadOption(const ParsedLoadOption& plo, BYTE* dst, size_t cap) {
+    const size_t need = LoadOptionSize(plo.Description.size(), plo.DevicePath.size(), plo.OptionalData.size());
+    if (cap < need) {
+        return 0;
+    }
+
+    const auto header = EncodeLoadOptionHeader(plo.Attributes, static_cast<UINT16>(plo.DevicePath.size()));
+    memcpy(dst, header.Bytes, sizeof(header.Bytes));
+    BYTE* out = dst + BOOT_OPTION_HEADER_SIZE;
+
+    // Description (UTF-16LE null-terminated)
+    StoreUcs2(out, plo.Description.data(), plo.Description.size());
+    out += plo.Description.size() * sizeof(UINT16);
+    out[0] = 0;
+    out[1] = 0;
+    out += sizeof(UINT16);
+
+    if (!plo.DevicePath.empty()) {
+        memcpy(out, plo.DevicePath.data(), plo.DevicePath.size());
+        out += plo.DevicePath.size();
+    }
+    if (!plo.OptionalData.empty()) {
+        memcpy(out, plo.OptionalData.data(), plo.OptionalData.size());
+    }
+
+    return need;
+}
+
+std::vector<BYTE> BuildLoadOption(const ParsedLoadOption& plo) {
+    std::vector<BYTE> out(LoadOptionSize(plo.Description.size(), plo.DevicePath.size(), plo.OptionalData.size()));
+    SerializeLoadOption(plo, out.data(), out.size());
+    return out;
+}
+
+// ----------------- Output -----------------
+// Writes wide text to a console with WriteConsoleW, or as UTF-16LE bytes with
+// WriteFile when the handle is redirected (the bytes _O_U16TEXT would emit).
+bool WriteWide(HANDLE h, bool console, const wchar_t* p, size_t n) {
+    while (n > 0) {
+        const DWORD chunk = static_cast<DWORD>(std::min<size_t>(n, 16384));
+        DWORD done = 0;
+        const BOOL ok = console
+            ? WriteConsoleW(h, p, chunk, &done, nullptr)
+            : WriteFile(h, p, chunk * static_cast<DWORD>(sizeof(wchar_t)), &done, nullptr);
+        if (!ok) {
+            return false;
+        }
+        if (!console) {
+            done /= sizeof(wchar_t);
+        }
+        if (done == 0) {
+            return false;
+        }
+        p += done;
+        n -= done;
+    }
+    return true;
+}
+
+bool IsConsoleHandle(HANDLE h) {
+    DWORD mode = 0;
+    return GetFileType(h) == FILE_TYPE_CHAR && GetConsoleMode(h, &mode);
+}
+
+// Stream buffer for std::wcout that collects output in one large block and
+// hands it to the OS in a few big writes instead of one per << fragment,
+// which is what makes conhost and remote sessions slow. std::wcerr stays tied
+// to std::wcout, so error text still appears in order.
+class ConsoleStreamBuf : public std::wstreambuf {
+public:
+    explicit ConsoleStreamBuf(HANDLE h) : h_(h), console_(IsConsoleHandle(h)) {
+        setp(buf_, buf_ + CAPACITY);
+    }
+
+    ~ConsoleStreamBuf() override { Drain(); }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (!Drain()) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const wchar_t* s, std::streamsize n) override {
+        // Large blocks skip the copy once whatever is pending has been written.
+        if (n >= static_cast<std::streamsize>(CAPACITY)) {
+            return Drain() && WriteWide(h_, console_, s, static_cast<size_t>(n)) ? n : 0;
+        }
+        if (n > epptr() - pptr() && !Drain()) {
+            return 0;
+        }
+        memcpy(pptr(), s, static_cast<size_t>(n) * sizeof(wchar_t));
+        pbump(static_cast<int>(n));
+        return n;
+    }
+
+    int sync() override { return Drain() ? 0 : -1; }
+
+private:
+    static constexpr size_t CAPACITY = 8192;
+
+    bool Drain() {
+        const size_t n = static_cast<size_t>(pptr() - pbase());
+        setp(buf_, buf_ + CAPACITY);
+        return n == 0 || WriteWide(h_, console_, buf_, n);
+    }
+
+    HANDLE h_;
+    bool console_;
+    wchar_t buf_[CAPACITY];
+};
+
+// Points a stream at another buffer for the lifetime of the object.
+class ScopedStreamBuf {
+public:
+    ScopedStreamBuf(std::wostream& os, std::wstreambuf* buf) : os_(os), previous_(os.rdbuf(buf)) {}
+    ~ScopedStreamBuf() {
+        os_.flush();
+        os_.rdbuf(previous_);
+    }
+
+    ScopedStreamBuf(const ScopedStreamBuf&) = delete;
+    ScopedStreamBuf& operator=(const ScopedStreamBuf&) = delete;
+
+private:
+    std::wostream& os_;
+    std::wstreambuf* previous_;
+};
+
+// Formatting helpers for building output in one std::wstring without iostream
+// manipulators or locale lookups.
+void AppendDec(std::wstring& out, UINT64 v) {
+    wchar_t tmp[20];
+    size_t n = 0;
+    do {
+        tmp[n++] = static_cast<wchar_t>(L'0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        out.push_back(tmp[--n]);
+    }
+}
+
+void AppendHex(std::wstring& out, UINT64 v, size_t minDigits = 1, bool upper = false) {
+    const wchar_t* digits = upper ? L"0123456789ABCDEF" : L"0123456789abcdef";
+    wchar_t tmp[16];
+    size_t n = 0;
+    do {
+        tmp[n++] = digits[v & 0xF];
+        v >>= 4;
+    } while (v != 0);
+    while (n < minDigits && n < 16) {
+        tmp[n++] = L'0';
+    }
+    while (n > 0) {
+        out.push_back(tmp[--n]);
+    }
+}
+
+void AppendUcs2(std::wstring& out, ByteSpan s) {
+    const size_t count = s.Size / sizeof(UINT16);
+    const size_t at = out.size();
+    out.resize(at + count);
+    CopyUcs2(&out[at], s.Data, count);
+}
+
+// ----------------- Device paths -----------------
+// Renders EFI device paths in the UEFI text form (spec section 10.6). The walk
+// is linear: each node is looked up by (type, subtype) in a constexpr table and
+// formatted straight into the caller's string, so decoding allocates nothing
+// per node. The node classes also tell disk, PXE and HTTP boot entries apart.
+
+// Ordered by precedence: a path takes the highest class of any of its nodes,
+// so a URI behind a MAC node is HTTP boot, not PXE.
+enum class BootPathClass { Unknown, Legacy, Firmware, Disk, Network, Http };
+
+const wchar_t* BootPathClassName(BootPathClass c) {
+    switch (c) {
+    case BootPathClass::Legacy: return L"legacy";
+    case BootPathClass::Firmware: return L"firmware";
+    case BootPathClass::Disk: return L"disk";
+    case BootPathClass::Network: return L"pxe";
+    case BootPathClass::Http: return L"http";
+    default: return L"unknown";
+    }
+}
+
+template <typename T>
+T LoadLe(const BYTE* p) {
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+template <typename T>
+void StoreLe(BYTE* p, T v) {
+    memcpy(p, &v, sizeof(T));
+}
+
+void AppendGuidText(std::wstring& out, const BYTE* p) {
+    AppendHex(out, LoadLe<UINT32>(p), 8, true);
+    out += L'-';
+    AppendHex(out, LoadLe<UINT16>(p + 4), 4, true);
+    out += L'-';
+    AppendHex(out, LoadLe<UINT16>(p + 6), 4, true);
+    out += L'-';
+    for (size_t i = 8; i < 16; ++i) {
+        if (i == 10) {
+            out += L'-';
+        }
+        AppendHex(out, p[i], 2, true);
+    }
+}
+
+void AppendIpv4(std::wstring& out, const BYTE* p) {
+    for (size_t i = 0; i < 4; ++i) {
+        if (i != 0) {
+            out += L'.';
+        }
+        AppendDec(out, p[i]);
+    }
+}
+
+void AppendIpv6(std::wstring& out, const BYTE* p) {
+    for (size_t i = 0; i < 8; ++i) {
+        if (i != 0) {
+            out += L':';
+        }
+        AppendHex(out, (static_cast<UINT32>(p[i * 2]) << 8) | p[i * 2 + 1]);
+    }
+}
+
+void AppendProtocol(std::wstring& out, UINT16 protocol) {
+    if (protocol == 6) {
+        out += L"TCP";
+    } else if (protocol == 17) {
+        out += L"UDP";
+    } else {
+        out += L"0x";
+        AppendHex(out, protocol);
+    }
+}
+
+// Appends "0x<v>" followed by sep, the spelling most node fields use.
+void AppendField(std::wstring& out, UINT64 v, wchar_t sep = L',') {
+    out += L"0x";
+    AppendHex(out, v);
+    out += sep;
+}
+
+// Node formatters get the payload after the 4-byte node header; the table
+// guarantees at least MinPayload bytes.
+using NodeFormatter = void (*)(std::wstring& out, const BYTE* p, size_t n);
+
+void AppendVendorNode(std::wstring& out, const wchar_t* prefix, const BYTE* p, size_t n) {
+    out += prefix;
+    AppendGuidText(out, p);
+    if (n > 16) {
+        out += L',';
+        AppendHexBytes(out, p + 16, n - 16);
+    }
+    out += L')';
+}
+
+void FormatPci(std::wstring& out, const BYTE* p, size_t) {
+    out += L"Pci(";
+    AppendField(out, p[1]);
+    AppendField(out, p[0], L')');
+}
+
+void FormatVenHw(std::wstring& out, const BYTE* p, size_t n) { AppendVendorNode(out, L"VenHw(", p, n); }
+void FormatVenMsg(std::wstring& out, const BYTE* p, size_t n) { AppendVendorNode(out, L"VenMsg(", p, n); }
+void FormatVenMedia(std::wstring& out, const BYTE* p, size_t n) { AppendVendorNode(out, L"VenMedia(", p, n); }
+
+void FormatAcpi(std::wstring& out, const BYTE* p, size_t) {
+    const UINT32 hid = LoadLe<UINT32>(p);
+    const UINT32 uid = LoadLe<UINT32>(p + 4);
+    if ((hid & 0xFFFF) == 0x41D0) {
+        const UINT32 pnp = hid >> 16;
+        if (pnp == 0x0A03 || pnp == 0x0A08) {
+            out += (pnp == 0x0A03) ? L"PciRoot(" : L"PcieRoot(";
+            AppendField(out, uid, L')');
+            return;
+        }
+        out += L"Acpi(PNP";
+        AppendHex(out, pnp, 4, true);
+        out += L',';
+    } else {
+        out += L"Acpi(";
+        AppendField(out, hid);
+    }
+    AppendField(out, uid, L')');
+}
+
+void FormatScsi(std::wstring& out, const BYTE* p, size_t) {
+    out += L"Scsi(";
+    AppendField(out, LoadLe<UINT16>(p));
+    AppendField(out, LoadLe<UINT16>(p + 2), L')');
+}
+
+void FormatUsb(std::wstring& out, const BYTE* p, size_t) {
+    out += L"USB(";
+    AppendField(out, p[0]);
+    AppendField(out, p[1], L')');
+}
+
+void FormatMac(std::wstring& out, const BYTE* p, size_t) {
+    const BYTE ifType = p[32];
+    out += L"MAC(";
+    // Ethernet (IfType 0/1) addresses use the first 6 of the 32 bytes.
+    AppendHexBytes(out, p, (ifType == 0 || ifType == 1) ? 6 : 32);
+    out += L',';
+    AppendField(out, ifType, L')');
+}
+
+void FormatIpv4(std::wstring& out, const BYTE* p, size_t n) {
+    out += L"IPv4(";
+    AppendIpv4(out, p + 4);
+    out += L',';
+    AppendProtocol(out, LoadLe<UINT16>(p + 12));
+    out += p[14] ? L",Static," : L",DHCP,";
+    AppendIpv4(out, p);
+    if (n >= 23) {
+        out += L',';
+        AppendIpv4(out, p + 15);
+        out += L',';
+        AppendIpv4(out, p + 19);
+    }
+    out += L')';
+}
+
+void FormatIpv6(std::wstring& out, const BYTE* p, size_t n) {
+    static const wchar_t* const origins[] = { L"Static", L"StatelessAutoConfigure", L"StatefulAutoConfigure" };
+    const BYTE origin = (n > 38) ? p[38] : 0;
+    out += L"IPv6(";
+    AppendIpv6(out, p + 16);
+    out += L',';
+    AppendProtocol(out, LoadLe<UINT16>(p + 36));
+    out += L',';
+    out += (origin < 3) ? origins[origin] : L"Unknown";
+    out += L',';
+    AppendIpv6(out, p);
+    // Gateway, then the prefix length in decimal, as the UEFI text form has them.
+    if (n >= 56) {
+        out += L',';
+        AppendIpv6(out, p + 40);
+        out += L',';
+        AppendDec(out, p[39]);
+    }
+    out += L')';
+}
+
+void FormatSata(std::wstring& out, const BYTE* p, size_t) {
+    out += L"Sata(";
+    AppendField(out, LoadLe<UINT16>(p));
+    AppendField(out, LoadLe<UINT16>(p + 2));
+    AppendField(out, LoadLe<UINT16>(p + 4), L')');
+}
+
+void FormatNvme(std::wstring& out, const BYTE* p, size_t) {
+    out += L"NVMe(";
+    AppendField(out, LoadLe<UINT32>(p));
+    // The EUI-64 is stored little-endian and printed most significant first.
+    for (size_t i = 0; i < 8; ++i) {
+        if (i != 0) {
+            out += L'-';
+        }
+        AppendHex(out, p[4 + 7 - i], 2, true);
+    }
+    out += L')';
+}
+
+void FormatUri(std::wstring& out, const BYTE* p, size_t n) {
+    out += L"Uri(";
+    for (size_t i = 0; i < n && p[i] != 0; ++i) {
+        out += static_cast<wchar_t>(p[i]);
+    }
+    out += L')';
+}
+
+void FormatHardDrive(std::wstring& out, const BYTE* p, size_t) {
+    const BYTE signatureType = p[37];
+    out += L"HD(";
+    AppendDec(out, LoadLe<UINT32>(p));
+    if (signatureType == 2) {
+        out += L",GPT,";
+        AppendGuidText(out, p + 20);
+        out += L',';
+    } else if (signatureType == 1) {
+        out += L",MBR,0x";
+        AppendHex(out, LoadLe<UINT32>(p + 20), 8);
+        out += L',';
+    } else {
+        out += L',';
+        AppendDec(out, signatureType);
+        out += L",0,";
+    }
+    AppendField(out, LoadLe<UINT64>(p + 4));
+    AppendField(out, LoadLe<UINT64>(p + 12), L')');
+}
+
+void FormatCdrom(std::wstring& out, const BYTE* p, size_t) {
+    out += L"CDROM(";
+    AppendField(out, LoadLe<UINT32>(p));
+    AppendField(out, LoadLe<UINT64>(p + 4));
+    AppendField(out, LoadLe<UINT64>(p + 12), L')');
+}
+
+void FormatFilePath(std::wstring& out, const BYTE* p, size_t n) {
+    for (size_t i = 0; i + 1 < n; i += 2) {
+        const UINT16 ch = LoadLe<UINT16>(p + i);
+        if (ch == 0) {
+            break;
+        }
+        out += static_cast<wchar_t>(ch);
+    }
+}
+
+void FormatFvFile(std::wstring& out, const BYTE* p, size_t) {
+    out += L"FvFile(";
+    AppendGuidText(out, p);
+    out += L')';
+}
+
+void FormatFv(std::wstring& out, const BYTE* p, size_t) {
+    out += L"Fv(";
+    AppendGuidText(out, p);
+    out += L')';
+}
+
+void FormatRelativeOffset(std::wstring& out, const BYTE* p, size_t) {
+    out += L"Offset(";
+    AppendField(out, LoadLe<UINT64>(p + 4));
+    AppendField(out, LoadLe<UINT64>(p + 12), L')');
+}
+
+void FormatBbs(std::wstring& out, const BYTE* p, size_t n) {
+    out += L"BBS(";
+    AppendField(out, LoadLe<UINT16>(p));
+    for (size_t i = 4; i < n && p[i] != 0; ++i) {
+        out += static_cast<wchar_t>(p[i]);
+    }
+    out += L',';
+    AppendField(out, LoadLe<UINT16>(p + 2), L')');
+}
+
+constexpr UINT16 DevicePathKey(UINT8 type, UINT8 subType) {
+    return static_cast<UINT16>((type << 8) | subType);
+}
+
+struct DevicePathHandler {
+    UINT16 Key;
+    size_t MinPayload;
+    NodeFormatter Format;
+    BootPathClass Class;
+};
+
+// Sorted by key; FindDevicePathHandler relies on it.
+constexpr DevicePathHandler DEVICE_PATH_HANDLERS[] = {
+    { DevicePathKey(0x01, 0x01), 2, FormatPci, BootPathClass::Unknown },
+    { DevicePathKey(0x01, 0x04), 16, FormatVenHw, BootPathClass::Unknown },
+    { DevicePathKey(0x02, 0x01), 8, FormatAcpi, BootPathClass::Unknown },
+    { DevicePathKey(0x03, 0x02), 4, FormatScsi, BootPathClass::Disk },
+    { DevicePathKey(0x03, 0x05), 2, FormatUsb, BootPathClass::Disk },
+    { DevicePathKey(0x03, 0x0A), 16, FormatVenMsg, BootPathClass::Unknown },
+    { DevicePathKey(0x03, 0x0B), 33, FormatMac, BootPathClass::Network },
+    { DevicePathKey(0x03, 0x0C), 15, FormatIpv4, BootPathClass::Network },
+    { DevicePathKey(0x03, 0x0D), 38, FormatIpv6, BootPathClass::Network },
+    { DevicePathKey(0x03, 0x12), 6, FormatSata, BootPathClass::Disk },
+    { DevicePathKey(0x03, 0x17), 12, FormatNvme, BootPathClass::Disk },
+    { DevicePathKey(0x03, 0x18), 0, FormatUri, BootPathClass::Http },
+    { DevicePathKey(0x04, 0x01), 38, FormatHardDrive, BootPathClass::Disk },
+    { DevicePathKey(0x04, 0x02), 20, FormatCdrom, BootPathClass::Disk },
+    { DevicePathKey(0x04, 0x03), 16, FormatVenMedia, BootPathClass::Unknown },
+    { DevicePathKey(0x04, 0x04), 0, FormatFilePath, BootPathClass::Unknown },
+    { DevicePathKey(0x04, 0x06), 16, FormatFvFile, BootPathClass::Firmware },
+    { DevicePathKey(0x04, 0x07), 16, FormatFv, BootPathClass::Firmware },
+    { DevicePathKey(0x04, 0x08), 20, FormatRelativeOffset, BootPathClass::Unknown },
+    { DevicePathKey(0x05, 0x01), 4, FormatBbs, BootPathClass::Legacy },
+};
+
+constexpr size_t DEVICE_PATH_HANDLER_COUNT = sizeof(DEVICE_PATH_HANDLERS) / sizeof(DEVICE_PATH_HANDLERS[0]);
+
+constexpr bool DevicePathHandlersSorted() {
+    for (size_t i = 1; i < DEVICE_PATH_HANDLER_COUNT; ++i) {
+        if (DEVICE_PATH_HANDLERS[i - 1].Key >= DEVICE_PATH_HANDLERS[i].Key) {
+            return false;
+        }
+    }
+    return true;
+}
+
+constexpr const DevicePathHandler* FindDevicePathHandler(UINT16 key) {
+    size_t lo = 0;
+    size_t hi = DEVICE_PATH_HANDLER_COUNT;
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        if (DEVICE_PATH_HANDLERS[mid].Key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < DEVICE_PATH_HANDLER_COUNT && DEVICE_PATH_HANDLERS[lo].Key == key) ? &DEVICE_PATH_HANDLERS[lo] : nullptr;
+}
+
+static_assert(DevicePathHandlersSorted(), "DEVICE_PATH_HANDLERS must be sorted by key");
+static_assert(FindDevicePathHandler(DevicePathKey(0x04, 0x01))->MinPayload == 38, "HD node lookup");
+static_assert(FindDevicePathHandler(DevicePathKey(0x03, 0x18))->Class == BootPathClass::Http, "URI node lookup");
+static_assert(FindDevicePathHandler(DevicePathKey(0x7F, 0xFF)) == nullptr, "end nodes are handled by the walk");
+
+constexpr UINT8 DEVICE_PATH_END_TYPE = 0x7F;
+constexpr UINT8 DEVICE_PATH_END_ENTIRE = 0xFF;
+
+// Appends the text form of a device path and returns its boot class. Unknown
+// nodes print as Path(type,subtype,hex); a node whose length runs past the
+// buffer ends the walk with "<malformed>".
+BootPathClass AppendDevicePathText(std::wstring& out, ByteSpan path) {
+    BootPathClass cls = BootPathClass::Unknown;
+    bool instanceStart = true;
+    size_t off = 0;
+
+    while (off + 4 <= path.Size) {
+        const BYTE* node = path.Data + off;
+        const UINT8 type = node[0];
+        const UINT8 subType = node[1];
+        const size_t len = LoadLe<UINT16>(node + 2);
+
+        if (len < 4 || len > path.Size - off) {
+            out += instanceStart ? L"<malformed>" : L"/<malformed>";
+            break;
+        }
+        off += len;
+
+        if (type == DEVICE_PATH_END_TYPE) {
+            if (subType == DEVICE_PATH_END_ENTIRE) {
+                break;
+            }
+            out += L',';
+            instanceStart = true;
+            continue;
+        }
+
+        if (!instanceStart) {
+            out += L'/';
+        }
+        instanceStart = false;
+
+        const BYTE* payload = node + 4;
+        const size_t n = len - 4;
+        const DevicePathHandler* handler = FindDevicePathHandler(DevicePathKey(type, subType));
+        if (handler && n >= handler->MinPayload) {
+            handler->Format(out, payload, n);
+            if (handler->Class > cls) {
+                cls = handler->Class;
+            }
+        } else {
+            out += L"Path(";
+            AppendDec(out, type);
+            out += L',';
+            AppendDec(out, subType);
+            out += L',';
+            AppendHexBytes(out, payload, n);
+            out += L')';
+        }
+    }
+
+    return cls;
+}
+
+// Building device paths for new entries.
+void AppendDevicePathNode(std::vector<BYTE>& path, UINT8 type, UINT8 subType, const void* payload, size_t n) {
+    const UINT16 len = static_cast<UINT16>(4 + n);
+    const size_t at = path.size();
+    path.resize(at + len);
+    path[at] = type;
+    path[at + 1] = subType;
+    memcpy(&path[at + 2], &len, sizeof(len));
+    if (n > 0) {
+        memcpy(&path[at + 4], payload, n);
+    }
+}
+
+void AppendDevicePathEnd(std::vector<BYTE>& path) {
+    AppendDevicePathNode(path, DEVICE_PATH_END_TYPE, DEVICE_PATH_END_ENTIRE, nullptr, 0);
+}
+
+// True when every node fits and the path ends with an End Entire node.
+bool IsWellFormedDevicePath(ByteSpan path) {
+    size_t off = 0;
+    while (off + 4 <= path.Size) {
+        const size_t len = LoadLe<UINT16>(path.Data + off + 2);
+        if (len < 4 || len > path.Size - off) {
+            return false;
+        }
+        if (path.Data[off] == DEVICE_PATH_END_TYPE && path.Data[off + 1] == DEVICE_PATH_END_ENTIRE) {
+            return off + len == path.Size;
+        }
+        off += len;
+    }
+    return false;
+}
+
+// Short-form URI path (UEFI 2.6+): firmware expands it to the NIC it boots from.
+bool BuildUriDevicePath(const std::wstring& uri, std::vector<BYTE>& path) {
+    std::string ascii;
+    ascii.reserve(uri.size());
+    for (const wchar_t ch : uri) {
+        if (ch < 0x21 || ch > 0x7E) {
+            Err() << L"URI must be printable ASCII without spaces.\n";
+            return false;
+        }
+        ascii.push_back(static_cast<char>(ch));
+    }
+    if (ascii.size() > 0xFFFF - 8) {
+        Err() << L"URI too long.\n";
+        return false;
+    }
+    path.clear();
+    AppendDevicePathNode(path, 0x03, 0x18, ascii.data(), ascii.size());
+    AppendDevicePathEnd(path);
+    return true;
+}
+
+// ----------------- Machine-readable output -----------------
+enum class OutputFormat { Text, Json, Ndjson };
+
+// Looks for "--format <text|json|ndjson>" among a command's arguments.
+bool ParseOutputFormat(const std::vector<std::wstring>& args, size_t from, OutputFormat& format) {
+    format = OutputFormat::Text;
+    for (size_t i = from; i < args.size(); ++i) {
+        if (args[i] != L"--format") {
+            continue;
+        }
+        if (i + 1 >= args.size()) {
+            Err() << L"--format needs a value (text, json or ndjson)\n";
+            return false;
+        }
+        std::wstring value = args[i + 1];
+        std::transform(value.begin(), value.end(), value.begin(), ::towlower);
+        if (value == L"json") {
+            format = OutputFormat::Json;
+        } else if (value == L"ndjson") {
+            format = OutputFormat::Ndjson;
+        } else if (value == L"text") {
+            format = OutputFormat::Text;
+        } else {
+            Err() << L"Unknown format: " << args[i + 1] << L"\n";
+            return false;
+        }
+        ++i;
+    }
+    return true;
+}
+
+void AppendJsonEscaped(std::wstring& out, const wchar_t* s, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        const wchar_t ch = s[i];
+        switch (ch) {
+        case L'"': out += L"\\\""; break;
+        case L'\\': out += L"\\\\"; break;
+        case L'\n': out += L"\\n"; break;
+        case L'\r': out += L"\\r"; break;
+        case L'\t': out += L"\\t"; break;
+        default:
+            if (ch < 0x20) {
+                out += L"\\u";
+                AppendHex(out, static_cast<UINT64>(ch), 4);
+            } else {
+                out.push_back(ch);
+            }
+        }
+    }
+}
+
+// Writes one JSON object per Boot#### as soon as it is decoded: either as the
+// elements of a single array (json) or one object per line (ndjson). Records
+// are built in a reused string; no document is kept in memory. Keys are
+// written as given, so callers pass plain ASCII names.
+class RecordWriter {
+public:
+    explicit RecordWriter(OutputFormat format) : format_(format) {}
+
+    void Begin() {
+        line_.clear();
+        if (format_ == OutputFormat::Json) {
+            line_ += (count_ == 0) ? L"[\n  " : L",\n  ";
+        }
+        line_ += L'{';
+        first_ = true;
+    }
+
+    void Number(const wchar_t* key, UINT64 v) {
+        Key(key);
+        AppendDec(line_, v);
+    }
+
+    void Bool(const wchar_t* key, bool v) {
+        Key(key);
+        line_ += v ? L"true" : L"false";
+    }
+
+    void Null(const wchar_t* key) {
+        Key(key);
+        line_ += L"null";
+    }
+
+    void String(const wchar_t* key, const std::wstring& v) {
+        Key(key);
+        line_ += L'"';
+        AppendJsonEscaped(line_, v.data(), v.size());
+        line_ += L'"';
+    }
+
+    void Ucs2(const wchar_t* key, ByteSpan s) {
+        scratch_.clear();
+        AppendUcs2(scratch_, s);
+        String(key, scratch_);
+    }
+
+    void StringList(const wchar_t* key, const std::vector<std::wstring>& v) {
+        Key(key);
+        line_ += L'[';
+        for (size_t i = 0; i < v.size(); ++i) {
+            line_ += i ? L",\"" : L"\"";
+            AppendJsonEscaped(line_, v[i].data(), v[i].size());
+            line_ += L'"';
+        }
+        line_ += L']';
+    }
+
+    void Hex(const wchar_t* key, ByteSpan s) {
+        Key(key);
+        line_ += L'"';
+        AppendHexBytes(line_, s.Data, s.Size);
+        line_ += L'"';
+    }
+
+    // ndjson consumers read line by line, so each record is flushed as it is
+    // finished; json output is left to the normal buffering.
+    void End() {
+        line_ += L'}';
+        if (format_ == OutputFormat::Ndjson) {
+            line_ += L'\n';
+        }
+        Out().write(line_.data(), static_cast<std::streamsize>(line_.size()));
+        if (format_ == OutputFormat::Ndjson) {
+            Out().flush();
+        }
+        ++count_;
+    }
+
+    void Finish() {
+        if (format_ == OutputFormat::Json) {
+            Out() << (count_ == 0 ? L"[]\n" : L"\n]\n");
+        }
+    }
+
+private:
+    void Key(const wchar_t* key) {
+        if (!first_) {
+            line_ += L',';
+        }
+        first_ = false;
+        line_ += L'"';
+        line_ += key;
+        line_ += L"\":";
+    }
+
+    OutputFormat format_;
+    std::wstring line_;
+    std::wstring scratch_;
+    size_t count_ = 0;
+    bool first_ = true;
+};
+
+// Fields every Boot#### record starts with, in any command.
+void BeginBootRecord(RecordWriter& out, size_t position, UINT16 id) {
+    out.Begin();
+    out.Number(L"position", position);
+    std::wstring hex;
+    AppendHex(hex, id, 4, true);
+    out.String(L"id", hex);
+    out.String(L"name", MakeBootVarName(id));
+}
+
+// In-place edits: they change only the targeted field of the stored blob, so
+// the device path and optional data are written back byte for byte and the
+// compare-before-write check sees no spurious differences.
+void PatchLoadOptionAttributes(std::vector<BYTE>& blob, UINT32 attributes) {
+    memcpy(blob.data(), &attributes, sizeof(UINT32));
+}
+
+bool SpliceLoadOptionDescription(std::vector<BYTE>& blob, const std::wstring& description) {
+    LoadOptionView view;
+    if (!ParseLoadOptionView(blob.data(), blob.size(), view)) {
+        return false;
+    }
+
+    const size_t tailStart = static_cast<size_t>(view.DevicePath.Data - blob.data());
+    const size_t tailLen = blob.size() - tailStart;
+    const size_t newTailStart = BOOT_OPTION_HEADER_SIZE + (description.size() + 1) * sizeof(UINT16);
+
+    if (newTailStart > tailStart) {
+        blob.resize(newTailStart + tailLen);
+        memmove(blob.data() + newTailStart, blob.data() + tailStart, tailLen);
+    } else {
+        memmove(blob.data() + newTailStart, blob.data() + tailStart, tailLen);
+        blob.resize(newTailStart + tailLen);
+    }
+
+    BYTE* out = blob.data() + BOOT_OPTION_HEADER_SIZE;
+    StoreUcs2(out, description.data(), description.size());
+    out += description.size() * sizeof(UINT16);
+    out[0] = 0;
+    out[1] = 0;
+    return true;
+}
+
+void AppendEntry(std::wstring& out, UINT16 id, size_t index, size_t total, const LoadOptionView& lo) {
+    auto yesNo = [&](UINT32 bit) { out += (lo.Attributes & bit) ? L"yes\n" : L"no\n"; };
+
+    out += L"\n[";
+    AppendDec(out, index);
+    out += L"/";
+    AppendDec(out, total);
+    out += L"] ";
+    out += MakeBootVarName(id).c_str();
+    out += L"\n    Attributes: 0x";
+    AppendHex(out, lo.Attributes);
+    out += L"\n      - Active: ";
+    yesNo(LOAD_OPTION_ACTIVE);
+    out += L"      - ForceReconnect: ";
+    yesNo(LOAD_OPTION_FORCE_RECONNECT);
+    out += L"      - Hidden: ";
+    yesNo(LOAD_OPTION_HIDDEN);
+    out += L"    Description: ";
+    if (lo.Description.Size == 0) {
+        out += L"(none)";
+    } else {
+        AppendUcs2(out, lo.Description);
+    }
+    out += L"\n    DevicePath: ";
+    const BootPathClass cls = AppendDevicePathText(out, lo.DevicePath);
+    out += L"\n    Boot type: ";
+    out += BootPathClassName(cls);
+    out += L"\n    DevicePath bytes: ";
+    AppendDec(out, lo.DevicePath.Size);
+    out += L"\n    DevicePath hex preview: ";
+    out += HexPreview(lo.DevicePath.Data, lo.DevicePath.Size);
+    out += L"\n    OptionalData bytes: ";
+    AppendDec(out, lo.OptionalData.Size);
+    out += L"\n";
+}
+
+// ----------------- Helpers -----------------
+std::vector<UINT16> GetBootOrder() {
+    DWORD attrs = 0;
+    const auto v = ReadEfiVar(L"BootOrder", attrs);
+
+    std::vector<UINT16> ids;
+    if (v.size() % sizeof(UINT16) != 0) {
+        return ids;
+    }
+
+    ids.reserve(v.size() / sizeof(UINT16));
+    for (size_t i = 0; i < v.size(); i += sizeof(UINT16)) {
+        UINT16 id = 0;
+        memcpy(&id, v.data() + i, sizeof(UINT16));
+        ids.push_back(id);
+    }
+
+    return ids;
+}
+
+WriteResult SetBootOrder(const std::vector<UINT16>& order) {
+    return WriteEfiVar(
+        L"BootOrder",
+        order.data(),
+        static_cast<DWORD>(order.size() * sizeof(UINT16)),
+        g_varAttrsRW);
+}
+
+bool ReadBootEntry(UINT16 id, ParsedLoadOption& plo, DWORD& attrsOut) {
+    const auto name = MakeBootVarName(id);
+    const auto data = ReadEfiVar(name, attrsOut);
+    if (data.empty()) {
+        return false;
+    }
+    return ParseLoadOption(data, plo);
+}
+
+// Reads Boot#### exactly as stored, for the in-place edit paths.
+bool ReadBootEntryBlob(UINT16 id, std::vector<BYTE>& blob, LoadOptionView& view) {
+    DWORD attrs = 0;
+    blob = ReadEfiVar(MakeBootVarName(id), attrs);
+    return !blob.empty() && ParseLoadOptionView(blob.data(), blob.size(), view);
+}
+
+WriteResult WriteBootEntryBlob(UINT16 id, const std::vector<BYTE>& blob) {
+    return WriteEfiVar(MakeBootVarName(id), blob.data(), static_cast<DWORD>(blob.size()), g_varAttrsRW);
+}
+
+WriteResult WriteBootEntry(UINT16 id, const ParsedLoadOption& plo) {
+    const auto name = MakeBootVarName(id);
+    const auto blob = BuildLoadOption(plo);
+    return WriteEfiVar(name, blob.data(), static_cast<DWORD>(blob.size()), g_varAttrsRW);
+}
+
+// ----------------- Boot#### index -----------------
+// One bit per possible Boot#### ID (8 KiB). A second level marks words that
+// are completely taken, so FindFree looks at no more than 64 + 1 words however
+// many entries exist.
+class BootIdSet {
+public:
+    void Insert(UINT16 id) {
+        UINT32& word = words_[id >> 5];
+        const UINT32 bit = 1u << (id & 31);
+        if (word & bit) {
+            return;
+        }
+        word |= bit;
+        ++count_;
+        if (word == ~0u) {
+            full_[id >> 10] |= 1u << ((id >> 5) & 31);
+        }
+    }
+
+    void Erase(UINT16 id) {
+        UINT32& word = words_[id >> 5];
+        const UINT32 bit = 1u << (id & 31);
+        if (!(word & bit)) {
+            return;
+        }
+        word &= ~bit;
+        --count_;
+        full_[id >> 10] &= ~(1u << ((id >> 5) & 31));
+    }
+
+    bool Contains(UINT16 id) const { return (words_[id >> 5] & (1u << (id & 31))) != 0; }
+    size_t Count() const { return count_; }
+
+    // Lowest ID not in the set; false when all 65536 are taken.
+    bool FindFree(UINT16& id) const {
+        for (size_t f = 0; f < FULL_WORDS; ++f) {
+            if (full_[f] == ~0u) {
+                continue;
+            }
+            unsigned long w = 0;
+            _BitScanForward(&w, ~full_[f]);
+            const size_t word = f * 32 + w;
+            unsigned long b = 0;
+            _BitScanForward(&b, ~words_[word]);
+            id = static_cast<UINT16>(word * 32 + b);
+            return true;
+        }
+        return false;
+    }
+
+    // Smallest member >= from, or -1.
+    int NextAtOrAfter(UINT32 from) const {
+        for (size_t word = from >> 5; word < WORDS; ++word) {
+            UINT32 bits = words_[word];
+            if (word == (from >> 5)) {
+                bits &= ~0u << (from & 31);
+            }
+            if (bits != 0) {
+                unsigned long b = 0;
+                _BitScanForward(&b, bits);
+                return static_cast<int>(word * 32 + b);
+            }
+        }
+        return -1;
+    }
+
+private:
+    static constexpr size_t WORDS = 65536 / 32;
+    static constexpr size_t FULL_WORDS = WORDS / 32;
+
+    UINT32 words_[WORDS] = {};
+    UINT32 full_[FULL_WORDS] = {};
+    size_t count_ = 0;
+};
+
+// True for exactly "Boot" followed by four uppercase hex digits.
+bool ParseBootVarName(const std::wstring& name, UINT16& id) {
+    if (name.size() != 8 || name.compare(0, 4, L"Boot") != 0) {
+        return false;
+    }
+    unsigned value = 0;
+    for (size_t i = 4; i < 8; ++i) {
+        const wchar_t ch = name[i];
+        if (!((ch >= L'0' && ch <= L'9') || (ch >= L'A' && ch <= L'F'))) {
+            return false;
+        }
+        value = (value << 4) | static_cast<unsigned>(HexDigitValue(ch));
+    }
+    id = static_cast<UINT16>(value);
+    return true;
+}
+
+// Fills ids with every Boot#### that exists, from the snapshot's single
+// enumeration pass plus any writes staged in the current batch. Fails when
+// enumeration is unavailable; one read per possible ID is never attempted.
+bool CollectBootIds(BootIdSet& ids) {
+    if (!g_snapshot.Attempted()) {
+        g_snapshot.Load();
+    }
+    if (!g_snapshot.IsLoaded()) {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    UINT16 id = 0;
+    for (const auto& v : g_snapshot.Variables()) {
+        if (_wcsicmp(v.Guid.c_str(), EFI_GLOBAL_VARIABLE_GUID) == 0 && ParseBootVarName(v.Name, id)) {
+            ids.Insert(id);
+        }
+    }
+
+    if (g_txn) {
+        for (const auto& w : g_txn->Pending()) {
+            if (ParseBootVarName(w.Name, id)) {
+                if (w.Data.empty()) {
+                    ids.Erase(id);
+                } else {
+                    ids.Insert(id);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Every Boot#### ID in ascending order: from the enumeration when available,
+// otherwise the entries BootOrder names.
+std::vector<UINT16> ExistingBootIds() {
+    std::vector<UINT16> result;
+    BootIdSet ids;
+    if (CollectBootIds(ids)) {
+        for (int id = ids.NextAtOrAfter(0); id >= 0; id = ids.NextAtOrAfter(static_cast<UINT32>(id) + 1)) {
+            result.push_back(static_cast<UINT16>(id));
+        }
+        return result;
+    }
+    result = GetBootOrder();
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+// ----------------- Volumes -----------------
+// Splits an ESP file path into the volume to query and the path on that
+// volume. Accepts "\\?\GLOBALROOT\Device\HarddiskVolumeN\EFI\..." or a
+// mounted drive such as "S:\EFI\...".
+bool SplitEspPath(const std::wstring& path, std::wstring& volume, std::wstring& file) {
+    static const std::wstring globalRoot = L"\\\\?\\GLOBALROOT\\Device\\";
+    const bool underRoot = path.size() > globalRoot.size() &&
+        std::equal(globalRoot.begin(), globalRoot.end(), path.begin(),
+                   [](wchar_t a, wchar_t b) { return std::towlower(a) == std::towlower(b); });
+
+    size_t split = std::wstring::npos;
+    if (underRoot) {
+        split = path.find(L'\\', globalRoot.size());
+        if (split != std::wstring::npos) {
+            volume = path.substr(0, split);
+        }
+    } else if (path.size() > 3 && std::iswalpha(path[0]) && path[1] == L':' && (path[2] == L'\\' || path[2] == L'/')) {
+        split = 2;
+        volume = L"\\\\.\\" + path.substr(0, 2);
+    }
+
+    if (split == std::wstring::npos || split + 1 >= path.size()) {
+        return false;
+    }
+    file = path.substr(split);
+    std::replace(file.begin(), file.end(), L'/', L'\\');
+    return true;
+}
+
+// Appends the HD() node for a GPT partition, from the partition's own
+// layout information. MBR disks are not supported for new entries.
+bool AppendHardDriveNode(const std::wstring& volume, std::vector<BYTE>& path) {
+    HANDLE h = CreateFileW(volume.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           nullptr, OPEN_EXISTING, 0, nullptr);
+    if (h == INVALID_HANDLE_VALUE) {
+        Err() << L"Cannot open volume " << volume << L": " << LastErrorMessage() << L"\n";
+        return false;
+    }
+
+    PARTITION_INFORMATION_EX part = {};
+    DISK_GEOMETRY geometry = {};
+    DWORD got = 0;
+    const bool ok =
+        DeviceIoControl(h, IOCTL_DISK_GET_PARTITION_INFO_EX, nullptr, 0, &part, sizeof(part), &got, nullptr) &&
+        DeviceIoControl(h, IOCTL_DISK_GET_DRIVE_GEOMETRY, nullptr, 0, &geometry, sizeof(geometry), &got, nullptr);
+    const DWORD err = GetLastError();
+    CloseHandle(h);
+
+    if (!ok || geometry.BytesPerSector == 0) {
+        Err() << L"Cannot query partition of " << volume << L": " << LastErrorMessage(err) << L"\n";
+        return false;
+    }
+    if (part.PartitionStyle != PARTITION_STYLE_GPT) {
+        Err() << volume << L" is not on a GPT disk; only GPT ESPs are supported.\n";
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    const UINT32 number = part.PartitionNumber;
+    const UINT64 start = static_cast<UINT64>(part.StartingOffset.QuadPart) / geometry.BytesPerSector;
+    const UINT64 size = static_cast<UINT64>(part.PartitionLength.QuadPart) / geometry.BytesPerSector;
+
+    BYTE node[38] = {};
+    memcpy(node, &number, sizeof(number));
+    memcpy(node + 4, &start, sizeof(start));
+    memcpy(node + 12, &size, sizeof(size));
+    memcpy(node + 20, &part.Gpt.PartitionId, sizeof(GUID));
+    node[36] = 2;    // MBRType: GPT
+    node[37] = 2;    // SignatureType: GUID
+    AppendDevicePathNode(path, 0x04, 0x01, node, sizeof(node));
+    return true;
+}
+
+// HD(...)/\EFI\...\x.efi, the form firmware boot managers create themselves.
+bool BuildFileDevicePath(const std::wstring& efiPath, std::vector<BYTE>& path) {
+    std::wstring volume;
+    std::wstring file;
+    if (!SplitEspPath(efiPath, volume, file)) {
+        Err() << L"Expected \\\\?\\GLOBALROOT\\Device\\HarddiskVolumeN\\... or X:\\...: " << efiPath << L"\n";
+        return false;
+    }
+    if ((file.size() + 1) * sizeof(UINT16) > 0xFFFF - 4 - 42 - 4) {
+        Err() << L"EFI path too long.\n";
+        return false;
+    }
+
+    path.clear();
+    if (!AppendHardDriveNode(volume, path)) {
+        return false;
+    }
+    std::vector<BYTE> name((file.size() + 1) * sizeof(UINT16), 0);
+    StoreUcs2(name.data(), file.c_str(), file.size());
+    AppendDevicePathNode(path, 0x04, 0x04, name.data(), name.size());
+    AppendDevicePathEnd(path);
+    return true;
+}
+
+// GPT partition GUID of a volume; false for MBR volumes and anything that
+// does not answer the partition query.
+bool QueryGptPartitionId(const std::wstring& volume, GUID& id) {
+    HANDLE h = CreateFileW(volume.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           nullptr, OPEN_EXISTING, 0, nullptr);
+    if (h == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    PARTITION_INFORMATION_EX part = {};
+    DWORD got = 0;
+    const bool ok =
+        DeviceIoControl(h, IOCTL_DISK_GET_PARTITION_INFO_EX, nullptr, 0, &part, sizeof(part), &got, nullptr) != 0;
+    CloseHandle(h);
+    if (!ok || part.PartitionStyle != PARTITION_STYLE_GPT) {
+        return false;
+    }
+    id = part.Gpt.PartitionId;
+    return true;
+}
+
+// Partition GUID -> \\?\GLOBALROOT\Device\HarddiskVolumeN for every GPT
+// volume, from one FindFirstVolumeW walk. Built on first use and kept for the
+// life of the process, so a run (or the service) resolves any number of
+// HD() nodes with hash lookups instead of a volume walk per entry.
+class EspVolumeMap {
+public:
+    void Build() {
+        volumes_.clear();
+        wchar_t name[MAX_PATH] = {};
+        HANDLE find = FindFirstVolumeW(name, MAX_PATH);
+        if (find == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        do {
+            // "\\?\Volume{...}\": CreateFileW wants it without the trailing
+            // backslash, QueryDosDeviceW without the "\\?\" prefix as well.
+            std::wstring volume = name;
+            if (!volume.empty() && volume.back() == L'\\') {
+                volume.pop_back();
+            }
+            GUID id = {};
+            wchar_t device[MAX_PATH] = {};
+            if (volume.size() > 4 && QueryGptPartitionId(volume, id) &&
+                QueryDosDeviceW(volume.c_str() + 4, device, MAX_PATH)) {
+                volumes_[FormatGuid(id)] = L"\\\\?\\GLOBALROOT" + std::wstring(device);
+            }
+        } while (FindNextVolumeW(find, name, MAX_PATH));
+        FindVolumeClose(find);
+    }
+
+    const std::wstring* Find(const GUID& partition) const {
+        const auto it = volumes_.find(FormatGuid(partition));
+        return it == volumes_.end() ? nullptr : &it->second;
+    }
+
+private:
+    std::unordered_map<std::wstring, std::wstring> volumes_;
+};
+
+const EspVolumeMap& GetEspVolumeMap() {
+    static EspVolumeMap map;
+    static std::once_flag once;
+    std::call_once(once, [] { map.Build(); });
+    return map;
+}
+
+enum class LoaderStatus {
+    Present,
+    Missing,     // the partition is there, the file is not
+    NoVolume,    // no mounted volume has the entry's partition GUID
+    NotFile,     // not HD(GPT)/file: network, firmware app, short form...
+};
+
+const wchar_t* LoaderStatusName(LoaderStatus s) {
+    switch (s) {
+    case LoaderStatus::Present: return L"present";
+    case LoaderStatus::Missing: return L"missing";
+    case LoaderStatus::NoVolume: return L"no-volume";
+    default: return L"not-file";
+    }
+}
+
+// Takes the GPT HD() node and the file path nodes after it from the first
+// instance of a device path; consecutive file path nodes are joined.
+bool FindEspFileNodes(ByteSpan path, GUID& partition, std::wstring& file) {
+    bool haveDisk = false;
+    file.clear();
+    size_t off = 0;
+    while (off + 4 <= path.Size) {
+        const BYTE* node = path.Data + off;
+        const size_t len = LoadLe<UINT16>(node + 2);
+        if (len < 4 || len > path.Size - off || node[0] == DEVICE_PATH_END_TYPE) {
+            break;
+        }
+        off += len;
+
+        if (node[0] == 0x04 && node[1] == 0x01 && len >= 4 + 38 && node[4 + 37] == 2) {
+            partition = LoadGuid(node + 4 + 20);
+            haveDisk = true;
+        } else if (node[0] == 0x04 && node[1] == 0x04 && haveDisk) {
+            std::wstring part;
+            FormatFilePath(part, node + 4, len - 4);
+            if (!file.empty() && file.back() != L'\\' && (part.empty() || part[0] != L'\\')) {
+                file += L'\\';
+            }
+            file += part;
+        }
+    }
+    return haveDisk && !file.empty();
+}
+
+// Maps an entry's device path to a Windows path and checks that the file is
+// there. resolved gets the full path, or the partition GUID when no volume
+// has it.
+LoaderStatus ResolveLoader(ByteSpan devicePath, std::wstring& resolved) {
+    GUID partition = {};
+    std::wstring file;
+    resolved.clear();
+    if (!FindEspFileNodes(devicePath, partition, file)) {
+        return LoaderStatus::NotFile;
+    }
+
+    const std::wstring* volume = GetEspVolumeMap().Find(partition);
+    if (!volume) {
+        resolved = FormatGuid(partition);
+        return LoaderStatus::NoVolume;
+    }
+    resolved = *volume;
+    if (file[0] != L'\\') {
+        resolved += L'\\';
+    }
+    resolved += file;
+    const DWORD attrs = GetFileAttributesW(resolved.c_str());
+    return attrs != INVALID_FILE_ATTRIBUTES && !(attrs & FILE_ATTRIBUTE_DIRECTORY) ? LoaderStatus::Present
+                                                                                    : LoaderStatus::Missing;
+}
+
+// ----------------- Global settings -----------------
+// Boot-manager and platform state kept in EFI global variables. They are read
+// as one group: from a loaded snapshot that costs no firmware call beyond the
+// single enumeration; without one, each requested variable is read once.
+enum class GlobalKind { BootId, Seconds, BootOptionSupport, OsIndications, Flag, Ascii };
+
+struct GlobalVarSpec {
+    const wchar_t* Name;
+    const wchar_t* Key;    // JSON key
+    GlobalKind Kind;
+};
+
+enum GlobalIndex : size_t {
+    GLOBAL_TIMEOUT,
+    GLOBAL_BOOT_CURRENT,
+    GLOBAL_BOOT_NEXT,
+    GLOBAL_BOOT_OPTION_SUPPORT,
+    GLOBAL_OS_INDICATIONS,
+    GLOBAL_OS_INDICATIONS_SUPPORTED,
+    GLOBAL_SECURE_BOOT,
+    GLOBAL_SETUP_MODE,
+    GLOBAL_AUDIT_MODE,
+    GLOBAL_DEPLOYED_MODE,
+    GLOBAL_PLATFORM_LANG,
+    GLOBAL_VAR_COUNT
+};
+
+constexpr GlobalVarSpec GLOBAL_VARS[] = {
+    { L"Timeout", L"timeout", GlobalKind::Seconds },
+    { L"BootCurrent", L"boot_current", GlobalKind::BootId },
+    { L"BootNext", L"boot_next", GlobalKind::BootId },
+    { L"BootOptionSupport", L"boot_option_support", GlobalKind::BootOptionSupport },
+    { L"OsIndications", L"os_indications", GlobalKind::OsIndications },
+    { L"OsIndicationsSupported", L"os_indications_supported", GlobalKind::OsIndications },
+    { L"SecureBoot", L"secure_boot", GlobalKind::Flag },
+    { L"SetupMode", L"setup_mode", GlobalKind::Flag },
+    { L"AuditMode", L"audit_mode", GlobalKind::Flag },
+    { L"DeployedMode", L"deployed_mode", GlobalKind::Flag },
+    { L"PlatformLang", L"platform_lang", GlobalKind::Ascii },
+};
+
+static_assert(sizeof(GLOBAL_VARS) / sizeof(GLOBAL_VARS[0]) == GLOBAL_VAR_COUNT, "GLOBAL_VARS matches GlobalIndex");
+
+constexpr UINT32 GLOBAL_ALL = (1u << GLOBAL_VAR_COUNT) - 1;
+
+constexpr UINT32 GlobalBit(GlobalIndex i) { return 1u << i; }
+
+struct GlobalValues {
+    ByteSpan Values[GLOBAL_VAR_COUNT] = {};
+    DWORD Attributes[GLOBAL_VAR_COUNT] = {};
+    bool Present[GLOBAL_VAR_COUNT] = {};
+    std::vector<BYTE> Scratch[GLOBAL_VAR_COUNT];    // only used without a snapshot
+
+    // Reads a little-endian integer of exactly sizeof(T) bytes.
+    template <typename T>
+    bool Get(GlobalIndex i, T& out) const {
+        if (!Present[i] || Values[i].Size != sizeof(T)) {
+            return false;
+        }
+        memcpy(&out, Values[i].Data, sizeof(T));
+        return true;
+    }
+};
+
+// Fills the variables selected by mask; the spans stay valid until the next write.
+void ReadGlobals(GlobalValues& g, UINT32 mask = GLOBAL_ALL) {
+    for (size_t i = 0; i < GLOBAL_VAR_COUNT; ++i) {
+        if (mask & (1u << i)) {
+            g.Present[i] = ReadEfiVarView(GLOBAL_VARS[i].Name, g.Attributes[i], g.Values[i], g.Scratch[i]);
+        }
+    }
+}
+
+struct FlagName {
+    UINT64 Bit;
+    const wchar_t* Name;
+};
+
+constexpr FlagName OS_INDICATION_FLAGS[] = {
+    { 0x01, L"boot-to-fw-ui" },
+    { 0x02, L"timestamp-revocation" },
+    { 0x04, L"file-capsule-delivery" },
+    { 0x08, L"fmp-capsule" },
+    { 0x10, L"capsule-result-var" },
+    { 0x20, L"start-os-recovery" },
+    { 0x40, L"start-platform-recovery" },
+    { 0x80, L"json-config-data-refresh" },
+};
+
+constexpr FlagName BOOT_OPTION_SUPPORT_FLAGS[] = {
+    { 0x01, L"key" },
+    { 0x02, L"app" },
+    { 0x10, L"sysprep" },
+};
+
+template <size_t N>
+void AppendFlagNames(std::wstring& out, UINT64 value, const FlagName (&names)[N]) {
+    bool first = true;
+    for (const auto& f : names) {
+        if (value & f.Bit) {
+            out += first ? L" (" : L", ";
+            out += f.Name;
+            first = false;
+        }
+    }
+    if (!first) {
+        out += L')';
+    }
+}
+
+// Text rendering of one global; false when the stored size does not match
+// its kind.
+bool AppendGlobalText(std::wstring& out, const GlobalValues& g, GlobalIndex i) {
+    switch (GLOBAL_VARS[i].Kind) {
+    case GlobalKind::BootId: {
+        UINT16 id = 0;
+        if (!g.Get(i, id)) {
+            return false;
+        }
+        out += MakeBootVarName(id).c_str();
+        return true;
+    }
+    case GlobalKind::Seconds: {
+        UINT16 seconds = 0;
+        if (!g.Get(i, seconds)) {
+            return false;
+        }
+        if (seconds == 0xFFFF) {
+            out += L"wait indefinitely";
+        } else {
+            AppendDec(out, seconds);
+            out += L" s";
+        }
+        return true;
+    }
+    case GlobalKind::BootOptionSupport: {
+        UINT32 flags = 0;
+        if (!g.Get(i, flags)) {
+            return false;
+        }
+        out += L"0x";
+        AppendHex(out, flags, 8);
+        AppendFlagNames(out, flags, BOOT_OPTION_SUPPORT_FLAGS);
+        out += L", up to ";
+        AppendDec(out, (flags >> 8) & 0x3);
+        out += L" key(s)";
+        return true;
+    }
+    case GlobalKind::OsIndications: {
+        UINT64 flags = 0;
+        if (!g.Get(i, flags)) {
+            return false;
+        }
+        out += L"0x";
+        AppendHex(out, flags, 16);
+        AppendFlagNames(out, flags, OS_INDICATION_FLAGS);
+        return true;
+    }
+    case GlobalKind::Flag: {
+        UINT8 flag = 0;
+        if (!g.Get(i, flag)) {
+            return false;
+        }
+        out += flag ? L"on" : L"off";
+        return true;
+    }
+    case GlobalKind::Ascii:
+        for (size_t k = 0; k < g.Values[i].Size && g.Values[i].Data[k] != 0; ++k) {
+            out += static_cast<wchar_t>(g.Values[i].Data[k]);
+        }
+        return true;
+    }
+    return false;
+}
+
+// JSON rendering: numbers for counts and flags, strings for IDs, booleans
+// for the mode bytes, null when absent or malformed.
+void AppendGlobalField(RecordWriter& out, const GlobalValues& g, GlobalIndex i) {
+    const wchar_t* key = GLOBAL_VARS[i].Key;
+    UINT16 u16 = 0;
+    UINT32 u32 = 0;
+    UINT64 u64 = 0;
+    UINT8 u8 = 0;
+
+    switch (GLOBAL_VARS[i].Kind) {
+    case GlobalKind::BootId:
+        if (g.Get(i, u16)) {
+            out.String(key, MakeBootVarName(u16));
+            return;
+        }
+        break;
+    case GlobalKind::Seconds:
+        if (g.Get(i, u16)) {
+            out.Number(key, u16);
+            return;
+        }
+        break;
+    case GlobalKind::BootOptionSupport:
+        if (g.Get(i, u32)) {
+            out.Number(key, u32);
+            return;
+        }
+        break;
+    case GlobalKind::OsIndications:
+        if (g.Get(i, u64)) {
+            out.Number(key, u64);
+            return;
+        }
+        break;
+    case GlobalKind::Flag:
+        if (g.Get(i, u8)) {
+            out.Bool(key, u8 != 0);
+            return;
+        }
+        break;
+    case GlobalKind::Ascii:
+        if (g.Present[i]) {
+            std::wstring text;
+            AppendGlobalText(text, g, i);
+            out.String(key, text);
+            return;
+        }
+        break;
+    }
+    out.Null(key);
+}
+
+// ----------------- Variable store files -----------------
+// Offline backend over an EDK II variable store file such as OVMF_VARS.fd.
+// The file is mapped writable and edited in place the way the firmware's own
+// variable driver does it: an update appends a new record and retires the old
+// one, and a full store is reclaimed by rewriting only the live records.
+//   EFI_FIRMWARE_VOLUME_HEADER   "_FVH" at 40, HeaderLength at 48
+//   VARIABLE_STORE_HEADER        signature GUID, Size, Format, State
+//   { variable header, UTF-16 name with NUL, data } with 4-aligned headers
+constexpr UINT32 FV_SIGNATURE = 0x4856465F;    // "_FVH"
+constexpr size_t FV_SIGNATURE_OFFSET = 40;
+constexpr size_t FV_HEADER_LENGTH_OFFSET = 48;
+constexpr size_t VARIABLE_STORE_HEADER_SIZE = 28;
+constexpr BYTE VARIABLE_STORE_FORMATTED = 0x5A;
+constexpr BYTE VARIABLE_STORE_HEALTHY = 0xFE;
+constexpr UINT16 VARIABLE_START_ID = 0x55AA;
+constexpr size_t VARIABLE_STATE_OFFSET = 2;
+constexpr size_t VARIABLE_ATTRIBUTES_OFFSET = 4;
+
+// State bits are only ever cleared as a record ages.
+constexpr BYTE VAR_IN_DELETED_TRANSITION = 0xFE;
+constexpr BYTE VAR_DELETED = 0xFD;
+constexpr BYTE VAR_HEADER_VALID_ONLY = 0x7F;
+constexpr BYTE VAR_ADDED = 0x3F;
+
+// gEfiAuthenticatedVariableGuid {AAF32C78-947B-439A-A180-2E144EC37792}
+constexpr BYTE AUTHENTICATED_VARIABLE_STORE_GUID[16] = {
+    0x78, 0x2C, 0xF3, 0xAA, 0x7B, 0x94, 0x9A, 0x43, 0xA1, 0x80, 0x2E, 0x14, 0x4E, 0xC3, 0x77, 0x92 };
+// gEfiVariableGuid {DDCF3616-3275-4164-98B6-FE85707FFE7D}
+constexpr BYTE VARIABLE_STORE_GUID[16] = {
+    0x16, 0x36, 0xCF, 0xDD, 0x75, 0x32, 0x64, 0x41, 0x98, 0xB6, 0xFE, 0x85, 0x70, 0x7F, 0xFE, 0x7D };
+
+// Field offsets that differ between AUTHENTICATED_VARIABLE_HEADER and the
+// plain VARIABLE_HEADER; StartId, State and Attributes lead both.
+struct VariableHeaderLayout {
+    size_t Size;
+    size_t NameSize;
+    size_t DataSize;
+    size_t VendorGuid;
+};
+
+constexpr VariableHeaderLayout AUTHENTICATED_VARIABLE_LAYOUT = { 60, 36, 40, 44 };
+constexpr VariableHeaderLayout PLAIN_VARIABLE_LAYOUT = { 32, 8, 12, 16 };
+
+constexpr size_t AlignVariable(size_t n) { return (n + 3) & ~static_cast<size_t>(3); }
+
+class VarStoreEfiBackend : public EfiVarBackend {
+public:
+    bool Open(const std::wstring& path) {
+        if (!file_.Open(path, true)) {
+            return false;
+        }
+        if (!Parse()) {
+            Err() << L"'" << path << L"' is not an EDK II variable store: " << error_ << L".\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool Flush() const { return file_.Flush(); }
+
+    bool Enumerate(std::vector<EfiVariable>& vars) override {
+        for (const auto& r : records_) {
+            EfiVariable v;
+            v.Guid = r.Guid;
+            v.Name = r.Name;
+            v.Attributes = r.Attributes;
+            const BYTE* data = DataOf(r);
+            v.Data.assign(data, data + r.DataSize);
+            vars.push_back(std::move(v));
+        }
+        return true;
+    }
+
+    DWORD Read(const wchar_t* name, const wchar_t* guid, void* buf, DWORD size, DWORD* attrs) override {
+        const Record* r = Find(guid, name);
+        if (!r) {
+            SetLastError(ERROR_ENVVAR_NOT_FOUND);
+            return 0;
+        }
+        if (r->DataSize > size || !buf) {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return 0;
+        }
+
+        memcpy(buf, DataOf(*r), r->DataSize);
+        if (attrs) {
+            *attrs = r->Attributes;
+        }
+        return static_cast<DWORD>(r->DataSize);
+    }
+
+    bool Write(const wchar_t* name, const wchar_t* guid, const void* data, DWORD size, DWORD attrs) override {
+        BYTE* p = file_.MutableData();
+        const Record* old = Find(guid, name);
+
+        if (size == 0) {
+            if (!old) {
+                SetLastError(ERROR_ENVVAR_NOT_FOUND);
+                return false;
+            }
+            p[old->Offset + VARIABLE_STATE_OFFSET] &= VAR_DELETED;
+            Parse();
+            return true;
+        }
+
+        // A rewrite keeps the old header so MonotonicCount, TimeStamp and
+        // PubKeyIndex of authenticated stores carry over.
+        const size_t nameLength = wcslen(name);
+        std::vector<BYTE> rec(layout_->Size + (nameLength + 1) * sizeof(UINT16) + size, 0);
+        if (old) {
+            memcpy(rec.data(), p + old->Offset, layout_->Size);
+        }
+        GUID vendor = {};
+        ParseGuid(guid, vendor);
+        StoreLe<UINT16>(&rec[0], VARIABLE_START_ID);
+        rec[VARIABLE_STATE_OFFSET] = VAR_HEADER_VALID_ONLY;
+        rec[VARIABLE_STATE_OFFSET + 1] = 0;
+        StoreLe<UINT32>(&rec[VARIABLE_ATTRIBUTES_OFFSET], attrs);
+        StoreLe<UINT32>(&rec[layout_->NameSize], static_cast<UINT32>((nameLength + 1) * sizeof(UINT16)));
+        StoreLe<UINT32>(&rec[layout_->DataSize], size);
+        StoreGuid(&rec[layout_->VendorGuid], vendor);
+        StoreUcs2(&rec[layout_->Size], name, nameLength);
+        memcpy(&rec[rec.size() - size], data, size);
+
+        if (rec.size() > end_ - free_) {
+            return Reclaim(old, rec);
+        }
+
+        // Same sequence as the firmware, so a torn write leaves a store it
+        // recovers from: old copy in transition, new header, data, added,
+        // old copy deleted.
+        const size_t at = free_;
+        if (old) {
+            p[old->Offset + VARIABLE_STATE_OFFSET] &= VAR_IN_DELETED_TRANSITION;
+        }
+        memcpy(p + at, rec.data(), rec.size());
+        p[at + VARIABLE_STATE_OFFSET] &= VAR_ADDED;
+        if (old) {
+            p[old->Offset + VARIABLE_STATE_OFFSET] &= VAR_DELETED;
+        }
+        Parse();
+        return true;
+    }
+
+private:
+    struct Record {
+        size_t Offset = 0;
+        size_t NameSize = 0;
+        size_t DataSize = 0;
+        DWORD Attributes = 0;
+        std::wstring Guid;
+        std::wstring Name;
+    };
+
+    // Validates the headers and indexes the live records. Walking stops at the
+    // first slot without a start ID, which is where the next record goes.
+    bool Parse() {
+        const BYTE* p = file_.Data();
+        const size_t n = file_.Size();
+        records_.clear();
+        index_.clear();
+
+        if (n < FV_HEADER_LENGTH_OFFSET + sizeof(UINT16) || LoadLe<UINT32>(p + FV_SIGNATURE_OFFSET) != FV_SIGNATURE) {
+            error_ = L"no firmware volume header";
+            return false;
+        }
+        const size_t store = LoadLe<UINT16>(p + FV_HEADER_LENGTH_OFFSET);
+        if (store > n || n - store < VARIABLE_STORE_HEADER_SIZE) {
+            error_ = L"truncated variable store header";
+            return false;
+        }
+        if (memcmp(p + store, AUTHENTICATED_VARIABLE_STORE_GUID, 16) == 0) {
+            layout_ = &AUTHENTICATED_VARIABLE_LAYOUT;
+        } else if (memcmp(p + store, VARIABLE_STORE_GUID, 16) == 0) {
+            layout_ = &PLAIN_VARIABLE_LAYOUT;
+        } else {
+            error_ = L"unknown variable store signature";
+            return false;
+        }
+        const size_t size = LoadLe<UINT32>(p + store + 16);
+        if (size < VARIABLE_STORE_HEADER_SIZE || size > n - store) {
+            error_ = L"variable store size out of range";
+            return false;
+        }
+        if (p[store + 20] != VARIABLE_STORE_FORMATTED || p[store + 21] != VARIABLE_STORE_HEALTHY) {
+            error_ = L"variable store is not formatted and healthy";
+            return false;
+        }
+
+        begin_ = AlignVariable(store + VARIABLE_STORE_HEADER_SIZE);
+        end_ = store + size;
+        size_t off = begin_;
+        std::wstring key;
+        while (off < end_ && end_ - off >= layout_->Size && LoadLe<UINT16>(p + off) == VARIABLE_START_ID) {
+            Record r;
+            r.Offset = off;
+            r.NameSize = LoadLe<UINT32>(p + off + layout_->NameSize);
+            r.DataSize = LoadLe<UINT32>(p + off + layout_->DataSize);
+            const size_t room = end_ - off - layout_->Size;
+            if (r.NameSize > room || r.DataSize > room - r.NameSize) {
+                break;    // torn record; nothing valid follows it
+            }
+
+            const BYTE state = p[off + VARIABLE_STATE_OFFSET];
+            if (state == VAR_ADDED || state == (VAR_ADDED & VAR_IN_DELETED_TRANSITION)) {
+                r.Attributes = LoadLe<UINT32>(p + off + VARIABLE_ATTRIBUTES_OFFSET);
+                r.Guid = FormatGuid(LoadGuid(p + off + layout_->VendorGuid));
+                r.Name.resize(r.NameSize / sizeof(UINT16));
+                CopyUcs2(&r.Name[0], p + off + layout_->Size, r.Name.size());
+                r.Name.resize(wcsnlen(r.Name.c_str(), r.Name.size()));
+
+                // A copy still in transition loses to a later added one; that
+                // is an update the firmware did not get to finish.
+                AssignEfiVarKey(key, r.Guid.c_str(), r.Name.c_str());
+                const auto it = index_.find(key);
+                if (it == index_.end()) {
+                    index_[key] = records_.size();
+                    records_.push_back(std::move(r));
+                } else if (state == VAR_ADDED) {
+                    records_[it->second] = std::move(r);
+                }
+            }
+            off = AlignVariable(off + layout_->Size + LoadLe<UINT32>(p + off + layout_->NameSize) +
+                                LoadLe<UINT32>(p + off + layout_->DataSize));
+        }
+        free_ = std::min(off, end_);
+        return true;
+    }
+
+    // Rewrites the store with its live records, minus the one being replaced,
+    // followed by the new record, and erases the rest.
+    bool Reclaim(const Record* replaced, std::vector<BYTE> rec) {
+        BYTE* p = file_.MutableData();
+        std::vector<BYTE> packed;
+        packed.reserve(end_ - begin_);
+        for (const auto& r : records_) {
+            if (&r == replaced) {
+                continue;
+            }
+            const size_t at = packed.size();
+            packed.insert(packed.end(), p + r.Offset, p + r.Offset + layout_->Size + r.NameSize + r.DataSize);
+            packed[at + VARIABLE_STATE_OFFSET] = VAR_ADDED;
+            packed.resize(AlignVariable(packed.size()), 0xFF);
+        }
+        rec[VARIABLE_STATE_OFFSET] = VAR_ADDED;
+        packed.insert(packed.end(), rec.begin(), rec.end());
+
+        if (packed.size() > end_ - begin_) {
+            SetLastError(ERROR_DISK_FULL);
+            return false;
+        }
+        memcpy(p + begin_, packed.data(), packed.size());
+        memset(p + begin_ + packed.size(), 0xFF, end_ - begin_ - packed.size());
+        Parse();
+        return true;
+    }
+
+    const Record* Find(const wchar_t* guid, const wchar_t* name) {
+        AssignEfiVarKey(probe_, guid, name);
+        const auto it = index_.find(probe_);
+        return it == index_.end() ? nullptr : &records_[it->second];
+    }
+
+    const BYTE* DataOf(const Record& r) const { return file_.Data() + r.Offset + layout_->Size + r.NameSize; }
+
+    MappedFile file_;
+    const VariableHeaderLayout* layout_ = &AUTHENTICATED_VARIABLE_LAYOUT;
+    size_t begin_ = 0;    // first record
+    size_t free_ = 0;     // where the next record goes
+    size_t end_ = 0;      // end of the variable store
+    std::vector<Record> records_;    // live records, in store order
+    std::unordered_map<std::wstring, size_t> index_;
+    std::wstring probe_;
+    std::wstring error_;
+};
+
+// ----------------- Commands -----------------
+void AppendEntryRecord(RecordWriter& out, size_t position, UINT16 id, const LoadOptionView& lo, DWORD varAttrs,
+                       bool isCurrent, bool isNext, const wchar_t* status) {
+    BeginBootRecord(out, position, id);
+    out.String(L"status", status);
+    out.Number(L"attributes", lo.Attributes);
+    out.Bool(L"active", (lo.Attributes & LOAD_OPTION_ACTIVE) != 0);
+    out.Bool(L"force_reconnect", (lo.Attributes & LOAD_OPTION_FORCE_RECONNECT) != 0);
+    out.Bool(L"hidden", (lo.Attributes & LOAD_OPTION_HIDDEN) != 0);
+    out.Ucs2(L"description", lo.Description);
+    out.Number(L"device_path_length", lo.DevicePath.Size);
+    out.Hex(L"device_path_hex", lo.DevicePath);
+    std::wstring path;
+    const BootPathClass cls = AppendDevicePathText(path, lo.DevicePath);
+    out.String(L"device_path", path);
+    out.String(L"boot_type", BootPathClassName(cls));
+    out.Number(L"optional_data_length", lo.OptionalData.Size);
+    out.Number(L"variable_attributes", varAttrs);
+    out.Bool(L"current", isCurrent);
+    out.Bool(L"next", isNext);
+    out.End();
+}
+
+// With all set, every Boot#### found by enumeration is reported: entries in
+// BootOrder, orphans (present but not in BootOrder) and dangling BootOrder
+// references (listed but not present).
+int cmd_list(OutputFormat format = OutputFormat::Text, bool all = false) {
+    DWORD attrs = 0;
+    std::vector<BYTE> orderScratch;
+    ByteSpan order;
+
+    if (!ReadEfiVarView(L"BootOrder", attrs, order, orderScratch) || (order.Size % sizeof(UINT16) != 0)) {
+        Err() << L"Could not read BootOrder: " << LastErrorMessage() << L"\n";
+        return 1;
+    }
+
+    const size_t n = order.Size / sizeof(UINT16);
+    auto orderAt = [&](size_t i) {
+        UINT16 id = 0;
+        memcpy(&id, order.Data + i * sizeof(UINT16), sizeof(UINT16));
+        return id;
+    };
+
+    BootIdSet present;
+    std::vector<UINT16> orphans;
+    size_t dangling = 0;
+    if (all) {
+        if (!CollectBootIds(present)) {
+            Err() << L"list --all needs variable enumeration: " << LastErrorMessage() << L"\n";
+            return 1;
+        }
+
+        BootIdSet listed;
+        for (size_t i = 0; i < n; ++i) {
+            listed.Insert(orderAt(i));
+            dangling += present.Contains(orderAt(i)) ? 0 : 1;
+        }
+        for (int id = present.NextAtOrAfter(0); id >= 0; id = present.NextAtOrAfter(static_cast<UINT32>(id) + 1)) {
+            if (!listed.Contains(static_cast<UINT16>(id))) {
+                orphans.push_back(static_cast<UINT16>(id));
+            }
+        }
+    }
+
+    GlobalValues globals;
+    ReadGlobals(globals, GlobalBit(GLOBAL_BOOT_CURRENT) | GlobalBit(GLOBAL_BOOT_NEXT));
+
+    std::vector<BYTE> scratch;
+    ByteSpan raw;
+    LoadOptionView lo;
+    DWORD entryAttrs = 0;
+    auto readEntry = [&](UINT16 id) {
+        return ReadEfiVarView(MakeBootVarName(id).c_str(), entryAttrs, raw, scratch) &&
+               ParseLoadOptionView(raw.Data, raw.Size, lo);
+    };
+
+    if (format != OutputFormat::Text) {
+        // BootCurrent/BootNext become flags on the matching entry records.
+        int current = -1;
+        int next = -1;
+        UINT16 value = 0;
+        if (globals.Get(GLOBAL_BOOT_CURRENT, value)) {
+            current = value;
+        }
+        if (globals.Get(GLOBAL_BOOT_NEXT, value)) {
+            next = value;
+        }
+
+        RecordWriter out(format);
+        for (size_t i = 0; i < n; ++i) {
+            const UINT16 id = orderAt(i);
+            if (all && !present.Contains(id)) {
+                BeginBootRecord(out, i + 1, id);
+                out.String(L"status", L"dangling");
+                out.String(L"error", L"missing");
+                out.End();
+            } else if (readEntry(id)) {
+                AppendEntryRecord(out, i + 1, id, lo, entryAttrs, id == current, id == next, L"ordered");
+            } else {
+                BeginBootRecord(out, i + 1, id);
+                out.String(L"status", L"ordered");
+                out.String(L"error", L"unreadable");
+                out.End();
+            }
+        }
+        // Orphans have no BootOrder position; they are reported as 0.
+        for (const UINT16 id : orphans) {
+            if (readEntry(id)) {
+                AppendEntryRecord(out, 0, id, lo, entryAttrs, id == current, id == next, L"orphaned");
+            } else {
+                BeginBootRecord(out, 0, id);
+                out.String(L"status", L"orphaned");
+                out.String(L"error", L"unreadable");
+                out.End();
+            }
+        }
+        out.Finish();
+        return 0;
+    }
+
+    // Entries are formatted into one buffer and written in large blocks.
+    std::wstring text;
+    text.reserve(16384);
+    for (const GlobalIndex i : { GLOBAL_BOOT_CURRENT, GLOBAL_BOOT_NEXT }) {
+        if (globals.Present[i]) {
+            text += GLOBAL_VARS[i].Name;
+            text += L": ";
+            if (!AppendGlobalText(text, globals, i)) {
+                text += L"(malformed)";
+            }
+            text += L"\n";
+        }
+    }
+    auto flushText = [&](size_t threshold) {
+        if (text.size() >= threshold) {
+            Out().write(text.data(), static_cast<std::streamsize>(text.size()));
+            text.clear();
+        }
+    };
+    auto appendNote = [&](size_t index, size_t total, UINT16 id, const wchar_t* note) {
+        text += L"\n[";
+        AppendDec(text, index);
+        text += L"/";
+        AppendDec(text, total);
+        text += L"] ";
+        text += MakeBootVarName(id).c_str();
+        text += note;
+    };
+
+    for (size_t i = 0; i < n; ++i) {
+        const UINT16 id = orderAt(i);
+        if (all && !present.Contains(id)) {
+            appendNote(i + 1, n, id, L": (missing, listed in BootOrder only)\n");
+        } else if (readEntry(id)) {
+            AppendEntry(text, id, i + 1, n, lo);
+        } else {
+            appendNote(i + 1, n, id, L": (unreadable)\n");
+        }
+        flushText(8192);
+    }
+
+    if (all) {
+        text += L"\nOrphaned entries (not in BootOrder): ";
+        AppendDec(text, orphans.size());
+        text += L"\n";
+        for (size_t i = 0; i < orphans.size(); ++i) {
+            if (readEntry(orphans[i])) {
+                AppendEntry(text, orphans[i], i + 1, orphans.size(), lo);
+            } else {
+                appendNote(i + 1, orphans.size(), orphans[i], L": (unreadable)\n");
+            }
+            flushText(8192);
+        }
+
+        text += L"\nSummary: ";
+        AppendDec(text, present.Count());
+        text += L" present, ";
+        AppendDec(text, n - dangling);
+        text += L" in BootOrder, ";
+        AppendDec(text, orphans.size());
+        text += L" orphaned, ";
+        AppendDec(text, dangling);
+        text += L" dangling\n";
+    }
+
+    flushText(0);
+    return 0;
+}
+
+int cmd_order_show(OutputFormat format = OutputFormat::Text) {
+    const auto order = GetBootOrder();
+    if (order.empty()) {
+        Err() << L"BootOrder empty: " << LastErrorMessage() << L"\n";
+        return 1;
+    }
+
+    if (format != OutputFormat::Text) {
+        RecordWriter out(format);
+        for (size_t i = 0; i < order.size(); ++i) {
+            BeginBootRecord(out, i + 1, order[i]);
+            out.End();
+        }
+        out.Finish();
+        return 0;
+    }
+
+    Out() << L"BootOrder (" << order.size() << L"):";
+    for (const auto id : order) {
+        Out() << L" " << MakeBootVarName(id);
+    }
+    Out() << L"\n";
+
+    return 0;
+}
+
+int cmd_order_set(const std::wstring& csv) {
+    std::vector<UINT16> newOrder;
+    std::wstringstream ss(csv);
+    std::wstring token;
+
+    while (std::getline(ss, token, L',')) {
+        token.erase(std::remove_if(token.begin(), token.end(), [](wchar_t ch) { return std::iswspace(ch) != 0; }), token.end());
+
+        UINT16 id = 0;
+        if (!ParseBootId(token, id)) {
+            Err() << L"Bad id: " << token << L"\n";
+            return 2;
+        }
+
+        newOrder.push_back(id);
+    }
+
+    if (newOrder.empty()) {
+        Err() << L"No IDs provided.\n";
+        return 2;
+    }
+
+    const auto result = SetBootOrder(newOrder);
+    if (result == WriteResult::Failed) {
+        return 3;
+    }
+
+    if (result == WriteResult::Unchanged) {
+        Out() << L"BootOrder unchanged.\n";
+        return EXIT_UNCHANGED;
+    }
+
+    Out() << L"BootOrder updated.\n";
+    return 0;
+}
+
+int cmd_select(const std::wstring& idhex) {
+    auto order = GetBootOrder();
+    if (order.empty()) {
+        return 1;
+    }
+
+    UINT16 target = 0;
+    if (!ParseBootId(idhex, target)) {
+        Err() << L"Bad id.\n";
+        return 2;
+    }
+
+    auto it = std::find(order.begin(), order.end(), target);
+    if (it == order.end()) {
+        Err() << L"ID not found in BootOrder.\n";
+        return 3;
+    }
+
+    std::rotate(order.begin(), it, it + 1); // bring to front
+    const auto result = SetBootOrder(order);
+    if (result == WriteResult::Failed) {
+        return 4;
+    }
+
+    if (result == WriteResult::Unchanged) {
+        Out() << L"Default boot already " << MakeBootVarName(target) << L" (unchanged).\n";
+        return EXIT_UNCHANGED;
+    }
+
+    Out() << L"Default boot set to " << MakeBootVarName(target) << L".\n";
+    return 0;
+}
+
+int cmd_next(const std::wstring& idhex) {
+    UINT16 target = 0;
     if (!ParseBootId(idhex, target)) {
-        std::wcerr << L"Bad id.\n";
+        Err() << L"Bad id.\n";
+        return 2;
+    }
+
+    const auto result = WriteEfiVar(L"BootNext", &target, sizeof(target), g_varAttrsRW);
+    if (result == WriteResult::Failed) {
+        return 3;
+    }
+
+    if (result == WriteResult::Unchanged) {
+        Out() << L"BootNext already " << MakeBootVarName(target) << L" (unchanged).\n";
+        return EXIT_UNCHANGED;
+    }
+
+    Out() << L"BootNext set to " << MakeBootVarName(target) << L" (one-time).\n";
+    return 0;
+}
+
+int cmd_globals(OutputFormat format = OutputFormat::Text) {
+    GlobalValues globals;
+    ReadGlobals(globals);
+
+    if (format != OutputFormat::Text) {
+        RecordWriter out(format);
+        out.Begin();
+        for (size_t i = 0; i < GLOBAL_VAR_COUNT; ++i) {
+            AppendGlobalField(out, globals, static_cast<GlobalIndex>(i));
+        }
+        out.End();
+        out.Finish();
+        return 0;
+    }
+
+    std::wstring text;
+    for (size_t i = 0; i < GLOBAL_VAR_COUNT; ++i) {
+        const auto index = static_cast<GlobalIndex>(i);
+        text += GLOBAL_VARS[i].Name;
+        text.append(24 - std::min<size_t>(wcslen(GLOBAL_VARS[i].Name), 23), L' ');
+        if (!globals.Present[i]) {
+            text += L"(not set)";
+        } else if (!AppendGlobalText(text, globals, index)) {
+            text += L"(malformed, ";
+            AppendDec(text, globals.Values[i].Size);
+            text += L" bytes)";
+        }
+        text += L"\n";
+    }
+    Out().write(text.data(), static_cast<std::streamsize>(text.size()));
+    return 0;
+}
+
+int cmd_timeout_show(OutputFormat format = OutputFormat::Text) {
+    GlobalValues globals;
+    ReadGlobals(globals, GlobalBit(GLOBAL_TIMEOUT));
+
+    if (format != OutputFormat::Text) {
+        RecordWriter out(format);
+        out.Begin();
+        AppendGlobalField(out, globals, GLOBAL_TIMEOUT);
+        out.End();
+        out.Finish();
+        return 0;
+    }
+
+    std::wstring text = L"Timeout: ";
+    if (!globals.Present[GLOBAL_TIMEOUT]) {
+        text += L"(not set)";
+    } else if (!AppendGlobalText(text, globals, GLOBAL_TIMEOUT)) {
+        text += L"(malformed)";
+    }
+    text += L"\n";
+    Out() << text;
+    return 0;
+}
+
+int cmd_timeout_set(const std::wstring& secondsText) {
+    wchar_t* end = nullptr;
+    const unsigned long seconds = wcstoul(secondsText.c_str(), &end, 10);
+    if (secondsText.empty() || *end != L'\0' || seconds > 0xFFFF) {
+        Err() << L"Timeout must be 0-65535 seconds (65535 waits indefinitely).\n";
+        return 2;
+    }
+
+    const UINT16 value = static_cast<UINT16>(seconds);
+    const auto result = WriteEfiVar(L"Timeout", &value, sizeof(value), g_varAttrsRW);
+    if (result == WriteResult::Failed) {
+        return 3;
+    }
+
+    if (result == WriteResult::Unchanged) {
+        Out() << L"Timeout already " << value << L" s (unchanged).\n";
+        return EXIT_UNCHANGED;
+    }
+
+    Out() << L"Timeout set to " << value << L" s.\n";
+    return 0;
+}
+
+int cmd_enable_disable(const std::wstring& idhex, bool enable) {
+    UINT16 id = 0;
+    if (!ParseBootId(idhex, id)) {
+        Err() << L"Bad id.\n";
+        return 2;
+    }
+
+    std::vector<BYTE> blob;
+    LoadOptionView view;
+    if (!ReadBootEntryBlob(id, blob, view)) {
+        Err() << L"Entry not found.\n";
+        return 3;
+    }
+
+    const UINT32 attributes = enable
+        ? (view.Attributes | LOAD_OPTION_ACTIVE)
+        : (view.Attributes & ~LOAD_OPTION_ACTIVE);
+    PatchLoadOptionAttributes(blob, attributes);
+
+    const auto result = WriteBootEntryBlob(id, blob);
+    if (result == WriteResult::Failed) {
+        return 4;
+    }
+
+    if (result == WriteResult::Unchanged) {
+        Out() << MakeBootVarName(id) << (enable ? L" already enabled" : L" already disabled") << L" (unchanged).\n";
+        return EXIT_UNCHANGED;
+    }
+
+    Out() << (enable ? L"Enabled " : L"Disabled ") << MakeBootVarName(id) << L".\n";
+    return 0;
+}
+
+int cmd_rename(const std::wstring& idhex, const std::wstring& newLabel) {
+    UINT16 id = 0;
+    if (!ParseBootId(idhex, id)) {
+        Err() << L"Bad id.\n";
+        return 2;
+    }
+
+    std::vector<BYTE> blob;
+    LoadOptionView view;
+    if (!ReadBootEntryBlob(id, blob, view)) {
+        Err() << L"Entry not found.\n";
+        return 3;
+    }
+
+    if (!SpliceLoadOptionDescription(blob, newLabel)) {
+        Err() << L"Entry is malformed.\n";
+        return 3;
+    }
+
+    const auto result = WriteBootEntryBlob(id, blob);
+    if (result == WriteResult::Failed) {
+        return 4;
+    }
+
+    if (result == WriteResult::Unchanged) {
+        Out() << MakeBootVarName(id) << L" already named '" << newLabel << L"' (unchanged).\n";
+        return EXIT_UNCHANGED;
+    }
+
+    Out() << L"Renamed " << MakeBootVarName(id) << L" to '" << newLabel << L"'.\n";
+    return 0;
+}
+
+// Appends data as rows of 16 spaced hex bytes prefixed with their offset in
+// the variable, e.g. "        0006: 57 00 69 00 ...".
+void AppendHexRows(std::wstring& out, const wchar_t* label, const BYTE* base, size_t offset, size_t n) {
+    out += L"    ";
+    out += label;
+    out += L" (";
+    AppendDec(out, n);
+    out += L" bytes)\n";
+
+    for (size_t row = 0; row < n; row += 16) {
+        const size_t count = std::min<size_t>(n - row, 16);
+        out += L"        ";
+        AppendHex(out, offset + row, 4);
+        out += L": ";
+        const size_t at = out.size();
+        out.resize(at + count * 3);
+        EncodeHexSpaced(&out[at], base + offset + row, count);
+        out.back() = L'\n';
+    }
+}
+
+// Full hex of one load option, split at the field boundaries when it parses.
+void AppendRawEntry(std::wstring& out, ByteSpan data) {
+    LoadOptionView lo;
+    if (!ParseLoadOptionView(data.Data, data.Size, lo)) {
+        AppendHexRows(out, L"data", data.Data, 0, data.Size);
+        return;
+    }
+
+    const size_t descOffset = BOOT_OPTION_HEADER_SIZE;
+    const size_t pathOffset = static_cast<size_t>(lo.DevicePath.Data - data.Data);
+    const size_t optOffset = pathOffset + lo.DevicePath.Size;
+    AppendHexRows(out, L"header", data.Data, 0, descOffset);
+    AppendHexRows(out, L"description", data.Data, descOffset, pathOffset - descOffset);
+    AppendHexRows(out, L"device path", data.Data, pathOffset, lo.DevicePath.Size);
+    AppendHexRows(out, L"optional data", data.Data, optOffset, data.Size - optOffset);
+}
+
+// Runs body with its writes staged and commits them together, so a command
+// that touches several variables lands as one planned set of writes. Commit
+// applies them by CommitRank: entries first, then BootOrder, then BootNext,
+// then deletes.
+// Inside a batch the batch's own transaction collects them instead.
+template <typename Body>
+int RunStaged(Body body) {
+    if (g_txn) {
+        return body();
+    }
+
+    WriteTransaction txn;
+    g_txn = &txn;
+    const int rc = body();
+    g_txn = nullptr;
+    if (rc != 0) {
+        return rc;
+    }
+
+    size_t written = 0;
+    size_t unchanged = 0;
+    if (!txn.Commit(written, unchanged)) {
+        Err() << txn.Pending().size() << L" staged write(s) were not committed.\n";
+        return 4;
+    }
+    return 0;
+}
+
+// Lowest Boot#### ID that neither exists nor appears in BootOrder. Uses the
+// enumeration bitmap; only without enumeration does it read IDs upward.
+bool AllocateBootId(UINT16& id) {
+    BootIdSet used;
+    const bool enumerated = CollectBootIds(used);
+    for (const auto listed : GetBootOrder()) {
+        used.Insert(listed);
+    }
+
+    if (enumerated) {
+        return used.FindFree(id);
+    }
+
+    for (UINT32 probe = 0; probe <= 0xFFFF; ++probe) {
+        const UINT16 candidate = static_cast<UINT16>(probe);
+        if (used.Contains(candidate)) {
+            continue;
+        }
+        DWORD attrs = 0;
+        if (ReadEfiVar(MakeBootVarName(candidate), attrs).empty() && GetLastError() == ERROR_ENVVAR_NOT_FOUND) {
+            id = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct CreateOptions {
+    std::wstring File;            // ESP path to an EFI application
+    std::wstring Uri;             // HTTP(S) boot URI
+    std::wstring DevicePathHex;   // prebuilt device path
+    std::wstring Description;
+    std::wstring DataHex;
+    bool Active = false;
+    bool First = false;
+};
+
+int cmd_create(const CreateOptions& opts) {
+    const int sources = !opts.File.empty() + !opts.Uri.empty() + !opts.DevicePathHex.empty();
+    if (sources != 1 || opts.Description.empty()) {
+        Err() << L"create needs --desc and exactly one of --file, --uri or --devpath.\n";
+        return 2;
+    }
+
+    ParsedLoadOption plo;
+    plo.Attributes = opts.Active ? LOAD_OPTION_ACTIVE : 0;
+    plo.Description = opts.Description;
+
+    if (!opts.DevicePathHex.empty()) {
+        if (!FromHex(opts.DevicePathHex, plo.DevicePath) ||
+            !IsWellFormedDevicePath(ByteSpan{ plo.DevicePath.data(), plo.DevicePath.size() })) {
+            Err() << L"--devpath must be a complete device path in hex, ending with 7fff0400.\n";
+            return 2;
+        }
+    } else if (!opts.Uri.empty()) {
+        if (!BuildUriDevicePath(opts.Uri, plo.DevicePath)) {
+            return 2;
+        }
+    } else if (!BuildFileDevicePath(opts.File, plo.DevicePath)) {
+        return 1;
+    }
+
+    if (!opts.DataHex.empty() && !FromHex(opts.DataHex, plo.OptionalData)) {
+        Err() << L"--data must be hex.\n";
+        return 2;
+    }
+    if (plo.DevicePath.size() > 0xFFFF) {
+        Err() << L"Device path too long.\n";
+        return 2;
+    }
+    plo.FilePathListLength = static_cast<UINT16>(plo.DevicePath.size());
+
+    UINT16 id = 0;
+    if (!AllocateBootId(id)) {
+        Err() << L"No free Boot#### ID.\n";
+        return 3;
+    }
+
+    // The entry is staged before BootOrder, so BootOrder never names an entry
+    // that has not been written yet.
+    size_t position = 0;
+    const int rc = RunStaged([&] {
+        if (WriteBootEntry(id, plo) == WriteResult::Failed) {
+            return 4;
+        }
+        auto order = GetBootOrder();
+        order.insert(opts.First ? order.begin() : order.end(), id);
+        position = opts.First ? 1 : order.size();
+        return SetBootOrder(order) == WriteResult::Failed ? 4 : 0;
+    });
+    if (rc != 0) {
+        return rc;
+    }
+
+    Out() << L"Created " << MakeBootVarName(id) << L" at position " << position << L" in BootOrder.\n";
+    return 0;
+}
+
+// Drops the entry from BootOrder and BootNext before deleting it, so neither
+// is ever left pointing at a missing variable.
+int cmd_remove(const std::wstring& idhex) {
+    UINT16 id = 0;
+    if (!ParseBootId(idhex, id)) {
+        Err() << L"Bad id.\n";
+        return 2;
+    }
+
+    const auto name = MakeBootVarName(id);
+    DWORD attrs = 0;
+    if (ReadEfiVar(name, attrs).empty()) {
+        Err() << name << L": entry not found.\n";
+        return 3;
+    }
+
+    bool droppedFromOrder = false;
+    bool clearedNext = false;
+    const int rc = RunStaged([&] {
+        auto order = GetBootOrder();
+        const size_t before = order.size();
+        order.erase(std::remove(order.begin(), order.end(), id), order.end());
+        if (order.size() != before) {
+            droppedFromOrder = true;
+            if (SetBootOrder(order) == WriteResult::Failed) {
+                return 4;
+            }
+        }
+
+        DWORD nextAttrs = 0;
+        const auto next = ReadEfiVar(L"BootNext", nextAttrs);
+        if (next.size() == sizeof(UINT16) && memcmp(next.data(), &id, sizeof(UINT16)) == 0) {
+            clearedNext = true;
+            if (WriteEfiVar(L"BootNext", nullptr, 0, g_varAttrsRW) == WriteResult::Failed) {
+                return 4;
+            }
+        }
+
+        return WriteEfiVar(name, nullptr, 0, g_varAttrsRW) == WriteResult::Failed ? 4 : 0;
+    });
+    if (rc != 0) {
+        return rc;
+    }
+
+    Out() << L"Removed " << name;
+    if (droppedFromOrder) {
+        Out() << L", dropped it from BootOrder";
+    }
+    if (clearedNext) {
+        Out() << L", cleared BootNext";
+    }
+    Out() << L".\n";
+    return 0;
+}
+
+int cmd_dump(OutputFormat format = OutputFormat::Text, bool raw = false) {
+    DWORD attrs = 0;
+    const auto orderRaw = ReadEfiVar(L"BootOrder", attrs);
+    if (orderRaw.empty()) {
+        Err() << L"BootOrder read failed: " << LastErrorMessage() << L"\n";
+        return 1;
+    }
+
+    const auto order = GetBootOrder();
+    std::vector<BYTE> scratch;
+
+    if (format != OutputFormat::Text) {
+        RecordWriter out(format);
+        for (size_t i = 0; i < order.size(); ++i) {
+            DWORD varAttrs = 0;
+            ByteSpan data;
+            const bool ok = ReadEfiVarView(MakeBootVarName(order[i]).c_str(), varAttrs, data, scratch);
+            BeginBootRecord(out, i + 1, order[i]);
+            if (ok) {
+                out.Number(L"size", data.Size);
+                out.Number(L"variable_attributes", varAttrs);
+                out.Hex(L"data_hex", data);
+            } else {
+                out.String(L"error", L"unreadable");
+            }
+            out.End();
+        }
+        out.Finish();
+        return 0;
+    }
+
+    Out() << L"BootOrder bytes: " << orderRaw.size() << L"\n";
+
+    std::wstring text;
+    size_t index = 0;
+    for (const auto id : order) {
+        DWORD varAttrs = 0;
+        const auto name = MakeBootVarName(id);
+        ByteSpan data;
+        ReadEfiVarView(name.c_str(), varAttrs, data, scratch);
+
+        Out() << L"[" << ++index << L"] "
+                   << name
+                   << L" size=" << data.Size
+                   << L" attrs=0x" << std::hex << varAttrs << std::dec
+                   << L"\n";
+
+        if (raw && data.Size > 0) {
+            // Sized up front: about 3.3 characters per byte plus row prefixes.
+            text.clear();
+            text.reserve(data.Size * 4 + 256);
+            AppendRawEntry(text, data);
+            Out().write(text.data(), static_cast<std::streamsize>(text.size()));
+        }
+    }
+
+    return 0;
+}
+
+int cmd_capture(const std::wstring& path) {
+    RecordingEfiBackend recorder(*g_backend);
+    EfiVarBackend* previous = g_backend;
+    g_backend = &recorder;
+
+    std::vector<EfiVariable> vars;
+    if (!recorder.Enumerate(vars)) {
+        Err() << L"Enumeration unavailable; capturing boot variables only.\n";
+        vars.clear();
+
+        const wchar_t* names[] = { L"BootOrder", L"BootCurrent", L"BootNext", L"Timeout" };
+        for (const auto* name : names) {
+            EfiVariable v;
+            v.Guid = EFI_GLOBAL_VARIABLE_GUID;
+            v.Name = name;
+            vars.push_back(v);
+        }
+        for (const auto id : GetBootOrder()) {
+            EfiVariable v;
+            v.Guid = EFI_GLOBAL_VARIABLE_GUID;
+            v.Name = MakeBootVarName(id);
+            vars.push_back(v);
+        }
+    }
+
+    // Time one direct read of every variable so replays know the per-call cost.
+    for (const auto& v : vars) {
+        DWORD attrs = 0;
+        ReadEfiVarDirect(v.Name, attrs, v.Guid.c_str());
+    }
+
+    g_backend = previous;
+
+    if (!recorder.Save(path)) {
+        return 1;
+    }
+
+    Out() << L"Captured " << recorder.Variables().size() << L" variable(s) to " << path << L".\n";
+    return 0;
+}
+
+// Resolves every Boot#### to its loader on the ESP. Exits 3 when any entry
+// points at a file or partition that is not there.
+int cmd_loaders(OutputFormat format) {
+    const auto ids = ExistingBootIds();
+    if (ids.empty()) {
+        Err() << L"No boot entries found: " << LastErrorMessage() << L"\n";
+        return 1;
+    }
+
+    RecordWriter out(format);
+    size_t broken = 0;
+    std::vector<BYTE> blob;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        LoadOptionView lo;
+        if (!ReadBootEntryBlob(ids[i], blob, lo)) {
+            continue;
+        }
+        std::wstring resolved;
+        const LoaderStatus status = ResolveLoader(lo.DevicePath, resolved);
+        if (status == LoaderStatus::Missing || status == LoaderStatus::NoVolume) {
+            ++broken;
+        }
+
+        if (format != OutputFormat::Text) {
+            BeginBootRecord(out, i, ids[i]);
+            out.Ucs2(L"description", lo.Description);
+            out.String(L"loader", LoaderStatusName(status));
+            if (status == LoaderStatus::NoVolume) {
+                out.String(L"partition", resolved);
+            } else if (status != LoaderStatus::NotFile) {
+                out.String(L"path", resolved);
+            }
+            out.End();
+            continue;
+        }
+
+        std::wstring description;
+        AppendUcs2(description, lo.Description);
+        Out() << MakeBootVarName(ids[i]) << L"  " << std::left << std::setw(9) << LoaderStatusName(status)
+                   << std::right << L"  " << description;
+        if (status == LoaderStatus::NoVolume) {
+            Out() << L"  (partition " << resolved << L")";
+        } else if (status != LoaderStatus::NotFile) {
+            Out() << L"  " << resolved;
+        }
+        Out() << L"\n";
+    }
+    out.Finish();
+    return broken ? 3 : 0;
+}
+
+// ----------------- Batch -----------------
+// Splits one command line into arguments; double quotes group words.
+bool SplitCommandLine(const std::wstring& line, std::vector<std::wstring>& args) {
+    args.clear();
+    std::wstring cur;
+    bool inQuotes = false;
+    bool haveArg = false;
+
+    for (const wchar_t ch : line) {
+        if (ch == L'"') {
+            inQuotes = !inQuotes;
+            haveArg = true;
+        } else if (!inQuotes && std::iswspace(ch)) {
+            if (haveArg) {
+                args.push_back(cur);
+                cur.clear();
+                haveArg = false;
+            }
+        } else {
+            cur.push_back(ch);
+            haveArg = true;
+        }
+    }
+
+    if (haveArg) {
+        args.push_back(cur);
+    }
+
+    return !inQuotes;
+}
+
+int RunCommand(const std::vector<std::wstring>& args);
+
+// Runs one command per line against the in-memory snapshot. Writes are staged
+// and merged per variable, then committed once after the last line succeeds.
+int cmd_batch(const std::wstring& path) {
+    if (g_txn) {
+        Err() << L"Nested batch is not supported.\n";
+        return 2;
+    }
+
+    std::wstring text;
+    if (!ReadTextFile(path, text)) {
+        return 1;
+    }
+
+    WriteTransaction txn;
+    g_txn = &txn;
+
+    std::wstringstream lines(text);
+    std::wstring line;
+    size_t lineNo = 0;
+    size_t commands = 0;
+
+    while (std::getline(lines, line)) {
+        ++lineNo;
+        if (!line.empty() && line.back() == L'\r') {
+            line.pop_back();
+        }
+
+        std::vector<std::wstring> args;
+        if (!SplitCommandLine(line, args)) {
+            Err() << L"Line " << lineNo << L": unterminated quote.\n";
+            g_txn = nullptr;
+            return 2;
+        }
+
+        if (args.empty() || args[0][0] == L'#') {
+            continue;
+        }
+
+        ++commands;
+        const int rc = RunCommand(args);
+        if (rc != 0 && rc != EXIT_UNCHANGED) {
+            Err() << L"Line " << lineNo << L" failed (exit " << rc << L"); nothing was written.\n";
+            g_txn = nullptr;
+            return rc;
+        }
+    }
+
+    g_txn = nullptr;
+
+    size_t written = 0;
+    size_t unchanged = 0;
+    const bool ok = txn.Commit(written, unchanged);
+
+    Out() << L"Batch: " << commands << L" command(s), "
+               << written << L" variable(s) written, "
+               << unchanged << L" unchanged.\n";
+
+    if (!ok) {
+        Err() << txn.Pending().size() << L" staged write(s) were not committed.\n";
+        return 4;
+    }
+
+    return written == 0 ? EXIT_UNCHANGED : 0;
+}
+
+// Lists or rolls back what the journal of an interrupted commit changed.
+int cmd_recover(bool planOnly) {
+    if (g_journalPath.empty()) {
+        Err() << L"Only commits to the firmware are journaled; nothing to recover.\n";
+        return 2;
+    }
+    if (!JournalExists()) {
+        Out() << L"No interrupted commit.\n";
+        return EXIT_UNCHANGED;
+    }
+
+    std::vector<JournalRecord> records;
+    bool complete = false;
+    if (!LoadJournal(records, complete)) {
+        return 1;
+    }
+    if (!complete) {
+        Out() << L"The journal was cut off before any variable was written.\n";
+        if (!planOnly) {
+            DeleteJournal();
+        }
+        return 0;
+    }
+
+    if (planOnly) {
+        size_t planned = 0;
+        for (auto it = records.rbegin(); it != records.rend(); ++it) {
+            Out() << L"  " << it->Name << L": ";
+            if (ReadsBack(it->Name, it->OldData, it->OldAttributes)) {
+                Out() << L"already restored\n";
+                continue;
+            }
+            ++planned;
+            if (it->OldData.empty()) {
+                Out() << L"delete\n";
+            } else {
+                Out() << L"restore " << it->OldData.size() << L" byte(s)\n";
+            }
+        }
+        Out() << L"Plan: " << planned << L" variable write(s).\n";
+        return 0;
+    }
+
+    size_t restored = 0;
+    if (!RollBackJournal(records, restored)) {
+        Err() << L"The journal stays in '" << g_journalPath << L"'.\n";
+        return 4;
+    }
+    DeleteJournal();
+    Out() << L"Recovered: " << restored << L" variable(s) restored.\n";
+    return restored == 0 ? EXIT_UNCHANGED : 0;
+}
+
+// ----------------- JSON -----------------
+struct JsonValue {
+    enum class Kind { Null, Bool, Number, String, Array, Object };
+
+    Kind Type = Kind::Null;
+    bool Bool = false;
+    double Number = 0;
+    std::wstring String;
+    std::vector<JsonValue> Items;
+    std::vector<std::pair<std::wstring, JsonValue>> Members;
+
+    const JsonValue* Get(const std::wstring& key) const {
+        for (const auto& m : Members) {
+            if (m.first == key) {
+                return &m.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// Small recursive-descent reader; enough for desired-state documents.
+class JsonParser {
+public:
+    explicit JsonParser(const std::wstring& text) : text_(text) {}
+
+    bool Parse(JsonValue& out, std::wstring& error) {
+        if (!ParseValue(out, 0)) {
+            error = error_;
+            return false;
+        }
+        SkipSpace();
+        if (pos_ != text_.size()) {
+            error = Fail(L"trailing characters");
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static constexpr int MAX_DEPTH = 32;
+
+    std::wstring Fail(const wchar_t* what) {
+        std::wstringstream ss;
+        ss << what << L" at offset " << pos_;
+        error_ = ss.str();
+        return error_;
+    }
+
+    void SkipSpace() {
+        while (pos_ < text_.size() && std::iswspace(text_[pos_])) {
+            ++pos_;
+        }
+    }
+
+    bool Consume(const wchar_t* word) {
+        const size_t n = wcslen(word);
+        if (text_.compare(pos_, n, word) != 0) {
+            return false;
+        }
+        pos_ += n;
+        return true;
+    }
+
+    bool ParseValue(JsonValue& out, int depth) {
+        if (depth > MAX_DEPTH) {
+            Fail(L"nesting too deep");
+            return false;
+        }
+
+        SkipSpace();
+        if (pos_ >= text_.size()) {
+            Fail(L"unexpected end");
+            return false;
+        }
+
+        const wchar_t ch = text_[pos_];
+        if (ch == L'{') {
+            return ParseObject(out, depth);
+        }
+        if (ch == L'[') {
+            return ParseArray(out, depth);
+        }
+        if (ch == L'"') {
+            out.Type = JsonValue::Kind::String;
+            return ParseString(out.String);
+        }
+        if (Consume(L"true")) {
+            out.Type = JsonValue::Kind::Bool;
+            out.Bool = true;
+            return true;
+        }
+        if (Consume(L"false")) {
+            out.Type = JsonValue::Kind::Bool;
+            out.Bool = false;
+            return true;
+        }
+        if (Consume(L"null")) {
+            out.Type = JsonValue::Kind::Null;
+            return true;
+        }
+        if (ch == L'-' || std::iswdigit(ch)) {
+            const wchar_t* begin = text_.c_str() + pos_;
+            wchar_t* end = nullptr;
+            out.Type = JsonValue::Kind::Number;
+            out.Number = wcstod(begin, &end);
+            pos_ += static_cast<size_t>(end - begin);
+            return true;
+        }
+
+        Fail(L"unexpected character");
+        return false;
+    }
+
+    bool ParseString(std::wstring& out) {
+        ++pos_; // opening quote
+        out.clear();
+
+        while (pos_ < text_.size()) {
+            const wchar_t ch = text_[pos_++];
+            if (ch == L'"') {
+                return true;
+            }
+            if (ch != L'\\') {
+                out.push_back(ch);
+                continue;
+            }
+            if (pos_ >= text_.size()) {
+                break;
+            }
+
+            const wchar_t esc = text_[pos_++];
+            switch (esc) {
+            case L'"': out.push_back(L'"'); break;
+            case L'\\': out.push_back(L'\\'); break;
+            case L'/': out.push_back(L'/'); break;
+            case L'b': out.push_back(L'\b'); break;
+            case L'f': out.push_back(L'\f'); break;
+            case L'n': out.push_back(L'\n'); break;
+            case L'r': out.push_back(L'\r'); break;
+            case L't': out.push_back(L'\t'); break;
+            case L'u': {
+                if (pos_ + 4 > text_.size()) {
+                    Fail(L"bad \\u escape");
+                    return false;
+                }
+                unsigned code = 0;
+                for (int i = 0; i < 4; ++i) {
+                    const wchar_t h = text_[pos_++];
+                    code <<= 4;
+                    if (h >= L'0' && h <= L'9') code |= h - L'0';
+                    else if (h >= L'a' && h <= L'f') code |= h - L'a' + 10;
+                    else if (h >= L'A' && h <= L'F') code |= h - L'A' + 10;
+                    else {
+                        Fail(L"bad \\u escape");
+                        return false;
+                    }
+                }
+                out.push_back(static_cast<wchar_t>(code));
+                break;
+            }
+            default:
+                Fail(L"bad escape");
+                return false;
+            }
+        }
+
+        Fail(L"unterminated string");
+        return false;
+    }
+
+    bool ParseArray(JsonValue& out, int depth) {
+        ++pos_;
+        out.Type = JsonValue::Kind::Array;
+        SkipSpace();
+        if (pos_ < text_.size() && text_[pos_] == L']') {
+            ++pos_;
+            return true;
+        }
+
+        for (;;) {
+            out.Items.emplace_back();
+            if (!ParseValue(out.Items.back(), depth + 1)) {
+                return false;
+            }
+            SkipSpace();
+            if (pos_ < text_.size() && text_[pos_] == L',') {
+                ++pos_;
+                continue;
+            }
+            if (pos_ < text_.size() && text_[pos_] == L']') {
+                ++pos_;
+                return true;
+            }
+            Fail(L"expected ',' or ']'");
+            return false;
+        }
+    }
+
+    bool ParseObject(JsonValue& out, int depth) {
+        ++pos_;
+        out.Type = JsonValue::Kind::Object;
+        SkipSpace();
+        if (pos_ < text_.size() && text_[pos_] == L'}') {
+            ++pos_;
+            return true;
+        }
+
+        for (;;) {
+            SkipSpace();
+            if (pos_ >= text_.size() || text_[pos_] != L'"') {
+                Fail(L"expected member name");
+                return false;
+            }
+
+            out.Members.emplace_back();
+            if (!ParseString(out.Members.back().first)) {
+                return false;
+            }
+
+            SkipSpace();
+            if (pos_ >= text_.size() || text_[pos_] != L':') {
+                Fail(L"expected ':'");
+                return false;
+            }
+            ++pos_;
+
+            if (!ParseValue(out.Members.back().second, depth + 1)) {
+                return false;
+            }
+
+            SkipSpace();
+            if (pos_ < text_.size() && text_[pos_] == L',') {
+                ++pos_;
+                continue;
+            }
+            if (pos_ < text_.size() && text_[pos_] == L'}') {
+                ++pos_;
+                return true;
+            }
+            Fail(L"expected ',' or '}'");
+            return false;
+        }
+    }
+
+    const std::wstring& text_;
+    size_t pos_ = 0;
+    std::wstring error_;
+};
+
+// ----------------- Apply -----------------
+std::wstring FormatOrder(const std::vector<UINT16>& order) {
+    std::wstring out;
+    for (const auto id : order) {
+        if (!out.empty()) {
+            out += L",";
+        }
+        out.append(MakeBootVarName(id).Text + 4, 4);
+    }
+    return out.empty() ? L"(empty)" : out;
+}
+
+// Desired state document:
+//   {
+//     "order":   ["0003", "0001"],
+//     "next":    "0004" | null,
+//     "entries": { "0001": { "active": true, "hidden": false, "description": "..." } }
+//   }
+// Every member is optional; anything not mentioned is left as it is.
+int cmd_apply(const std::wstring& path, bool planOnly) {
+    if (g_txn) {
+        Err() << L"apply cannot run inside a batch.\n";
+        return 2;
+    }
+
+    std::wstring text;
+    if (!ReadTextFile(path, text)) {
+        return 1;
+    }
+
+    JsonValue doc;
+    std::wstring error;
+    if (!JsonParser(text).Parse(doc, error) || doc.Type != JsonValue::Kind::Object) {
+        Err() << L"Invalid desired state '" << path << L"': "
+                   << (error.empty() ? L"top level must be an object" : error) << L"\n";
+        return 2;
+    }
+
+    WriteTransaction txn;
+    g_txn = &txn;
+    std::vector<std::wstring> plan;
+
+    auto fail = [&](int rc) {
+        g_txn = nullptr;
+        return rc;
+    };
+
+    if (const JsonValue* entries = doc.Get(L"entries")) {
+        if (entries->Type != JsonValue::Kind::Object) {
+            Err() << L"\"entries\" must be an object.\n";
+            return fail(2);
+        }
+
+        for (const auto& member : entries->Members) {
+            UINT16 id = 0;
+            if (!ParseBootId(member.first, id) || member.second.Type != JsonValue::Kind::Object) {
+                Err() << L"Bad entry: " << member.first << L"\n";
+                return fail(2);
+            }
+
+            std::vector<BYTE> blob;
+            LoadOptionView view;
+            ParsedLoadOption plo;
+            if (!ReadBootEntryBlob(id, blob, view) || !ParseLoadOption(blob, plo)) {
+                Err() << MakeBootVarName(id) << L": entry not found.\n";
+                return fail(3);
+            }
+
+            ParsedLoadOption updated = plo;
+            auto flag = [&](const wchar_t* key, UINT32 bit) {
+                const JsonValue* v = member.second.Get(key);
+                if (!v || v->Type != JsonValue::Kind::Bool) {
+                    return;
+                }
+                updated.Attributes = v->Bool ? (updated.Attributes | bit) : (updated.Attributes & ~bit);
+                if ((updated.Attributes & bit) != (plo.Attributes & bit)) {
+                    plan.push_back(std::wstring(MakeBootVarName(id)) + L": " + key + L" " +
+                                   ((plo.Attributes & bit) ? L"yes" : L"no") + L" -> " +
+                                   (v->Bool ? L"yes" : L"no"));
+                }
+            };
+            flag(L"active", LOAD_OPTION_ACTIVE);
+            flag(L"hidden", LOAD_OPTION_HIDDEN);
+
+            if (const JsonValue* desc = member.second.Get(L"description")) {
+                if (desc->Type == JsonValue::Kind::String && desc->String != plo.Description) {
+                    updated.Description = desc->String;
+                    plan.push_back(std::wstring(MakeBootVarName(id)) + L": description '" + plo.Description +
+                                   L"' -> '" + desc->String + L"'");
+                }
+            }
+
+            // Only touch entries whose fields actually change.
+            if (updated.Attributes == plo.Attributes && updated.Description == plo.Description) {
+                continue;
+            }
+
+            PatchLoadOptionAttributes(blob, updated.Attributes);
+            if (updated.Description != plo.Description &&
+                !SpliceLoadOptionDescription(blob, updated.Description)) {
+                Err() << MakeBootVarName(id) << L": entry is malformed.\n";
+                return fail(3);
+            }
+
+            if (WriteBootEntryBlob(id, blob) == WriteResult::Failed) {
+                return fail(4);
+            }
+        }
+    }
+
+    if (const JsonValue* order = doc.Get(L"order")) {
+        if (order->Type != JsonValue::Kind::Array) {
+            Err() << L"\"order\" must be an array.\n";
+            return fail(2);
+        }
+
+        std::vector<UINT16> newOrder;
+        for (const auto& item : order->Items) {
+            UINT16 id = 0;
+            if (item.Type != JsonValue::Kind::String || !ParseBootId(item.String, id)) {
+                Err() << L"Bad id in \"order\".\n";
+                return fail(2);
+            }
+            if (std::find(newOrder.begin(), newOrder.end(), id) != newOrder.end()) {
+                Err() << L"Duplicate id in \"order\": " << MakeBootVarName(id) << L"\n";
+                return fail(2);
+            }
+            newOrder.push_back(id);
+        }
+
+        const auto current = GetBootOrder();
+        if (newOrder != current) {
+            plan.push_back(L"BootOrder: " + FormatOrder(current) + L" -> " + FormatOrder(newOrder));
+            if (SetBootOrder(newOrder) == WriteResult::Failed) {
+                return fail(4);
+            }
+        }
+    }
+
+    if (const JsonValue* next = doc.Get(L"next")) {
+        DWORD attrs = 0;
+        const auto raw = ReadEfiVar(L"BootNext", attrs);
+        std::wstring before = L"(none)";
+        if (raw.size() >= sizeof(UINT16)) {
+            UINT16 cur = 0;
+            memcpy(&cur, raw.data(), sizeof(UINT16));
+            before = MakeBootVarName(cur);
+        }
+
+        if (next->Type == JsonValue::Kind::Null) {
+            if (WriteEfiVar(L"BootNext", nullptr, 0, g_varAttrsRW) == WriteResult::Written) {
+                plan.push_back(L"BootNext: " + before + L" -> (none)");
+            }
+        } else {
+            UINT16 id = 0;
+            if (next->Type != JsonValue::Kind::String || !ParseBootId(next->String, id)) {
+                Err() << L"Bad id in \"next\".\n";
+                return fail(2);
+            }
+            if (WriteEfiVar(L"BootNext", &id, sizeof(id), g_varAttrsRW) == WriteResult::Written) {
+                plan.push_back(L"BootNext: " + before + L" -> " + MakeBootVarName(id).c_str());
+            }
+        }
+    }
+
+    g_txn = nullptr;
+
+    for (const auto& step : plan) {
+        Out() << L"  " << step << L"\n";
+    }
+
+    const size_t planned = txn.Pending().size();
+    if (planned == 0) {
+        Out() << L"In compliance; nothing to write.\n";
+        return EXIT_UNCHANGED;
+    }
+
+    if (planOnly) {
+        Out() << L"Plan: " << planned << L" variable write(s).\n";
+        return 0;
+    }
+
+    size_t written = 0;
+    size_t unchanged = 0;
+    if (!txn.Commit(written, unchanged)) {
+        Err() << txn.Pending().size() << L" planned write(s) were not committed.\n";
+        return 4;
+    }
+
+    Out() << L"Applied: " << written << L" variable(s) written.\n";
+    return 0;
+}
+
+// ----------------- Export / import -----------------
+// Backup image of the restorable boot variables (Boot####, BootOrder,
+// Timeout). Little-endian and 4-byte aligned so a mapped file is walked in
+// place:
+//   ExportHeader
+//   { ExportRecordHeader, name (UTF-16LE, no NUL), data, zero pad to 4 } * Count
+// Crc32 covers every byte after the header.
+constexpr UINT32 EXPORT_MAGIC = 0x584A5442;    // "BTJX"
+constexpr UINT16 EXPORT_VERSION = 1;
+
+#pragma pack(push, 1)
+struct ExportHeader {
+    UINT32 Magic;
+    UINT16 Version;
+    UINT16 HeaderSize;
+    UINT32 Count;
+    UINT32 Flags;        // reserved, 0
+    UINT32 DataSize;     // bytes after the header
+    UINT32 Crc32;
+    UINT64 Created;      // FILETIME, UTC
+};
+
+struct ExportRecordHeader {
+    BYTE VendorGuid[16];
+    UINT32 Attributes;
+    UINT32 DataSize;
+    UINT16 NameLength;   // UTF-16 units
+    UINT16 Reserved;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(ExportHeader) == 32, "ExportHeader is 32 bytes on disk");
+static_assert(sizeof(ExportRecordHeader) == 28, "ExportRecordHeader is 28 bytes on disk");
+
+constexpr size_t AlignExport(size_t n) { return (n + 3) & ~static_cast<size_t>(3); }
+
+// Restore order: entries first, then the BootOrder that names them.
+int BackupRank(const std::wstring& name) {
+    UINT16 id = 0;
+    if (ParseBootVarName(name, id)) {
+        return 0;
+    }
+    if (name == L"BootOrder") {
+        return 1;
+    }
+    if (name == L"Timeout") {
+        return 2;
+    }
+    return -1;
+}
+
+bool IsBackupVariable(const std::wstring& guid, const std::wstring& name) {
+    return _wcsicmp(guid.c_str(), EFI_GLOBAL_VARIABLE_GUID) == 0 && BackupRank(name) >= 0;
+}
+
+// Names come from the snapshot (or BootOrder when enumeration is
+// unavailable); values go through ReadEfiVar so staged batch writes count.
+void CollectBackupVariables(std::vector<EfiVariable>& vars) {
+    std::vector<std::wstring> names;
+    if (!g_snapshot.Attempted()) {
+        g_snapshot.Load();
+    }
+    if (g_snapshot.IsLoaded()) {
+        for (const auto& v : g_snapshot.Variables()) {
+            if (IsBackupVariable(v.Guid, v.Name)) {
+                names.push_back(v.Name);
+            }
+        }
+    } else {
+        names.push_back(L"BootOrder");
+        names.push_back(L"Timeout");
+        for (const auto id : GetBootOrder()) {
+            names.push_back(MakeBootVarName(id));
+        }
+    }
+
+    std::sort(names.begin(), names.end(), [](const std::wstring& a, const std::wstring& b) {
+        const int ra = BackupRank(a);
+        const int rb = BackupRank(b);
+        return ra != rb ? ra < rb : a < b;
+    });
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+
+    for (const auto& name : names) {
+        EfiVariable v;
+        v.Guid = EFI_GLOBAL_VARIABLE_GUID;
+        v.Name = name;
+        v.Data = ReadEfiVar(name, v.Attributes);
+        if (!v.Data.empty()) {
+            vars.push_back(std::move(v));
+        }
+    }
+}
+
+std::vector<BYTE> BuildExportImage(const std::vector<EfiVariable>& vars) {
+    size_t total = sizeof(ExportHeader);
+    for (const auto& v : vars) {
+        total += AlignExport(sizeof(ExportRecordHeader) + v.Name.size() * sizeof(UINT16) + v.Data.size());
+    }
+
+    std::vector<BYTE> image(total, 0);
+    size_t off = sizeof(ExportHeader);
+    for (const auto& v : vars) {
+        ExportRecordHeader rec = {};
+        GUID guid = {};
+        ParseGuid(v.Guid, guid);
+        StoreGuid(rec.VendorGuid, guid);
+        rec.Attributes = v.Attributes;
+        rec.DataSize = static_cast<UINT32>(v.Data.size());
+        rec.NameLength = static_cast<UINT16>(v.Name.size());
+
+        memcpy(&image[off], &rec, sizeof(rec));
+        off += sizeof(rec);
+        StoreUcs2(&image[off], v.Name.c_str(), v.Name.size());
+        off += v.Name.size() * sizeof(UINT16);
+        memcpy(&image[off], v.Data.data(), v.Data.size());
+        off = AlignExport(off + v.Data.size());
+    }
+
+    FILETIME now = {};
+    GetSystemTimeAsFileTime(&now);
+
+    ExportHeader hdr = {};
+    hdr.Magic = EXPORT_MAGIC;
+    hdr.Version = EXPORT_VERSION;
+    hdr.HeaderSize = sizeof(ExportHeader);
+    hdr.Count = static_cast<UINT32>(vars.size());
+    hdr.DataSize = static_cast<UINT32>(total - sizeof(ExportHeader));
+    hdr.Crc32 = Crc32(image.data() + sizeof(ExportHeader), hdr.DataSize);
+    hdr.Created = (static_cast<UINT64>(now.dwHighDateTime) << 32) | now.dwLowDateTime;
+    memcpy(image.data(), &hdr, sizeof(hdr));
+    return image;
+}
+
+struct ImportRecord {
+    std::wstring Guid;
+    std::wstring Name;
+    DWORD Attributes = 0;
+    ByteSpan Data;    // points into the mapped file
+};
+
+bool ParseExportImage(const BYTE* p, size_t n, std::vector<ImportRecord>& records, std::wstring& error) {
+    ExportHeader hdr = {};
+    if (n < sizeof(hdr)) {
+        error = L"file too small";
+        return false;
+    }
+    memcpy(&hdr, p, sizeof(hdr));
+    if (hdr.Magic != EXPORT_MAGIC) {
+        error = L"not a booteja export";
+        return false;
+    }
+    if (hdr.Version != EXPORT_VERSION) {
+        error = L"unsupported export version " + std::to_wstring(hdr.Version);
+        return false;
+    }
+    if (hdr.HeaderSize < sizeof(hdr) || hdr.HeaderSize > n || hdr.DataSize != n - hdr.HeaderSize) {
+        error = L"size mismatch (truncated file?)";
+        return false;
+    }
+    if (Crc32(p + hdr.HeaderSize, hdr.DataSize) != hdr.Crc32) {
+        error = L"checksum mismatch";
+        return false;
+    }
+
+    size_t off = hdr.HeaderSize;
+    records.clear();
+    records.reserve(hdr.Count);
+    for (UINT32 i = 0; i < hdr.Count; ++i) {
+        ExportRecordHeader rec = {};
+        if (n - off < sizeof(rec)) {
+            error = L"record " + std::to_wstring(i) + L" truncated";
+            return false;
+        }
+        memcpy(&rec, p + off, sizeof(rec));
+        off += sizeof(rec);
+
+        const size_t nameBytes = rec.NameLength * sizeof(UINT16);
+        if (rec.NameLength == 0 || n - off < nameBytes || n - off - nameBytes < rec.DataSize) {
+            error = L"record " + std::to_wstring(i) + L" truncated";
+            return false;
+        }
+
+        ImportRecord r;
+        r.Guid = FormatGuid(LoadGuid(rec.VendorGuid));
+        r.Name.resize(rec.NameLength);
+        CopyUcs2(&r.Name[0], p + off, rec.NameLength);
+        r.Attributes = rec.Attributes;
+        r.Data = ByteSpan{ p + off + nameBytes, rec.DataSize };
+        records.push_back(std::move(r));
+
+        off = std::min(n, AlignExport(off + nameBytes + rec.DataSize));
+    }
+
+    if (off != n) {
+        error = L"trailing bytes after the last record";
+        return false;
+    }
+    return true;
+}
+
+int cmd_export(const std::wstring& path, OutputFormat format) {
+    std::vector<EfiVariable> vars;
+    CollectBackupVariables(vars);
+    if (vars.empty()) {
+        Err() << L"Nothing to export: " << LastErrorMessage() << L"\n";
+        return 1;
+    }
+
+    // JSON is a readable view of the same records; import takes the binary form.
+    if (format != OutputFormat::Text) {
+        std::wstringstream captured;
+        {
+            ScopedStreamBuf capture(Out(), captured.rdbuf());
+            RecordWriter out(format);
+            for (const auto& v : vars) {
+                out.Begin();
+                out.String(L"guid", v.Guid);
+                out.String(L"name", v.Name);
+                out.Number(L"attributes", v.Attributes);
+                out.Number(L"size", v.Data.size());
+                out.Hex(L"data_hex", ByteSpan{ v.Data.data(), v.Data.size() });
+                out.End();
+            }
+            out.Finish();
+        }
+        if (!WriteTextFile(path, captured.str())) {
+            return 1;
+        }
+        Out() << L"Exported " << vars.size() << L" variable(s) as JSON to " << path << L".\n";
+        return 0;
+    }
+
+    const auto image = BuildExportImage(vars);
+    if (!WriteBinaryFile(path, image.data(), image.size())) {
+        return 1;
+    }
+
+    Out() << L"Exported " << vars.size() << L" variable(s), " << image.size() << L" bytes, to " << path << L".\n";
+    return 0;
+}
+
+// Writes only the records that differ from the live variables. With prune,
+// Boot#### entries that are not in the image are deleted after BootOrder.
+int cmd_import(const std::wstring& path, bool planOnly, bool prune) {
+    MappedFile file;
+    if (!file.Open(path)) {
+        return 1;
+    }
+
+    std::vector<ImportRecord> records;
+    std::wstring error;
+    if (!ParseExportImage(file.Data(), file.Size(), records, error)) {
+        Err() << path << L": " << error << L".\n";
+        return 2;
+    }
+
+    std::stable_sort(records.begin(), records.end(), [](const ImportRecord& a, const ImportRecord& b) {
+        return BackupRank(a.Name) < BackupRank(b.Name);
+    });
+
+    std::vector<const ImportRecord*> changed;
+    size_t unchanged = 0;
+    size_t skipped = 0;
+    BootIdSet inImage;
+    for (const auto& r : records) {
+        if (!IsBackupVariable(r.Guid, r.Name)) {
+            ++skipped;
+            continue;
+        }
+        UINT16 id = 0;
+        if (ParseBootVarName(r.Name, id)) {
+            inImage.Insert(id);
+        }
+
+        DWORD curAttrs = 0;
+        const auto current = ReadEfiVar(r.Name, curAttrs);
+        if (SameEfiValue(current, curAttrs, r.Data.Data, static_cast<DWORD>(r.Data.Size), r.Attributes)) {
+            ++unchanged;
+        } else {
+            changed.push_back(&r);
+        }
+    }
+
+    std::vector<UINT16> extra;
+    if (prune) {
+        BootIdSet live;
+        if (!CollectBootIds(live)) {
+            Err() << L"--prune needs variable enumeration: " << LastErrorMessage() << L"\n";
+            return 1;
+        }
+        for (int id = live.NextAtOrAfter(0); id >= 0; id = live.NextAtOrAfter(static_cast<UINT32>(id) + 1)) {
+            if (!inImage.Contains(static_cast<UINT16>(id))) {
+                extra.push_back(static_cast<UINT16>(id));
+            }
+        }
+    }
+
+    if (skipped > 0) {
+        Err() << L"Skipped " << skipped << L" record(s) outside the boot variable set.\n";
+    }
+
+    if (planOnly) {
+        for (const auto* r : changed) {
+            Out() << L"  write  " << r->Name << L" (" << r->Data.Size << L" bytes)\n";
+        }
+        for (const auto id : extra) {
+            Out() << L"  delete " << MakeBootVarName(id) << L"\n";
+        }
+        Out() << L"Plan: " << changed.size() << L" write(s), " << extra.size() << L" delete(s), "
+                   << unchanged << L" unchanged.\n";
+        return (changed.empty() && extra.empty()) ? EXIT_UNCHANGED : 0;
+    }
+
+    const int rc = RunStaged([&] {
+        for (const auto* r : changed) {
+            if (WriteEfiVar(r->Name, r->Data.Data, static_cast<DWORD>(r->Data.Size), r->Attributes) == WriteResult::Failed) {
+                return 4;
+            }
+        }
+        for (const auto id : extra) {
+            if (WriteEfiVar(MakeBootVarName(id), nullptr, 0, g_varAttrsRW) == WriteResult::Failed) {
+                return 4;
+            }
+        }
+        return 0;
+    });
+    if (rc != 0) {
+        return rc;
+    }
+
+    Out() << L"Import: " << changed.size() << L" written, " << extra.size() << L" removed, "
+               << unchanged << L" unchanged.\n";
+    return (changed.empty() && extra.empty()) ? EXIT_UNCHANGED : 0;
+}
+
+// ----------------- Fingerprint -----------------
+// A stable digest of the boot configuration for drift polling: BootOrder,
+// BootNext and every Boot#### (ascending), each hashed with its attributes.
+// With a cache file the previous per-entry hashes name what changed, and a
+// generation counter goes up whenever the digest does.
+//   booteja-fingerprint 1
+//   generation <n>
+//   digest <hex>
+//   entry <hex> <name>
+constexpr const wchar_t* FINGERPRINT_MAGIC = L"booteja-fingerprint 1";
+
+struct FingerprintEntry {
+    std::wstring Name;
+    UINT64 Hash = 0;
+};
+
+struct FingerprintState {
+    UINT64 Generation = 0;
+    UINT64 Digest = 0;
+    std::vector<FingerprintEntry> Entries;
+};
+
+// One enumeration when the snapshot is available; otherwise BootOrder names
+// the entries to read.
+void CollectFingerprint(std::vector<FingerprintEntry>& entries) {
+    std::vector<std::wstring> names = { L"BootOrder", L"BootNext" };
+    for (const auto id : ExistingBootIds()) {
+        names.push_back(MakeBootVarName(id));
+    }
+
+    for (const auto& name : names) {
+        DWORD attrs = 0;
+        const auto data = ReadEfiVar(name, attrs);
+        if (!data.empty()) {
+            entries.push_back({ name, Xxh64(data.data(), data.size(), attrs) });
+        }
+    }
+}
+
+UINT64 FingerprintDigest(const std::vector<FingerprintEntry>& entries) {
+    std::vector<BYTE> buf;
+    for (const auto& e : entries) {
+        const size_t at = buf.size();
+        buf.resize(at + (e.Name.size() + 1) * sizeof(UINT16) + sizeof(e.Hash), 0);
+        StoreUcs2(&buf[at], e.Name.c_str(), e.Name.size());
+        memcpy(&buf[buf.size() - sizeof(e.Hash)], &e.Hash, sizeof(e.Hash));
+    }
+    return Xxh64(buf.data(), buf.size());
+}
+
+// A missing cache is a first poll, not an error.
+bool LoadFingerprintState(const std::wstring& path, FingerprintState& state) {
+    if (GetFileAttributesW(path.c_str()) == INVALID_FILE_ATTRIBUTES) {
+        return true;
+    }
+
+    std::wstring text;
+    if (!ReadTextFile(path, text)) {
+        return false;
+    }
+    std::wstringstream lines(text);
+    std::wstring line;
+    if (!std::getline(lines, line) || line.compare(0, wcslen(FINGERPRINT_MAGIC), FINGERPRINT_MAGIC) != 0) {
+        Err() << L"'" << path << L"' is not a booteja fingerprint cache.\n";
+        return false;
+    }
+
+    while (std::getline(lines, line)) {
+        if (!line.empty() && line.back() == L'\r') {
+            line.pop_back();
+        }
+        std::wstringstream ls(line);
+        std::wstring tag;
+        ls >> tag;
+        if (tag == L"generation") {
+            ls >> state.Generation;
+        } else if (tag == L"digest") {
+            ls >> std::hex >> state.Digest;
+        } else if (tag == L"entry") {
+            FingerprintEntry e;
+            ls >> std::hex >> e.Hash >> e.Name;
+            if (!e.Name.empty()) {
+                state.Entries.push_back(std::move(e));
+            }
+        }
+    }
+    return true;
+}
+
+bool SaveFingerprintState(const std::wstring& path, const FingerprintState& state) {
+    std::wstring text = FINGERPRINT_MAGIC;
+    text += L"\ngeneration ";
+    AppendDec(text, state.Generation);
+    text += L"\ndigest ";
+    AppendHex(text, state.Digest, 16);
+    text += L'\n';
+    for (const auto& e : state.Entries) {
+        text += L"entry ";
+        AppendHex(text, e.Hash, 16);
+        text += L' ';
+        text += e.Name;
+        text += L'\n';
+    }
+    return WriteTextFile(path, text);
+}
+
+// Names added, removed or rewritten between two entry lists.
+std::vector<std::wstring> DiffFingerprints(const std::vector<FingerprintEntry>& before,
+                                           const std::vector<FingerprintEntry>& after) {
+    std::unordered_map<std::wstring, UINT64> old;
+    for (const auto& e : before) {
+        old[e.Name] = e.Hash;
+    }
+
+    std::vector<std::wstring> changed;
+    for (const auto& e : after) {
+        const auto it = old.find(e.Name);
+        if (it == old.end() || it->second != e.Hash) {
+            changed.push_back(e.Name);
+        }
+        if (it != old.end()) {
+            old.erase(it);
+        }
+    }
+    for (const auto& e : before) {
+        if (old.count(e.Name)) {
+            changed.push_back(e.Name);
+        }
+    }
+    return changed;
+}
+
+// Exits 10 when a cache is given and nothing changed since it was written.
+int cmd_fingerprint(const std::wstring& cachePath, OutputFormat format) {
+    FingerprintState previous;
+    if (!cachePath.empty() && !LoadFingerprintState(cachePath, previous)) {
+        return 1;
+    }
+
+    FingerprintState current;
+    CollectFingerprint(current.Entries);
+    if (current.Entries.empty()) {
+        Err() << L"No boot variables readable: " << LastErrorMessage() << L"\n";
+        return 1;
+    }
+    current.Digest = FingerprintDigest(current.Entries);
+
+    const bool tracked = !cachePath.empty();
+    const bool same = tracked && previous.Generation > 0 && previous.Digest == current.Digest;
+    current.Generation = same ? previous.Generation : previous.Generation + 1;
+    const auto changed = tracked && previous.Generation > 0 ? DiffFingerprints(previous.Entries, current.Entries)
+                                                            : std::vector<std::wstring>();
+    if (tracked && !same && !SaveFingerprintState(cachePath, current)) {
+        return 1;
+    }
+
+    std::wstring digest;
+    AppendHex(digest, current.Digest, 16);
+
+    if (format != OutputFormat::Text) {
+        RecordWriter out(format);
+        out.Begin();
+        out.String(L"digest", digest);
+        out.Number(L"entries", current.Entries.size());
+        if (tracked) {
+            out.Number(L"generation", current.Generation);
+            out.StringList(L"changed", changed);
+        }
+        out.End();
+        out.Finish();
+    } else {
+        Out() << L"Fingerprint: " << digest << L" (" << current.Entries.size() << L" variables)\n";
+        if (tracked) {
+            Out() << L"Generation: " << current.Generation;
+            if (same) {
+                Out() << L" (unchanged)";
+            } else if (!changed.empty()) {
+                Out() << L" (changed:";
+                for (const auto& name : changed) {
+                    Out() << L' ' << name;
+                }
+                Out() << L')';
+            }
+            Out() << L"\n";
+        }
+    }
+    return same ? EXIT_UNCHANGED : 0;
+}
+
+// ----------------- Secure Boot -----------------
+// PK, KEK, db and dbx each hold a sequence of EFI_SIGNATURE_LISTs:
+//   SignatureType (GUID), SignatureListSize, SignatureHeaderSize,
+//   SignatureSize (UINT32 each), header bytes, then equally sized
+//   EFI_SIGNATURE_DATA entries (owner GUID followed by the signature).
+constexpr size_t SIGNATURE_LIST_HEADER_SIZE = 28;
+constexpr size_t SIGNATURE_OWNER_SIZE = 16;
+constexpr size_t SHA256_DIGEST_SIZE = 32;
+
+struct SecurityVariable {
+    const wchar_t* Name;
+    const wchar_t* Guid;
+};
+
+static const SecurityVariable SECURITY_VARIABLES[] = {
+    { L"PK", EFI_GLOBAL_VARIABLE_GUID },
+    { L"KEK", EFI_GLOBAL_VARIABLE_GUID },
+    { L"db", EFI_IMAGE_SECURITY_DATABASE_GUID },
+    { L"dbx", EFI_IMAGE_SECURITY_DATABASE_GUID },
+};
+
+// DataSize 0 means the signature size varies per list (certificates).
+struct SignatureTypeInfo {
+    GUID Type;
+    const wchar_t* Name;
+    size_t DataSize;
+};
+
+static const SignatureTypeInfo SIGNATURE_TYPES[] = {
+    { { 0xC1C41626, 0x504C, 0x4092, { 0xAC, 0xA9, 0x41, 0xF9, 0x36, 0x93, 0x43, 0x28 } }, L"SHA256", 32 },
+    { { 0xA5C059A1, 0x94E4, 0x4AA7, { 0x87, 0xB5, 0xAB, 0x15, 0x5C, 0x2B, 0xF0, 0x72 } }, L"X509", 0 },
+    { { 0x826CA512, 0xCF10, 0x4AC9, { 0xB1, 0x87, 0xBE, 0x01, 0x49, 0x66, 0x31, 0xBD } }, L"SHA1", 20 },
+    { { 0xFF3E5307, 0x9FD0, 0x48C9, { 0x85, 0xF1, 0x8A, 0xD5, 0x6C, 0x70, 0x1E, 0x01 } }, L"SHA384", 48 },
+    { { 0x093E0FAE, 0xA6C4, 0x4F50, { 0x9F, 0x1B, 0xD4, 0x1E, 0x2B, 0x89, 0xC1, 0x9A } }, L"SHA512", 64 },
+    { { 0x3C5766E8, 0x269C, 0x4E34, { 0xAA, 0x14, 0xED, 0x77, 0x6E, 0x85, 0xB3, 0xB6 } }, L"RSA2048", 256 },
+    { { 0x3BD2A492, 0x96C0, 0x4079, { 0xB4, 0x20, 0xFC, 0xF9, 0x8E, 0xF1, 0x03, 0xED } }, L"X509_SHA256", 48 },
+};
+
+const SecurityVariable* FindSecurityVariable(const std::wstring& name) {
+    const auto it = std::find_if(std::begin(SECURITY_VARIABLES), std::end(SECURITY_VARIABLES),
+        [&](const SecurityVariable& v) { return _wcsicmp(v.Name, name.c_str()) == 0; });
+    return it == std::end(SECURITY_VARIABLES) ? nullptr : &*it;
+}
+
+const SignatureTypeInfo* FindSignatureType(const GUID& type) {
+    const auto it = std::find_if(std::begin(SIGNATURE_TYPES), std::end(SIGNATURE_TYPES),
+        [&](const SignatureTypeInfo& t) { return memcmp(&t.Type, &type, sizeof(GUID)) == 0; });
+    return it == std::end(SIGNATURE_TYPES) ? nullptr : &*it;
+}
+
+bool IsSha256SignatureType(const SignatureTypeInfo* info) {
+    return info == &SIGNATURE_TYPES[0];
+}
+
+// Views into the variable buffer; valid only while that buffer is alive.
+struct SignatureEntry {
+    GUID Owner = {};
+    ByteSpan Data;
+};
+
+struct SignatureList {
+    GUID Type = {};
+    const SignatureTypeInfo* Info = nullptr;    // null for unknown types
+    std::vector<SignatureEntry> Signatures;
+};
+
+bool ParseSignatureLists(const std::vector<BYTE>& data, std::vector<SignatureList>& lists) {
+    const BYTE* p = data.data();
+    const size_t n = data.size();
+    size_t off = 0;
+
+    while (off < n) {
+        if (n - off < SIGNATURE_LIST_HEADER_SIZE) {
+            return false;
+        }
+        const UINT32 listSize = LoadLe<UINT32>(p + off + 16);
+        const UINT32 headerSize = LoadLe<UINT32>(p + off + 20);
+        const UINT32 sigSize = LoadLe<UINT32>(p + off + 24);
+        if (listSize > n - off || listSize < SIGNATURE_LIST_HEADER_SIZE ||
+            headerSize > listSize - SIGNATURE_LIST_HEADER_SIZE || sigSize <= SIGNATURE_OWNER_SIZE) {
+            return false;
+        }
+        const size_t body = listSize - SIGNATURE_LIST_HEADER_SIZE - headerSize;
+        if (body % sigSize != 0) {
+            return false;
+        }
+
+        SignatureList list;
+        list.Type = LoadGuid(p + off);
+        list.Info = FindSignatureType(list.Type);
+        if (list.Info && list.Info->DataSize != 0 && sigSize - SIGNATURE_OWNER_SIZE < list.Info->DataSize) {
+            return false;
+        }
+        list.Signatures.reserve(body / sigSize);
+        for (size_t at = off + SIGNATURE_LIST_HEADER_SIZE + headerSize; at < off + listSize; at += sigSize) {
+            SignatureEntry e;
+            e.Owner = LoadGuid(p + at);
+            e.Data.Data = p + at + SIGNATURE_OWNER_SIZE;
+            e.Data.Size = sigSize - SIGNATURE_OWNER_SIZE;
+            list.Signatures.push_back(e);
+        }
+        lists.push_back(std::move(list));
+        off += listSize;
+    }
+    return true;
+}
+
+// Reads and parses one security variable. A missing variable is an empty
+// database, not an error; present reports which it was.
+bool ReadSignatureDatabase(const SecurityVariable& var, std::vector<BYTE>& data,
+                           std::vector<SignatureList>& lists, bool& present) {
+    DWORD attrs = 0;
+    data = ReadEfiVar(var.Name, attrs, var.Guid);
+    present = !data.empty();
+    if (!present) {
+        if (GetLastError() == ERROR_ENVVAR_NOT_FOUND) {
+            return true;
+        }
+        Err() << L"Cannot read " << var.Name << L": " << LastErrorMessage() << L"\n";
+        return false;
+    }
+    if (!ParseSignatureLists(data, lists)) {
+        Err() << var.Name << L" is not a valid EFI_SIGNATURE_LIST sequence.\n";
+        return false;
+    }
+    return true;
+}
+
+// Subject of a DER certificate as Windows would display it; empty when the
+// certificate does not decode.
+std::wstring CertificateSubject(ByteSpan der) {
+    const PCCERT_CONTEXT cert = CertCreateCertificateContext(
+        X509_ASN_ENCODING, der.Data, static_cast<DWORD>(der.Size));
+    if (!cert) {
+        return {};
+    }
+    std::wstring subject;
+    const DWORD n = CertGetNameStringW(cert, CERT_NAME_SIMPLE_DISPLAY_TYPE, 0, nullptr, nullptr, 0);
+    if (n > 1) {
+        subject.resize(n);
+        CertGetNameStringW(cert, CERT_NAME_SIMPLE_DISPLAY_TYPE, 0, nullptr, &subject[0], n);
+        subject.resize(n - 1);
+    }
+    CertFreeCertificateContext(cert);
+    return subject;
+}
+
+// Open-addressing set of SHA-256 digests: linear probing over a power-of-two
+// table kept at most half full. Digests are uniformly distributed already, so
+// their first eight bytes serve as the hash.
+class DigestIndex {
+public:
+    void Reserve(size_t count) {
+        size_t capacity = 16;
+        while (capacity < count * 2) {
+            capacity *= 2;
+        }
+        if (capacity > Capacity()) {
+            Rehash(capacity);
+        }
+    }
+
+    bool Insert(const BYTE* digest) {
+        if ((size_ + 1) * 2 > Capacity()) {
+            Rehash(std::max<size_t>(16, Capacity() * 2));
+        }
+        size_t slot = Probe(digest);
+        if (used_[slot]) {
+            return false;
+        }
+        used_[slot] = 1;
+        memcpy(&keys_[slot * SHA256_DIGEST_SIZE], digest, SHA256_DIGEST_SIZE);
+        ++size_;
+        return true;
+    }
+
+    bool Contains(const BYTE* digest) const {
+        return size_ != 0 && used_[Probe(digest)] != 0;
+    }
+
+    size_t Size() const { return size_; }
+
+private:
+    size_t Capacity() const { return used_.size(); }
+
+    // The slot holding digest, or the empty slot where it would go.
+    size_t Probe(const BYTE* digest) const {
+        const size_t mask = Capacity() - 1;
+        UINT64 h = 0;
+        memcpy(&h, digest, sizeof(h));
+        size_t slot = static_cast<size_t>(h) & mask;
+        while (used_[slot] && memcmp(&keys_[slot * SHA256_DIGEST_SIZE], digest, SHA256_DIGEST_SIZE) != 0) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void Rehash(size_t capacity) {
+        std::vector<BYTE> oldKeys(capacity * SHA256_DIGEST_SIZE);
+        std::vector<BYTE> oldUsed(capacity);
+        oldKeys.swap(keys_);
+        oldUsed.swap(used_);
+        size_ = 0;
+        for (size_t i = 0; i < oldUsed.size(); ++i) {
+            if (oldUsed[i]) {
+                Insert(&oldKeys[i * SHA256_DIGEST_SIZE]);
+            }
+        }
+    }
+
+    std::vector<BYTE> keys_;
+    std::vector<BYTE> used_;
+    size_t size_ = 0;
+};
+
+// Every SHA-256 image hash in the database; certificate entries are skipped.
+void IndexSha256Signatures(const std::vector<SignatureList>& lists, DigestIndex& index) {
+    size_t count = 0;
+    for (const auto& list : lists) {
+        if (IsSha256SignatureType(list.Info)) {
+            count += list.Signatures.size();
+        }
+    }
+    index.Reserve(count);
+    for (const auto& list : lists) {
+        if (IsSha256SignatureType(list.Info)) {
+            for (const auto& sig : list.Signatures) {
+                index.Insert(sig.Data.Data);
+            }
+        }
+    }
+}
+
+// SHA-256 through CNG. The algorithm provider is opened once per process and
+// shared; each hash object is independent.
+class Sha256 {
+public:
+    Sha256() {
+        static BCRYPT_ALG_HANDLE alg = nullptr;
+        static std::once_flag once;
+        std::call_once(once, [] {
+            if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&alg, BCRYPT_SHA256_ALGORITHM, nullptr, 0))) {
+                alg = nullptr;
+            }
+        });
+        ok_ = alg && BCRYPT_SUCCESS(BCryptCreateHash(alg, &hash_, nullptr, 0, nullptr, 0, 0));
+    }
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+    ~Sha256() {
+        if (hash_) {
+            BCryptDestroyHash(hash_);
+        }
+    }
+
+    void Update(const BYTE* p, size_t n) {
+        while (ok_ && n != 0) {
+            const ULONG chunk = static_cast<ULONG>(std::min<size_t>(n, 0x40000000));
+            ok_ = BCRYPT_SUCCESS(BCryptHashData(hash_, const_cast<PUCHAR>(p), chunk, 0));
+            p += chunk;
+            n -= chunk;
+        }
+    }
+
+    bool Final(BYTE* digest) {
+        return ok_ && BCRYPT_SUCCESS(BCryptFinishHash(hash_, digest, SHA256_DIGEST_SIZE, 0));
+    }
+
+private:
+    BCRYPT_HASH_HANDLE hash_ = nullptr;
+    bool ok_ = false;
+};
+
+// Authenticode digest of a PE/COFF image, computed as firmware does when it
+// checks db/dbx: the headers without CheckSum and the certificate table
+// directory entry, the sections in file order, then any data after them up
+// to the attribute certificates.
+bool AuthenticodeSha256(const BYTE* p, size_t size, BYTE* digest, std::wstring& error) {
+    if (size < 0x40 || p[0] != 'M' || p[1] != 'Z') {
+        error = L"not a PE image (no MZ header)";
+        return false;
+    }
+    const size_t pe = LoadLe<UINT32>(p + 0x3C);
+    if (pe > size - 24 || memcmp(p + pe, "PE\0\0", 4) != 0) {
+        error = L"not a PE image (no PE signature)";
+        return false;
+    }
+
+    const size_t sectionCount = LoadLe<UINT16>(p + pe + 6);
+    const size_t optSize = LoadLe<UINT16>(p + pe + 20);
+    const size_t opt = pe + 24;
+    if (optSize > size - opt || optSize < 2) {
+        error = L"truncated optional header";
+        return false;
+    }
+
+    size_t rvaCountAt = 0;
+    size_t dirAt = 0;
+    switch (LoadLe<UINT16>(p + opt)) {
+    case 0x10B: rvaCountAt = 92; dirAt = 96; break;     // PE32
+    case 0x20B: rvaCountAt = 108; dirAt = 112; break;   // PE32+
+    default:
+        error = L"unknown optional header magic";
+        return false;
+    }
+    if (optSize < dirAt) {
+        error = L"truncated optional header";
+        return false;
+    }
+
+    const size_t checksumAt = opt + 64;
+    const size_t headersSize = LoadLe<UINT32>(p + opt + 60);
+    const size_t certDirAt = opt + dirAt + 4 * 8;
+    const bool hasCertDir = LoadLe<UINT32>(p + opt + rvaCountAt) > 4 && certDirAt + 8 <= opt + optSize;
+    const size_t certSize = hasCertDir ? LoadLe<UINT32>(p + certDirAt + 4) : 0;
+    const size_t sectionsAt = opt + optSize;
+    if (headersSize > size || headersSize < (hasCertDir ? certDirAt + 8 : checksumAt + 4) ||
+        sectionCount * 40 > size - sectionsAt || certSize > size) {
+        error = L"malformed PE headers";
+        return false;
+    }
+
+    Sha256 sha;
+    sha.Update(p, checksumAt);
+    if (hasCertDir) {
+        sha.Update(p + checksumAt + 4, certDirAt - checksumAt - 4);
+        sha.Update(p + certDirAt + 8, headersSize - certDirAt - 8);
+    } else {
+        sha.Update(p + checksumAt + 4, headersSize - checksumAt - 4);
+    }
+
+    struct RawSection {
+        size_t Offset;
+        size_t Size;
+    };
+    std::vector<RawSection> sections;
+    for (size_t i = 0; i < sectionCount; ++i) {
+        const BYTE* s = p + sectionsAt + i * 40;
+        const size_t rawSize = LoadLe<UINT32>(s + 16);
+        const size_t rawAt = LoadLe<UINT32>(s + 20);
+        if (rawSize == 0) {
+            continue;
+        }
+        if (rawAt > size || rawSize > size - rawAt) {
+            error = L"section data past end of file";
+            return false;
+        }
+        sections.push_back({ rawAt, rawSize });
+    }
+    std::sort(sections.begin(), sections.end(),
+        [](const RawSection& a, const RawSection& b) { return a.Offset < b.Offset; });
+
+    size_t hashed = headersSize;
+    for (const auto& s : sections) {
+        sha.Update(p + s.Offset, s.Size);
+        hashed += s.Size;
+    }
+    if (size - certSize > hashed) {
+        sha.Update(p + hashed, size - certSize - hashed);
+    }
+
+    if (!sha.Final(digest)) {
+        error = L"SHA-256 unavailable";
+        return false;
+    }
+    return true;
+}
+
+std::wstring SignatureTypeName(const SignatureList& list) {
+    return list.Info ? list.Info->Name : FormatGuid(list.Type);
+}
+
+// Lists every signature in the given security variables (all four by default).
+int cmd_keys(const std::vector<std::wstring>& names, OutputFormat format) {
+    std::vector<const SecurityVariable*> vars;
+    for (const auto& name : names) {
+        const SecurityVariable* v = FindSecurityVariable(name);
+        if (!v) {
+            Err() << L"Unknown Secure Boot variable: " << name << L" (PK, KEK, db or dbx)\n";
+            return 2;
+        }
+        vars.push_back(v);
+    }
+    if (vars.empty()) {
+        for (const auto& v : SECURITY_VARIABLES) {
+            vars.push_back(&v);
+        }
+    }
+
+    RecordWriter out(format);
+    for (const SecurityVariable* var : vars) {
+        std::vector<BYTE> data;
+        std::vector<SignatureList> lists;
+        bool present = false;
+        if (!ReadSignatureDatabase(*var, data, lists, present)) {
+            return 1;
+        }
+
+        if (format == OutputFormat::Text) {
+            if (!present) {
+                Out() << var->Name << L": not present\n";
+                continue;
+            }
+            size_t count = 0;
+            for (const auto& list : lists) {
+                count += list.Signatures.size();
+            }
+            Out() << var->Name << L": " << count << L" signature(s) in " << lists.size()
+                       << L" list(s), " << data.size() << L" bytes\n";
+        }
+
+        for (size_t l = 0; l < lists.size(); ++l) {
+            const SignatureList& list = lists[l];
+            const std::wstring type = SignatureTypeName(list);
+            const bool cert = list.Info && list.Info->DataSize == 0;
+            for (const auto& sig : list.Signatures) {
+                const size_t shown = list.Info && !cert ? list.Info->DataSize : sig.Data.Size;
+                const std::wstring subject = cert ? CertificateSubject(sig.Data) : std::wstring();
+
+                if (format != OutputFormat::Text) {
+                    out.Begin();
+                    out.String(L"variable", var->Name);
+                    out.Number(L"list", l);
+                    out.String(L"type", type);
+                    out.String(L"owner", FormatGuid(sig.Owner));
+                    out.Number(L"size", sig.Data.Size);
+                    if (cert) {
+                        out.String(L"subject", subject);
+                    } else {
+                        out.Hex(L"data", { sig.Data.Data, shown });
+                    }
+                    out.End();
+                    continue;
+                }
+
+                Out() << L"  " << std::left << std::setw(8) << type << std::right
+                           << L" " << FormatGuid(sig.Owner) << L"  ";
+                if (cert) {
+                    Out() << (subject.empty() ? L"(undecodable certificate)" : subject)
+                               << L" (" << sig.Data.Size << L" bytes)\n";
+                } else {
+                    std::wstring hex;
+                    AppendHexBytes(hex, sig.Data.Data, shown);
+                    Out() << hex << L"\n";
+                }
+            }
+        }
+    }
+    out.Finish();
+    return 0;
+}
+
+// Loaders of every Boot#### that resolves to a file on a mounted ESP, each
+// once; entries whose loader is missing are reported on stderr.
+std::vector<std::wstring> CollectBootLoaders() {
+    std::vector<std::wstring> files;
+    std::vector<BYTE> blob;
+    for (const auto id : ExistingBootIds()) {
+        LoadOptionView lo;
+        std::wstring resolved;
+        if (!ReadBootEntryBlob(id, blob, lo)) {
+            continue;
+        }
+        const LoaderStatus status = ResolveLoader(lo.DevicePath, resolved);
+        if (status == LoaderStatus::Present) {
+            if (std::find(files.begin(), files.end(), resolved) == files.end()) {
+                files.push_back(resolved);
+            }
+        } else if (status != LoaderStatus::NotFile) {
+            Err() << MakeBootVarName(id) << L": loader " << LoaderStatusName(status) << L" (" << resolved << L")\n";
+        }
+    }
+    return files;
+}
+
+// Looks up each image's Authenticode hash in dbx (and db). Exits
+// EXIT_REVOKED when any image is revoked by hash. Certificate entries are not
+// evaluated: that needs the image's signature chain, which firmware checks.
+int cmd_check(const std::vector<std::wstring>& files, OutputFormat format) {
+    if (files.empty()) {
+        Err() << L"check needs at least one EFI image.\n";
+        return 2;
+    }
+
+    std::vector<BYTE> dbxData, dbData;
+    std::vector<SignatureList> dbxLists, dbLists;
+    bool dbxPresent = false, dbPresent = false;
+    if (!ReadSignatureDatabase(*FindSecurityVariable(L"dbx"), dbxData, dbxLists, dbxPresent) ||
+        !ReadSignatureDatabase(*FindSecurityVariable(L"db"), dbData, dbLists, dbPresent)) {
+        return 1;
+    }
+    if (!dbxPresent) {
+        Err() << L"dbx is not present; no image is revoked by hash.\n";
+    }
+
+    DigestIndex revoked, allowed;
+    IndexSha256Signatures(dbxLists, revoked);
+    IndexSha256Signatures(dbLists, allowed);
+
+    RecordWriter out(format);
+    int rc = 0;
+    for (const auto& file : files) {
+        MappedFile image;
+        if (!image.Open(file)) {
+            rc = std::max(rc, 1);
+            continue;
+        }
+        BYTE digest[SHA256_DIGEST_SIZE];
+        std::wstring error;
+        if (!AuthenticodeSha256(image.Data(), image.Size(), digest, error)) {
+            Err() << L"'" << file << L"': " << error << L"\n";
+            rc = std::max(rc, 1);
+            continue;
+        }
+
+        const bool inDbx = revoked.Contains(digest);
+        const bool inDb = allowed.Contains(digest);
+        if (inDbx) {
+            rc = EXIT_REVOKED;
+        }
+
+        if (format != OutputFormat::Text) {
+            out.Begin();
+            out.String(L"file", file);
+            out.Hex(L"sha256", { digest, sizeof(digest) });
+            out.Bool(L"dbx", inDbx);
+            out.Bool(L"db", inDb);
+            out.End();
+            continue;
+        }
+
+        std::wstring hex;
+        AppendHexBytes(hex, digest, sizeof(digest));
+        Out() << file << L"\n  Authenticode SHA-256: " << hex << L"\n  "
+                   << (inDbx ? L"REVOKED: listed in dbx" : L"Not listed in dbx");
+        if (inDb) {
+            Out() << L"; allowed by hash in db";
+        }
+        Out() << L" (" << revoked.Size() << L" revoked hashes)\n";
+    }
+    out.Finish();
+    return rc;
+}
+
+// ----------------- Bench -----------------
+// Scratch variable for write timing; lives under our own vendor GUID so it can
+// never be mistaken for a boot variable.
+static const wchar_t* BOOTEJA_SCRATCH_GUID = L"{5D3F7A0C-2B8E-4C61-9A47-1E6B0C93D2F5}";
+static const wchar_t* BOOTEJA_SCRATCH_NAME = L"BootejaBench";
+
+struct LatencyStats {
+    size_t Samples = 0;
+    double P50 = 0;
+    double P95 = 0;
+    double P99 = 0;
+    double Max = 0;
+    double Mean = 0;
+};
+
+LatencyStats ComputeStats(std::vector<double> micros) {
+    LatencyStats st;
+    if (micros.empty()) {
+        return st;
+    }
+
+    std::sort(micros.begin(), micros.end());
+    auto rank = [&](double p) {
+        const size_t i = static_cast<size_t>(p * (micros.size() - 1) + 0.5);
+        return micros[std::min(i, micros.size() - 1)];
+    };
+
+    double total = 0;
+    for (const double m : micros) {
+        total += m;
+    }
+
+    st.Samples = micros.size();
+    st.P50 = rank(0.50);
+    st.P95 = rank(0.95);
+    st.P99 = rank(0.99);
+    st.Max = micros.back();
+    st.Mean = total / micros.size();
+    return st;
+}
+
+std::wstring JsonEscape(const std::wstring& s) {
+    std::wstring out;
+    out.reserve(s.size() + 2);
+    AppendJsonEscaped(out, s.data(), s.size());
+    return out;
+}
+
+// One JSON object per line so results from many machines can be concatenated.
+void PrintStatsRecord(const wchar_t* scope, const wchar_t* call, const std::wstring& name,
+                      size_t bytes, const LatencyStats& st) {
+    Out() << std::fixed << std::setprecision(1)
+               << L"{\"scope\":\"" << scope << L"\""
+               << L",\"call\":\"" << call << L"\"";
+    if (!name.empty()) {
+        Out() << L",\"name\":\"" << JsonEscape(name) << L"\",\"bytes\":" << bytes;
+    }
+    Out() << L",\"samples\":" << st.Samples
+               << L",\"p50_us\":" << st.P50
+               << L",\"p95_us\":" << st.P95
+               << L",\"p99_us\":" << st.P99
+               << L",\"max_us\":" << st.Max
+               << L",\"mean_us\":" << st.Mean
+               << L"}\n";
+    Out().unsetf(std::ios::floatfield);
+    Out() << std::setprecision(6);
+}
+
+// Times backend calls directly, bypassing the snapshot and write elision, so
+// the numbers are the raw cost of each firmware transition.
+int cmd_bench(size_t iterations, bool withWrites) {
+    if (iterations == 0) {
+        Err() << L"Iterations must be positive.\n";
+        return 2;
+    }
+
+    std::vector<double> enumSamples;
+    for (size_t i = 0; i < iterations; ++i) {
+        std::vector<EfiVariable> vars;
+        const LONGLONG start = QpcNow();
+        const bool ok = g_backend->Enumerate(vars);
+        const double micros = QpcToMicros(QpcNow() - start);
+        if (!ok) {
+            break;
+        }
+        enumSamples.push_back(micros);
+    }
+    if (!enumSamples.empty()) {
+        PrintStatsRecord(L"call", L"enumerate", L"", 0, ComputeStats(enumSamples));
+    }
+
+    std::vector<std::wstring> names;
+    names.push_back(L"BootOrder");
+    for (const auto id : GetBootOrder()) {
+        names.push_back(MakeBootVarName(id));
+    }
+
+    std::vector<BYTE> buf(MAX_EFI_READ_BUFFER_SIZE);
+    std::vector<double> allReads;
+
+    for (const auto& name : names) {
+        std::vector<double> samples;
+        DWORD bytes = 0;
+
+        for (size_t i = 0; i < iterations; ++i) {
+            DWORD attrs = 0;
+            const LONGLONG start = QpcNow();
+            const DWORD read = g_backend->Read(
+                name.c_str(), EFI_GLOBAL_VARIABLE_GUID, buf.data(), static_cast<DWORD>(buf.size()), &attrs);
+            const double micros = QpcToMicros(QpcNow() - start);
+            if (read == 0) {
+                break;
+            }
+            bytes = read;
+            samples.push_back(micros);
+        }
+
+        if (samples.empty()) {
+            Err() << L"Read '" << name << L"' failed: " << LastErrorMessage() << L"\n";
+            continue;
+        }
+
+        allReads.insert(allReads.end(), samples.begin(), samples.end());
+        PrintStatsRecord(L"variable", L"read", name, bytes, ComputeStats(samples));
+    }
+
+    PrintStatsRecord(L"call", L"read", L"", 0, ComputeStats(allReads));
+
+    if (withWrites) {
+        std::vector<double> samples;
+        UINT32 payload = 0;
+
+        for (size_t i = 0; i < iterations; ++i) {
+            ++payload;    // a different value every time, so no layer can elide the write
+            const LONGLONG start = QpcNow();
+            const bool ok = g_backend->Write(
+                BOOTEJA_SCRATCH_NAME, BOOTEJA_SCRATCH_GUID, &payload, sizeof(payload), g_varAttrsRW);
+            const double micros = QpcToMicros(QpcNow() - start);
+            if (!ok) {
+                Err() << L"Scratch write failed: " << LastErrorMessage() << L"\n";
+                break;
+            }
+            samples.push_back(micros);
+        }
+
+        g_backend->Write(BOOTEJA_SCRATCH_NAME, BOOTEJA_SCRATCH_GUID, nullptr, 0, g_varAttrsRW);
+        PrintStatsRecord(L"call", L"write", L"", 0, ComputeStats(samples));
+    }
+
+    return 0;
+}
+
+// The original per-character decoder, kept as the baseline for bench ucs2.
+std::wstring ReadUcs2StringScalar(const std::vector<BYTE>& data, size_t start, size_t& nextOffset) {
+    std::wstring out;
+    size_t i = start;
+
+    while (i + 1 < data.size()) {
+        const wchar_t ch = static_cast<wchar_t>(data[i] | (data[i + 1] << 8));
+        i += 2;
+        if (ch == L'\0') {
+            break;
+        }
+        out.push_back(ch);
+    }
+
+    if (i & 1) {
+        ++i;
+    }
+
+    nextOffset = i;
+    return out;
+}
+
+// Times ReadUcs2String against the scalar loop on load-option shaped buffers.
+int cmd_bench_ucs2(size_t iterations) {
+    const size_t lengths[] = { 4, 16, 32, 64, 128, 512 };
+    const size_t rounds = iterations * 1000;
+    volatile size_t sink = 0;
+
+    for (const size_t len : lengths) {
+        std::vector<BYTE> buf(BOOT_OPTION_HEADER_SIZE);
+        for (size_t i = 0; i < len; ++i) {
+            const wchar_t ch = static_cast<wchar_t>(L'A' + (i % 26));
+            buf.push_back(static_cast<BYTE>(ch & 0xFF));
+            buf.push_back(static_cast<BYTE>(ch >> 8));
+        }
+        buf.push_back(0);
+        buf.push_back(0);
+        buf.resize(buf.size() + 64, 0x7F);    // device path stand-in
+
+        auto timeIt = [&](std::wstring (*fn)(const std::vector<BYTE>&, size_t, size_t&)) {
+            const LONGLONG start = QpcNow();
+            for (size_t r = 0; r < rounds; ++r) {
+                size_t next = 0;
+                sink = sink + fn(buf, BOOT_OPTION_HEADER_SIZE, next).size() + next;
+            }
+            return QpcToMicros(QpcNow() - start) * 1000.0 / rounds;
+        };
+
+        const double scalar = timeIt(ReadUcs2StringScalar);
+        const double bulk = timeIt(ReadUcs2String);
+
+        Out() << std::fixed << std::setprecision(1)
+                   << L"{\"bench\":\"ucs2\",\"chars\":" << len
+                   << L",\"scalar_ns\":" << scalar
+                   << L",\"bulk_ns\":" << bulk
+                   << L",\"speedup\":" << std::setprecision(2) << (bulk > 0 ? scalar / bulk : 0)
+                   << L"}\n";
+    }
+
+    Out().unsetf(std::ios::floatfield);
+    Out() << std::setprecision(6);
+    return sink == 0 ? 1 : 0;
+}
+
+// Heap allocations made by the calling thread, for the allocations/entry
+// figures of bench parse. Only a build with BOOTEJA_COUNT_ALLOCATIONS
+// defined replaces operator new; the shipped tool and the service keep the
+// CRT's allocator, and bench parse then reports times only.
+#ifdef BOOTEJA_COUNT_ALLOCATIONS
+constexpr bool COUNTS_ALLOCATIONS = true;
+thread_local size_t t_allocations = 0;
+
+void* operator new(size_t size) {
+    ++t_allocations;
+    for (;;) {
+        if (void* p = malloc(size ? size : 1)) {
+            return p;
+        }
+        const std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+#else
+constexpr bool COUNTS_ALLOCATIONS = false;
+constexpr size_t t_allocations = 0;
+#endif
+
+struct ParseCorpusEntry {
+    const wchar_t* Name;
+    std::vector<BYTE> Blob;
+};
+
+// Load options shaped like the ones firmware and OS installers create:
+// Windows Boot Manager with its BCD optional data, shim, PXE, HTTP boot, an
+// NVMe removable-media entry and a vendor diagnostics app in a firmware volume.
+std::vector<ParseCorpusEntry> BuildParseCorpus() {
+    auto node = [](std::vector<BYTE>& path, UINT8 type, UINT8 subType, std::vector<BYTE> payload) {
+        AppendDevicePathNode(path, type, subType, payload.data(), payload.size());
+    };
+    auto ucs2 = [](const std::wstring& s) {
+        std::vector<BYTE> out((s.size() + 1) * sizeof(UINT16), 0);
+        StoreUcs2(out.data(), s.c_str(), s.size());
+        return out;
+    };
+    auto guid = [](const wchar_t* text) {
+        GUID g = {};
+        ParseGuid(text, g);
+        std::vector<BYTE> out(16);
+        StoreGuid(out.data(), g);
+        return out;
+    };
+    auto cat = [](std::vector<BYTE> a, const std::vector<BYTE>& b) {
+        a.insert(a.end(), b.begin(), b.end());
+        return a;
+    };
+    auto hardDrive = [&](std::vector<BYTE>& path) {
+        std::vector<BYTE> hd(38, 0);
+        hd[0] = 1;
+        StoreLe<UINT64>(&hd[4], 0x800);
+        StoreLe<UINT64>(&hd[12], 0x32000);
+        const auto id = guid(L"{4D36E97B-E325-11CE-BFC1-08002BE10318}");
+        std::copy(id.begin(), id.end(), hd.begin() + 20);
+        hd[36] = 2;
+        hd[37] = 2;
+        node(path, 0x04, 0x01, hd);
+    };
+    auto pciRoot = [&](std::vector<BYTE>& path, BYTE device) {
+        node(path, 0x02, 0x01, { 0xD0, 0x41, 0x03, 0x0A, 0, 0, 0, 0 });
+        node(path, 0x01, 0x01, { 0, device });
+    };
+    auto macIpv4 = [&](std::vector<BYTE>& path) {
+        std::vector<BYTE> mac(33, 0);
+        const BYTE addr[] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55 };
+        std::copy(std::begin(addr), std::end(addr), mac.begin());
+        mac[32] = 1;
+        node(path, 0x03, 0x0B, mac);
+        node(path, 0x03, 0x0C, std::vector<BYTE>(23, 0));
+    };
+    auto entry = [&](const wchar_t* name, const wchar_t* description, std::vector<BYTE> path,
+                     std::vector<BYTE> optionalData) {
+        AppendDevicePathEnd(path);
+        ParsedLoadOption plo;
+        plo.Attributes = LOAD_OPTION_ACTIVE;
+        plo.Description = description;
+        plo.DevicePath = std::move(path);
+        plo.OptionalData = std::move(optionalData);
+        return ParseCorpusEntry{ name, BuildLoadOption(plo) };
+    };
+
+    std::vector<ParseCorpusEntry> corpus;
+
+    std::vector<BYTE> path;
+    hardDrive(path);
+    node(path, 0x04, 0x04, ucs2(L"\\EFI\\Microsoft\\Boot\\bootmgfw.efi"));
+    const BYTE bcdHeader[] = { 'W', 'I', 'N', 'D', 'O', 'W', 'S', 0, 1, 0, 0, 0, 0x88, 0, 0, 0 };
+    corpus.push_back(entry(L"windows", L"Windows Boot Manager", path,
+        cat(std::vector<BYTE>(std::begin(bcdHeader), std::end(bcdHeader)),
+            ucs2(L"BCDOBJECT={9dea862c-5cdd-4e70-acc1-f32b344d4795}"))));
+
+    path.clear();
+    hardDrive(path);
+    node(path, 0x04, 0x04, ucs2(L"\\EFI\\ubuntu\\shimx64.efi"));
+    corpus.push_back(entry(L"shim", L"ubuntu", path, {}));
+
+    path.clear();
+    pciRoot(path, 0x1C);
+    macIpv4(path);
+    corpus.push_back(entry(L"pxe", L"UEFI PXEv4 (MAC:001122334455)", path, {}));
+
+    path.clear();
+    pciRoot(path, 0x1C);
+    macIpv4(path);
+    const std::string uri = "http://boot.example.com/images/grubx64.efi";
+    node(path, 0x03, 0x18, std::vector<BYTE>(uri.begin(), uri.end()));
+    corpus.push_back(entry(L"http", L"UEFI HTTPv4 (MAC:001122334455)", path, {}));
+
+    path.clear();
+    pciRoot(path, 0x1D);
+    node(path, 0x03, 0x17, { 1, 0, 0, 0, 0x00, 0x25, 0x38, 0xB5, 0x71, 0xB1, 0x2F, 0x6C });
+    corpus.push_back(entry(L"nvme", L"UEFI NVMe: Samsung SSD 980 PRO 1TB", path, {}));
+
+    path.clear();
+    node(path, 0x04, 0x07, guid(L"{7CB8BDC9-F8EB-4F34-AAEA-3EE4AF6516A1}"));
+    node(path, 0x04, 0x06, guid(L"{E33A28FD-2F3F-4B6E-A3B8-0B1C37D6A8D1}"));
+    corpus.push_back(entry(L"diagnostics", L"Vendor Hardware Diagnostics", path,
+        guid(L"{2D9A8F41-5E8B-4B9C-9D2A-6C3B1E0F7A55}")));
+
+    return corpus;
+}
+
+// ns (and, when counted, heap allocations) per entry for the owning parser,
+// the zero-copy view and the device path decoder, one JSON line per corpus
+// entry. --seeds writes the corpus out as starting inputs for the
+// BOOTEJA_FUZZ build.
+int cmd_bench_parse(size_t iterations, const std::wstring& seedDir) {
+    const auto corpus = BuildParseCorpus();
+
+    if (!seedDir.empty()) {
+        for (const auto& e : corpus) {
+            const std::wstring path = seedDir + L"\\" + e.Name + L".bin";
+            if (!WriteBinaryFile(path, e.Blob.data(), e.Blob.size())) {
+                return 1;
+            }
+        }
+        Out() << L"Wrote " << corpus.size() << L" seed inputs to " << seedDir << L"\n";
+        return 0;
+    }
+
+    const size_t rounds = std::max<size_t>(1, iterations * 1000);
+    volatile size_t sink = 0;
+    std::wstring text;
+
+    for (const auto& e : corpus) {
+        auto timeIt = [&](auto&& fn, double& allocs) {
+            const size_t allocsBefore = t_allocations;
+            const LONGLONG start = QpcNow();
+            for (size_t r = 0; r < rounds; ++r) {
+                sink = sink + fn();
+            }
+            const double ns = QpcToMicros(QpcNow() - start) * 1000.0 / rounds;
+            allocs = static_cast<double>(t_allocations - allocsBefore) / rounds;
+            return ns;
+        };
+
+        double parseAllocs = 0, viewAllocs = 0, pathAllocs = 0;
+        const double parse = timeIt([&] {
+            ParsedLoadOption plo;
+            return ParseLoadOption(e.Blob, plo) ? plo.DevicePath.size() : 0;
+        }, parseAllocs);
+        const double view = timeIt([&] {
+            LoadOptionView lo;
+            return ParseLoadOptionView(e.Blob.data(), e.Blob.size(), lo) ? lo.DevicePath.Size : 0;
+        }, viewAllocs);
+
+        LoadOptionView lo;
+        ParseLoadOptionView(e.Blob.data(), e.Blob.size(), lo);
+        const double decode = timeIt([&] {
+            text.clear();
+            return static_cast<size_t>(AppendDevicePathText(text, lo.DevicePath)) + text.size();
+        }, pathAllocs);
+
+        Out() << std::fixed << std::setprecision(1)
+                   << L"{\"bench\":\"parse\",\"entry\":\"" << e.Name << L"\",\"bytes\":" << e.Blob.size()
+                   << L",\"parse_ns\":" << parse
+                   << L",\"view_ns\":" << view
+                   << L",\"devpath_ns\":" << decode;
+        if (COUNTS_ALLOCATIONS) {
+            Out() << std::setprecision(2)
+                       << L",\"parse_allocs\":" << parseAllocs
+                       << L",\"view_allocs\":" << viewAllocs
+                       << L",\"devpath_allocs\":" << pathAllocs;
+        }
+        Out() << L"}\n";
+    }
+
+    Out().unsetf(std::ios::floatfield);
+    Out() << std::setprecision(6);
+    return sink == 0 ? 1 : 0;
+}
+
+// Launch-to-exit time of fresh booteja processes with output sent to NUL.
+// The first launch of each command line is reported on its own; the rest are
+// the warm distribution. The first launch is not a cold start: this process
+// already has booteja.exe and its DLLs mapped, so it only shows what the
+// first run of a command line costs over the later ones.
+int cmd_bench_startup(size_t iterations) {
+    wchar_t exe[MAX_PATH];
+    if (!GetModuleFileNameW(nullptr, exe, MAX_PATH)) {
+        Err() << L"Cannot locate booteja.exe: " << LastErrorMessage() << L"\n";
+        return 1;
+    }
+
+    SECURITY_ATTRIBUTES inherit = { sizeof(inherit), nullptr, TRUE };
+    const HANDLE nul = CreateFileW(L"NUL", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                   &inherit, OPEN_EXISTING, 0, nullptr);
+    if (nul == INVALID_HANDLE_VALUE) {
+        Err() << L"Cannot open NUL: " << LastErrorMessage() << L"\n";
+        return 1;
+    }
+
+    // help never touches firmware; order pays for the privilege and one read.
+    static const wchar_t* const commands[] = { L"--quiet help", L"--quiet order" };
+    int rc = 0;
+    for (const wchar_t* command : commands) {
+        std::vector<double> warm;
+        double first = 0;
+        for (size_t r = 0; r <= iterations; ++r) {
+            std::wstring line = L"\"" + std::wstring(exe) + L"\" " + command;
+            STARTUPINFOW si = {};
+            si.cb = sizeof(si);
+            si.dwFlags = STARTF_USESTDHANDLES;
+            si.hStdInput = nul;
+            si.hStdOutput = nul;
+            si.hStdError = nul;
+            PROCESS_INFORMATION pi = {};
+
+            const LONGLONG start = QpcNow();
+            if (!CreateProcessW(exe, &line[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr, &si, &pi)) {
+                Err() << L"CreateProcessW failed: " << LastErrorMessage() << L"\n";
+                rc = 1;
+                break;
+            }
+            WaitForSingleObject(pi.hProcess, INFINITE);
+            const double micros = QpcToMicros(QpcNow() - start);
+            CloseHandle(pi.hThread);
+            CloseHandle(pi.hProcess);
+
+            if (r == 0) {
+                first = micros;
+            } else {
+                warm.push_back(micros);
+            }
+        }
+        if (rc != 0) {
+            break;
+        }
+        PrintStatsRecord(L"startup-first", command, L"", 0, ComputeStats({ first }));
+        PrintStatsRecord(L"startup-warm", command, L"", 0, ComputeStats(warm));
+    }
+
+    CloseHandle(nul);
+    return rc;
+}
+
+// Times list output to a console and to a pipe, written line by line (as the
+// old per-field std::wcout chains did) and through ConsoleStreamBuf.
+int cmd_bench_output(size_t iterations) {
+    std::wstringstream captured;
+    {
+        ScopedStreamBuf capture(Out(), captured.rdbuf());
+        if (cmd_list() != 0) {
+            return 1;
+        }
+    }
+    const std::wstring text = captured.str();
+
+    auto run = [&](const wchar_t* sink, HANDLE h) {
+        const bool console = IsConsoleHandle(h);
+
+        size_t lineWrites = 0;
+        const LONGLONG lineStart = QpcNow();
+        for (size_t r = 0; r < iterations; ++r) {
+            size_t pos = 0;
+            while (pos < text.size()) {
+                size_t eol = text.find(L'\n', pos);
+                eol = (eol == std::wstring::npos) ? text.size() : eol + 1;
+                WriteWide(h, console, text.data() + pos, eol - pos);
+                ++lineWrites;
+                pos = eol;
+            }
+        }
+        const double lineMicros = QpcToMicros(QpcNow() - lineStart) / iterations;
+
+        const LONGLONG bufStart = QpcNow();
+        for (size_t r = 0; r < iterations; ++r) {
+            ConsoleStreamBuf sb(h);
+            sb.sputn(text.data(), static_cast<std::streamsize>(text.size()));
+            sb.pubsync();
+        }
+        const double bufMicros = QpcToMicros(QpcNow() - bufStart) / iterations;
+
+        Err() << std::fixed << std::setprecision(1)
+                   << L"{\"bench\":\"output\",\"sink\":\"" << sink << L"\",\"chars\":" << text.size()
+                   << L",\"line_writes\":" << lineWrites / iterations
+                   << L",\"per_line_us\":" << lineMicros
+                   << L",\"buffered_us\":" << bufMicros
+                   << L"}\n";
+        Err().unsetf(std::ios::floatfield);
+    };
+
+    // Results go to stderr so they stay readable next to the console run.
+    HANDLE con = CreateFileW(L"CONOUT$", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (con != INVALID_HANDLE_VALUE) {
+        run(L"console", con);
+        CloseHandle(con);
+    } else {
+        Err() << L"No console attached; skipping the console sink.\n";
+    }
+
+    HANDLE rd = nullptr;
+    HANDLE wr = nullptr;
+    if (!CreatePipe(&rd, &wr, nullptr, 1 << 16)) {
+        Err() << L"CreatePipe failed: " << LastErrorMessage() << L"\n";
+        return 1;
+    }
+
+    std::thread drain([rd] {
+        static BYTE sinkBuf[1 << 16];
+        DWORD got = 0;
+        while (ReadFile(rd, sinkBuf, sizeof(sinkBuf), &got, nullptr) && got > 0) {
+        }
+    });
+
+    run(L"pipe", wr);
+    CloseHandle(wr);
+    drain.join();
+    CloseHandle(rd);
+    return 0;
+}
+
+void PrintHelp() {
+    Out()
+        << L"Booteja  Windows UEFI Boot utility\n\n"
+        << L"Usage: booteja [global options] <command> [options]\n\n"
+        << L"Commands:\n"
+        << L"  list [--all] [--format <fmt>]     List Boot#### entries and BootOrder\n"
+        << L"                                    (--all adds orphaned and dangling entries)\n"
+        << L"  order [--format <fmt>]            Show BootOrder\n"
+        << L"  order set <id[,id,...]>           Set BootOrder (hex IDs or BootXXXX)\n"
+        << L"  select <id>                       Make ID first in BootOrder (default)\n"
+        << L"  next <id>                         Set BootNext one-time target\n"
+        << L"  timeout [get] [--format <fmt>]    Show the boot menu Timeout\n"
+        << L"  timeout [set] <seconds>           Set it (65535 waits indefinitely)\n"
+        << L"  globals [--format <fmt>]          Show Timeout, BootCurrent/Next, SecureBoot and friends\n"
+        << L"  enable <id> / disable <id>        Toggle LOAD_OPTION_ACTIVE\n"
+        << L"  rename <id> \"New Label\"          Rename entry description\n"
+        << L"  create --desc \"Label\" <source> [--data <hex>] [--active] [--first]\n"
+        << L"                                    Add Boot#### and append it to BootOrder; <source> is\n"
+        << L"                                    --file <esp-path>, --uri <http-url> or --devpath <hex>\n"
+        << L"  remove <id>                       Delete Boot#### and drop it from BootOrder/BootNext\n"
+        << L"  dump [--raw] [--format <fmt>]     Raw sizes/attrs diagnostic (--raw adds full hex)\n"
+        << L"  batch <file|->                    Run one command per line, commit once\n"
+        << L"  apply <desired.json> [--plan]     Converge to a desired state (--plan: dry run)\n"
+        << L"  fingerprint [--cache <file>] [--format <fmt>]\n"
+        << L"                                    Digest of BootOrder/BootNext/Boot####; with a cache,\n"
+        << L"                                    report what changed and exit 10 when nothing did\n"
+        << L"  keys [PK|KEK|db|dbx ...] [--format <fmt>]\n"
+        << L"                                    List Secure Boot certificates and hashes\n"
+        << L"  check <efi-file>... [--boot] [--format <fmt>]\n"
+        << L"                                    Authenticode-hash loaders and look them up in dbx/db;\n"
+        << L"                                    --boot checks every entry's loader; exits 5 if revoked\n"
+        << L"  loaders [--format <fmt>]          Resolve each Boot#### to its file on the ESP and\n"
+        << L"                                    report missing loaders (exit 3)\n"
+        << L"  export <file> [--format json]     Back up Boot####, BootOrder and Timeout (binary image)\n"
+        << L"  import <file> [--plan] [--prune]  Restore a backup, writing only what differs\n"
+        << L"  recover [--plan]                  Roll back a commit cut off by a crash or power loss\n"
+        << L"                                    (done automatically by the next write command)\n"
+        << L"  serve [--max-age <ms>] [--install|--uninstall]\n"
+        << L"                                    Resident service answering --service clients over\n"
+        << L"                                    \\\\.\\pipe\\booteja from a cached snapshot\n"
+        << L"  capture <file>                    Record variables and call latency for replay\n"
+        << L"  bench [-n <count>] [--write]      Time firmware calls (p50/p95/p99/max, JSON lines)\n"
+        << L"  bench ucs2 [-n <count>]           Microbenchmark the description decoder\n"
+        << L"  bench output [-n <count>]         Time list output to a console and a pipe\n"
+        << L"  bench startup [-n <count>]        Time first and repeated process startup (help, order)\n"
+        << L"  bench parse [-n <count>] [--seeds <dir>]\n"
+        << L"                                    ns per entry for the load option and device path\n"
+        << L"                                    parsers; --seeds writes the fuzz corpus\n"
+        << L"\nGlobal options (before the command):\n"
+        << L"  --replay <capture>                Run against a capture instead of firmware\n"
+        << L"  --no-latency                      With --replay, answer without captured delays\n"
+        << L"  --quiet, -q                       Do not print the banner\n"
+        << L"  --vars <OVMF_VARS.fd>             Edit a VM variable store file instead of firmware\n"
+        << L"  --service                         Send the command to a running 'booteja serve'\n"
+        << L"  --images <glob> [--jobs <n>]      Run the command on every matching store file in\n"
+        << L"                                    parallel; one NDJSON result per image\n"
+        << L"  --trace[=etw]                     Log and time each firmware call; =etw: ETW only\n"
+        << L"\n<fmt> is text (default), json (one array) or ndjson (one record per line).\n"
+        << L"\nWrite commands exit with 10 when the requested state is already in place.\n"
+        << L"\nExamples:\n"
+        << L"  booteja list\n"
+        << L"  booteja order\n"
+        << L"  booteja select 0003\n"
+        << L"  booteja next 0004\n"
+        << L"  booteja order set 0004,0001,0003,0002\n"
+        << L"  booteja rename 0002 \"Ubuntu NVMe\"\n"
+        << L"  booteja batch provision.txt\n";
+
+    Out().flush();
+}
+
+int cmd_serve(const std::vector<std::wstring>& args);
+bool ImageWorkerMayRun(const std::vector<std::wstring>& args);
+bool WritesFirmware(const std::vector<std::wstring>& args);
+
+int RunCommand(const std::vector<std::wstring>& args) {
+    if (args.empty()) {
+        PrintHelp();
+        return 0;
+    }
+
+    // Checked here rather than once up front so batch lines are covered too.
+    if (!ImageWorkerMayRun(args)) {
+        Err() << L"'" << args[0] << L"' cannot run with --images.\n";
+        return 2;
+    }
+
+    const size_t argc = args.size();
+    std::wstring cmd = args[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::towlower);
+
+    OutputFormat format = OutputFormat::Text;
+    if ((cmd == L"list" || cmd == L"order" || cmd == L"dump" || cmd == L"globals" || cmd == L"timeout") &&
+        !ParseOutputFormat(args, 1, format)) {
         return 2;
     }
 
-    if (!WriteEfiVar(L"BootNext", &target, sizeof(target), g_varAttrsRW)) {
-        return 3;
+    if (cmd == L"globals") {
+        return cmd_globals(format);
+    }
+
+    if (cmd == L"timeout") {
+        std::vector<std::wstring> operands;
+        for (size_t i = 1; i < argc; ++i) {
+            if (args[i] == L"--format") {
+                ++i;
+            } else {
+                operands.push_back(args[i]);
+            }
+        }
+        std::wstring sub = operands.empty() ? std::wstring() : operands[0];
+        std::transform(sub.begin(), sub.end(), sub.begin(), ::towlower);
+        if (sub == L"set" && operands.size() >= 2) {
+            return cmd_timeout_set(operands[1]);
+        }
+        if (!operands.empty() && sub != L"get") {
+            return cmd_timeout_set(operands[0]);
+        }
+        return cmd_timeout_show(format);
+    }
+
+    if (cmd == L"list") {
+        const bool all = std::find(args.begin() + 1, args.end(), L"--all") != args.end();
+        return cmd_list(format, all);
+    }
+
+    if (cmd == L"order") {
+        if (argc >= 2) {
+            std::wstring sub = args[1];
+            std::transform(sub.begin(), sub.end(), sub.begin(), ::towlower);
+            if (sub == L"set" && argc >= 3) {
+                return cmd_order_set(args[2]);
+            }
+        }
+        return cmd_order_show(format);
+    }
+
+    if (cmd == L"select" && argc >= 2) {
+        return cmd_select(args[1]);
+    }
+
+    if (cmd == L"next" && argc >= 2) {
+        return cmd_next(args[1]);
+    }
+
+    if (cmd == L"enable" && argc >= 2) {
+        return cmd_enable_disable(args[1], true);
+    }
+
+    if (cmd == L"disable" && argc >= 2) {
+        return cmd_enable_disable(args[1], false);
+    }
+
+    if (cmd == L"rename" && argc >= 3) {
+        std::wstring label = args[2];
+        for (size_t i = 3; i < argc; ++i) {
+            label += L" ";
+            label += args[i];
+        }
+        return cmd_rename(args[1], label);
+    }
+
+    if (cmd == L"create") {
+        CreateOptions opts;
+        for (size_t i = 1; i < argc; ++i) {
+            const std::wstring& a = args[i];
+            const bool hasValue = i + 1 < argc;
+            if (a == L"--file" && hasValue) {
+                opts.File = args[++i];
+            } else if (a == L"--uri" && hasValue) {
+                opts.Uri = args[++i];
+            } else if (a == L"--devpath" && hasValue) {
+                opts.DevicePathHex = args[++i];
+            } else if (a == L"--desc" && hasValue) {
+                opts.Description = args[++i];
+            } else if (a == L"--data" && hasValue) {
+                opts.DataHex = args[++i];
+            } else if (a == L"--active") {
+                opts.Active = true;
+            } else if (a == L"--first") {
+                opts.First = true;
+            } else {
+                Err() << L"Unknown create option: " << a << L"\n";
+                return 2;
+            }
+        }
+        return cmd_create(opts);
+    }
+
+    if (cmd == L"remove" && argc >= 2) {
+        return cmd_remove(args[1]);
+    }
+
+    if (cmd == L"dump") {
+        const bool raw = std::find(args.begin() + 1, args.end(), L"--raw") != args.end();
+        return cmd_dump(format, raw);
+    }
+
+    if (cmd == L"batch" && argc >= 2) {
+        return cmd_batch(args[1]);
+    }
+
+    if (cmd == L"bench") {
+        size_t iterations = 50;
+        bool withWrites = false;
+        bool ucs2 = false;
+        bool output = false;
+        bool startup = false;
+        bool parse = false;
+        std::wstring seedDir;
+        for (size_t i = 1; i < argc; ++i) {
+            if (args[i] == L"ucs2") {
+                ucs2 = true;
+            } else if (args[i] == L"parse") {
+                parse = true;
+            } else if (args[i] == L"--seeds" && i + 1 < argc) {
+                seedDir = args[++i];
+            } else if (args[i] == L"startup") {
+                startup = true;
+            } else if (args[i] == L"output") {
+                output = true;
+            } else if (args[i] == L"--write") {
+                withWrites = true;
+            } else if ((args[i] == L"-n" || args[i] == L"--iterations") && i + 1 < argc) {
+                iterations = static_cast<size_t>(wcstoul(args[++i].c_str(), nullptr, 10));
+            }
+        }
+        // Every mode divides by the count; 0 or a non-number runs once.
+        iterations = std::max<size_t>(1, iterations);
+        if (ucs2) {
+            return cmd_bench_ucs2(iterations);
+        }
+        if (output) {
+            return cmd_bench_output(iterations);
+        }
+        if (startup) {
+            return cmd_bench_startup(iterations);
+        }
+        if (parse) {
+            return cmd_bench_parse(iterations, seedDir);
+        }
+        return cmd_bench(iterations, withWrites);
+    }
+
+    if (cmd == L"fingerprint") {
+        std::wstring cachePath;
+        const auto cache = std::find(args.begin() + 1, args.end(), L"--cache");
+        if (cache != args.end()) {
+            if (cache + 1 == args.end()) {
+                Err() << L"--cache needs a file.\n";
+                return 2;
+            }
+            cachePath = *(cache + 1);
+        }
+        if (!ParseOutputFormat(args, 1, format)) {
+            return 2;
+        }
+        return cmd_fingerprint(cachePath, format);
+    }
+
+    if (cmd == L"loaders") {
+        if (!ParseOutputFormat(args, 1, format)) {
+            return 2;
+        }
+        return cmd_loaders(format);
+    }
+
+    if (cmd == L"keys" || (cmd == L"check" && argc >= 2)) {
+        if (!ParseOutputFormat(args, 1, format)) {
+            return 2;
+        }
+        std::vector<std::wstring> operands;
+        for (size_t i = 1; i < argc; ++i) {
+            if (args[i] == L"--format") {
+                ++i;
+            } else if (args[i] == L"--boot" && cmd == L"check") {
+                const auto loaders = CollectBootLoaders();
+                operands.insert(operands.end(), loaders.begin(), loaders.end());
+            } else {
+                operands.push_back(args[i]);
+            }
+        }
+        return cmd == L"keys" ? cmd_keys(operands, format) : cmd_check(operands, format);
+    }
+
+    if (cmd == L"serve" && !g_txn) {
+        return cmd_serve(args);
+    }
+
+    if (cmd == L"recover" && !g_txn) {
+        const bool planOnly = std::find(args.begin() + 1, args.end(), L"--plan") != args.end();
+        return cmd_recover(planOnly);
+    }
+
+    if (cmd == L"export" && argc >= 2) {
+        if (!ParseOutputFormat(args, 2, format)) {
+            return 2;
+        }
+        return cmd_export(args[1], format);
+    }
+
+    if (cmd == L"import" && argc >= 2) {
+        const bool planOnly = std::find(args.begin() + 2, args.end(), L"--plan") != args.end();
+        const bool prune = std::find(args.begin() + 2, args.end(), L"--prune") != args.end();
+        return cmd_import(args[1], planOnly, prune);
+    }
+
+    if (cmd == L"capture" && argc >= 2) {
+        return cmd_capture(args[1]);
+    }
+
+    if (cmd == L"apply" && argc >= 2) {
+        const bool planOnly = std::find(args.begin() + 1, args.end(), L"--plan") != args.end();
+        const auto file = std::find_if(args.begin() + 1, args.end(),
+            [](const std::wstring& a) { return a != L"--plan"; });
+        if (file != args.end()) {
+            return cmd_apply(*file, planOnly);
+        }
+    }
+
+    if (g_txn) {
+        Err() << L"Unknown command: " << args[0] << L"\n";
+        return 2;
     }
 
-    std::wcout << L"BootNext set to " << MakeBootVarName(target) << L" (one-time).\n";
+    PrintHelp();
     return 0;
 }
 
-int cmd_enable_disable(const std::wstring& idhex, bool enable) {
-    UINT16 id = 0;
-    if (!ParseBootId(idhex, id)) {
-        std::wcerr << L"Bad id.\n";
-        return 2;
+// ----------------- Images -----------------
+// --images runs one command against many variable store files at once. Each
+// worker owns its backend, snapshot, read cache, transaction and output
+// streams (all thread_local), so every image's output lands in its own NDJSON
+// record.
+thread_local bool t_imageWorker = false;
+
+// Commands that write a file named on the command line, read the live ESP or
+// time the machine (keys, loaders, export, capture, bench, ...) would collide
+// across workers and are not allowed.
+bool ImageWorkerMayRun(const std::vector<std::wstring>& args) {
+    if (!t_imageWorker) {
+        return true;
+    }
+    std::wstring cmd = args[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::towlower);
+    if (cmd == L"fingerprint") {
+        return std::find(args.begin(), args.end(), L"--cache") == args.end();
     }
+    static const wchar_t* const allowed[] = {
+        L"list", L"order", L"dump", L"globals", L"timeout", L"select", L"next", L"enable", L"disable",
+        L"rename", L"create", L"remove", L"batch", L"apply", L"import" };
+    return std::any_of(std::begin(allowed), std::end(allowed), [&](const wchar_t* a) { return cmd == a; });
+}
 
-    ParsedLoadOption plo;
-    DWORD attrs = 0;
-    if (!ReadBootEntry(id, plo, attrs)) {
-        std::wcerr << L"Entry not found.\n";
+// Wildcards are allowed in the last path component only, as with dir.
+bool ExpandImagePattern(const std::wstring& pattern, std::vector<std::wstring>& paths) {
+    const size_t slash = pattern.find_last_of(L"\\/");
+    const std::wstring dir = slash == std::wstring::npos ? std::wstring() : pattern.substr(0, slash + 1);
+
+    WIN32_FIND_DATAW found = {};
+    const HANDLE h = FindFirstFileW(pattern.c_str(), &found);
+    if (h == INVALID_HANDLE_VALUE) {
+        return GetLastError() == ERROR_FILE_NOT_FOUND;
+    }
+    do {
+        if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            paths.push_back(dir + found.cFileName);
+        }
+    } while (FindNextFileW(h, &found));
+    FindClose(h);
+
+    std::sort(paths.begin(), paths.end());
+    return true;
+}
+
+int RunOnImage(const std::wstring& path, const std::vector<std::wstring>& args, std::wstring& out, std::wstring& err) {
+    std::wstringbuf outBuf;
+    std::wstringbuf errBuf;
+    std::wostream outStream(&outBuf);
+    std::wostream errStream(&errBuf);
+    t_streams.Out = &outStream;
+    t_streams.Err = &errStream;
+    t_imageWorker = true;
+
+    g_snapshot = FirmwareSnapshot();
+    g_readSizeHints.clear();
+
+    int rc = 1;
+    {
+        VarStoreEfiBackend store;
+        EfiVarBackend* previous = g_backend;
+        if (store.Open(path)) {
+            g_backend = &store;
+            rc = RunCommand(args);
+            if (!store.Flush()) {
+                Err() << L"Flushing '" << path << L"' failed: " << LastErrorMessage() << L"\n";
+                rc = rc == 0 ? 4 : rc;
+            }
+        }
+        g_backend = previous;
+    }
+    g_snapshot = FirmwareSnapshot();
+
+    t_streams = ThreadStreams();
+    t_imageWorker = false;
+    out = outBuf.str();
+    err = errBuf.str();
+    return rc;
+}
+
+// Images are claimed one at a time from a shared cursor, so a slow image
+// never holds back work queued behind it on the same thread. Records go to
+// sink as each image finishes, in completion order.
+int cmd_images(const std::wstring& pattern, unsigned jobs, const std::vector<std::wstring>& args, std::wstreambuf* sink) {
+    std::vector<std::wstring> paths;
+    if (!ExpandImagePattern(pattern, paths)) {
+        Err() << L"Cannot list '" << pattern << L"': " << LastErrorMessage() << L"\n";
+        return 1;
+    }
+    if (paths.empty()) {
+        Err() << L"No files match '" << pattern << L"'.\n";
         return 3;
     }
 
-    if (enable) {
-        plo.Attributes |= LOAD_OPTION_ACTIVE;
-    } else {
-        plo.Attributes &= ~LOAD_OPTION_ACTIVE;
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
     }
+    jobs = static_cast<unsigned>(std::min<size_t>(jobs, paths.size()));
 
-    if (!WriteBootEntry(id, plo)) {
-        return 4;
+    std::atomic<size_t> next(0);
+    std::mutex emit;
+    size_t changed = 0;
+    size_t unchanged = 0;
+    size_t failed = 0;
+    const LONGLONG begin = QpcNow();
+
+    auto worker = [&] {
+        std::wstring record;
+        for (size_t i = next++; i < paths.size(); i = next++) {
+            std::wstring out;
+            std::wstring err;
+            const LONGLONG start = QpcNow();
+            const int rc = RunOnImage(paths[i], args, out, err);
+            const double ms = QpcToMicros(QpcNow() - start) / 1000.0;
+
+            record.assign(L"{\"image\":\"");
+            AppendJsonEscaped(record, paths[i].data(), paths[i].size());
+            record.append(L"\",\"exit\":");
+            AppendDec(record, static_cast<UINT64>(rc));
+            record.append(L",\"ms\":");
+            record.append(std::to_wstring(ms));
+            record.append(L",\"stdout\":\"");
+            AppendJsonEscaped(record, out.data(), out.size());
+            record.append(L"\",\"stderr\":\"");
+            AppendJsonEscaped(record, err.data(), err.size());
+            record.append(L"\"}\n");
+
+            std::lock_guard<std::mutex> lock(emit);
+            sink->sputn(record.data(), static_cast<std::streamsize>(record.size()));
+            sink->pubsync();
+            if (rc == 0) {
+                ++changed;
+            } else if (rc == EXIT_UNCHANGED) {
+                ++unchanged;
+            } else {
+                ++failed;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < jobs; ++t) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : pool) {
+        t.join();
     }
 
-    std::wcout << (enable ? L"Enabled " : L"Disabled ") << MakeBootVarName(id) << L".\n";
-    return 0;
+    Err() << paths.size() << L" image(s) on " << jobs << L" thread(s) in "
+               << QpcToMicros(QpcNow() - begin) / 1000.0 << L" ms: " << changed << L" ok, "
+               << unchanged << L" unchanged, " << failed << L" failed.\n";
+    if (failed > 0) {
+        return 1;
+    }
+    return changed == 0 ? EXIT_UNCHANGED : 0;
 }
 
-int cmd_rename(const std::wstring& idhex, const std::wstring& newLabel) {
-    UINT16 id = 0;
-    if (!ParseBootId(idhex, id)) {
-        std::wcerr << L"Bad id.\n";
-        return 2;
+// ----------------- Service -----------------
+// "booteja serve" keeps the privilege and a warm snapshot resident and runs
+// commands for clients over a message-mode named pipe; "booteja --service
+// <command>" is the client. One request is one message and so is its reply:
+//   request  ServiceMessageHeader, then Count NUL-terminated UTF-16 arguments
+//   reply    ServiceMessageHeader, ServiceReplyHeader, stdout, stderr (UTF-16)
+// Connections are served one at a time, so concurrent clients are
+// serialized instead of racing on BootOrder.
+constexpr const wchar_t* SERVICE_NAME = L"Booteja";
+constexpr const wchar_t* SERVICE_DISPLAY_NAME = L"Booteja UEFI boot variable service";
+constexpr const wchar_t* SERVICE_PIPE_NAME = L"\\\\.\\pipe\\booteja";
+// Local administrators and SYSTEM only.
+constexpr const wchar_t* SERVICE_PIPE_SDDL = L"D:P(A;;GA;;;BA)(A;;GA;;;SY)";
+constexpr UINT32 SERVICE_MAGIC = 0x534A5442;    // "BTJS"
+constexpr UINT16 SERVICE_PROTOCOL_VERSION = 1;
+constexpr DWORD SERVICE_MAX_REQUEST = 64 * 1024;
+constexpr DWORD SERVICE_IO_TIMEOUT_MS = 5000;
+constexpr DWORD SERVICE_CLIENT_WAIT_MS = 10000;
+constexpr DWORD SERVICE_CLIENT_RETRY_MS = 50;
+constexpr DWORD DEFAULT_SNAPSHOT_MAX_AGE_MS = 5000;
+
+#pragma pack(push, 1)
+struct ServiceMessageHeader {
+    UINT32 Magic;
+    UINT16 Version;
+    UINT16 Count;    // arguments in a request, 0 in a reply
+};
+
+struct ServiceReplyHeader {
+    INT32 Exit;
+    UINT32 OutChars;
+    UINT32 ErrChars;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(ServiceMessageHeader) == 8, "ServiceMessageHeader is 8 bytes on the wire");
+static_assert(sizeof(ServiceReplyHeader) == 12, "ServiceReplyHeader is 12 bytes on the wire");
+
+// Commands a client may run; nothing that reads or writes a client-named
+// file on the service's side.
+bool IsServiceCommand(const std::vector<std::wstring>& args) {
+    std::wstring cmd = args[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::towlower);
+    if (cmd == L"fingerprint") {
+        return std::find(args.begin(), args.end(), L"--cache") == args.end();
     }
+    static const wchar_t* const allowed[] = {
+        L"list", L"order", L"dump", L"globals", L"timeout", L"select", L"next",
+        L"enable", L"disable", L"rename", L"remove", L"keys", L"loaders" };
+    return std::any_of(std::begin(allowed), std::end(allowed), [&](const wchar_t* a) { return cmd == a; });
+}
 
-    ParsedLoadOption plo;
-    DWORD attrs = 0;
-    if (!ReadBootEntry(id, plo, attrs)) {
-        std::wcerr << L"Entry not found.\n";
-        return 3;
+std::vector<BYTE> EncodeServiceRequest(const std::vector<std::wstring>& args) {
+    size_t total = sizeof(ServiceMessageHeader);
+    for (const auto& a : args) {
+        total += (a.size() + 1) * sizeof(UINT16);
     }
 
-    ParsedLoadOption updated = plo;
-    updated.Description = newLabel;
+    std::vector<BYTE> msg(total, 0);
+    const ServiceMessageHeader hdr = { SERVICE_MAGIC, SERVICE_PROTOCOL_VERSION, static_cast<UINT16>(args.size()) };
+    memcpy(msg.data(), &hdr, sizeof(hdr));
+    size_t off = sizeof(hdr);
+    for (const auto& a : args) {
+        StoreUcs2(&msg[off], a.c_str(), a.size());
+        off += (a.size() + 1) * sizeof(UINT16);
+    }
+    return msg;
+}
 
-    if (!WriteBootEntry(id, updated)) {
-        return 4;
+bool DecodeServiceRequest(const BYTE* p, size_t n, std::vector<std::wstring>& args) {
+    ServiceMessageHeader hdr = {};
+    if (n < sizeof(hdr)) {
+        return false;
+    }
+    memcpy(&hdr, p, sizeof(hdr));
+    if (hdr.Magic != SERVICE_MAGIC || hdr.Version != SERVICE_PROTOCOL_VERSION || hdr.Count == 0) {
+        return false;
     }
 
-    std::wcout << L"Renamed " << MakeBootVarName(id) << L" to '" << newLabel << L"'.\n";
-    return 0;
+    args.clear();
+    size_t off = sizeof(hdr);
+    for (UINT16 i = 0; i < hdr.Count; ++i) {
+        const size_t end = FindUcs2Terminator(p, off, n);
+        if (end + sizeof(UINT16) > n) {
+            return false;
+        }
+        std::wstring a((end - off) / sizeof(UINT16), L'\0');
+        if (!a.empty()) {
+            CopyUcs2(&a[0], p + off, a.size());
+        }
+        args.push_back(std::move(a));
+        off = end + sizeof(UINT16);
+    }
+    return off == n;
 }
 
-int cmd_dump() {
-    DWORD attrs = 0;
-    const auto orderRaw = ReadEfiVar(L"BootOrder", attrs);
-    if (orderRaw.empty()) {
-        std::wcerr << L"BootOrder read failed: " << LastErrorMessage() << L"\n";
+std::vector<BYTE> EncodeServiceReply(int exit, const std::wstring& out, const std::wstring& err) {
+    std::vector<BYTE> msg(sizeof(ServiceMessageHeader) + sizeof(ServiceReplyHeader) +
+                          (out.size() + err.size()) * sizeof(UINT16));
+    const ServiceMessageHeader hdr = { SERVICE_MAGIC, SERVICE_PROTOCOL_VERSION, 0 };
+    const ServiceReplyHeader reply = { exit, static_cast<UINT32>(out.size()), static_cast<UINT32>(err.size()) };
+    memcpy(msg.data(), &hdr, sizeof(hdr));
+    memcpy(msg.data() + sizeof(hdr), &reply, sizeof(reply));
+    BYTE* text = msg.data() + sizeof(hdr) + sizeof(reply);
+    StoreUcs2(text, out.data(), out.size());
+    StoreUcs2(text + out.size() * sizeof(UINT16), err.data(), err.size());
+    return msg;
+}
+
+bool DecodeServiceReply(const BYTE* p, size_t n, int& exit, std::wstring& out, std::wstring& err) {
+    ServiceMessageHeader hdr = {};
+    ServiceReplyHeader reply = {};
+    if (n < sizeof(hdr) + sizeof(reply)) {
+        return false;
+    }
+    memcpy(&hdr, p, sizeof(hdr));
+    memcpy(&reply, p + sizeof(hdr), sizeof(reply));
+    const BYTE* text = p + sizeof(hdr) + sizeof(reply);
+    if (hdr.Magic != SERVICE_MAGIC || hdr.Version != SERVICE_PROTOCOL_VERSION ||
+        (static_cast<size_t>(reply.OutChars) + reply.ErrChars) * sizeof(UINT16) != n - (text - p)) {
+        return false;
+    }
+
+    exit = reply.Exit;
+    out.assign(reply.OutChars, L'\0');
+    err.assign(reply.ErrChars, L'\0');
+    if (!out.empty()) {
+        CopyUcs2(&out[0], text, out.size());
+    }
+    if (!err.empty()) {
+        CopyUcs2(&err[0], text + out.size() * sizeof(UINT16), err.size());
+    }
+    return true;
+}
+
+// Remembers whether anything was written, so the service can drop its
+// snapshot after a request that changed firmware state.
+class WriteWatchEfiBackend : public EfiVarBackend {
+public:
+    explicit WriteWatchEfiBackend(EfiVarBackend& inner) : inner_(inner) {}
+
+    bool Enumerate(std::vector<EfiVariable>& vars) override { return inner_.Enumerate(vars); }
+
+    DWORD Read(const wchar_t* name, const wchar_t* guid, void* buf, DWORD size, DWORD* attrs) override {
+        return inner_.Read(name, guid, buf, size, attrs);
+    }
+
+    bool Write(const wchar_t* name, const wchar_t* guid, const void* data, DWORD size, DWORD attrs) override {
+        const bool ok = inner_.Write(name, guid, data, size, attrs);
+        written_ = written_ || ok;
+        return ok;
+    }
+
+    bool TakeWritten() {
+        const bool written = written_;
+        written_ = false;
+        return written;
+    }
+
+private:
+    EfiVarBackend& inner_;
+    bool written_ = false;
+};
+
+// Completes one overlapped pipe operation. Gives up when the service is
+// stopping or the peer stalls, so one bad client cannot wedge the loop.
+bool FinishPipeIo(HANDLE pipe, OVERLAPPED& ov, BOOL started, HANDLE stop, DWORD timeoutMs, DWORD* bytes) {
+    if (!started) {
+        const DWORD err = GetLastError();
+        if (err == ERROR_PIPE_CONNECTED) {
+            return true;    // the client connected before ConnectNamedPipe
+        }
+        if (err != ERROR_IO_PENDING) {
+            return false;
+        }
+    }
+
+    const HANDLE waits[] = { ov.hEvent, stop };
+    DWORD done = 0;
+    if (WaitForMultipleObjects(2, waits, FALSE, timeoutMs) != WAIT_OBJECT_0) {
+        CancelIoEx(pipe, &ov);
+        GetOverlappedResult(pipe, &ov, &done, TRUE);
+        return false;
+    }
+    const BOOL ok = GetOverlappedResult(pipe, &ov, &done, FALSE);
+    if (bytes) {
+        *bytes = done;
+    }
+    return ok != FALSE;
+}
+
+// Runs one request with output captured, like an --images worker. Reads are
+// served from a snapshot that survives until it is older than maxAgeMs or a
+// request wrote something. Writes always start from a fresh one, since other
+// tools may have changed the store inside that window and compare-before-write,
+// BootOrder rebuilds and the journal's old values all come from it.
+std::vector<BYTE> HandleServiceRequest(const BYTE* p, size_t n, WriteWatchEfiBackend& watch,
+                                       DWORD maxAgeMs, LONGLONG& loadedAt) {
+    std::vector<std::wstring> args;
+    if (!DecodeServiceRequest(p, n, args)) {
+        return EncodeServiceReply(2, L"", L"Malformed request.\n");
+    }
+    if (!IsServiceCommand(args)) {
+        return EncodeServiceReply(2, L"", L"'" + args[0] + L"' is not available through the service.\n");
+    }
+
+    if (g_snapshot.Attempted() &&
+        (WritesFirmware(args) || QpcToMicros(QpcNow() - loadedAt) / 1000.0 > maxAgeMs)) {
+        g_snapshot = FirmwareSnapshot();
+    }
+    if (!g_snapshot.Attempted()) {
+        g_snapshot.Load();
+        loadedAt = QpcNow();
+    }
+
+    std::wstringbuf outBuf;
+    std::wstringbuf errBuf;
+    std::wostream outStream(&outBuf);
+    std::wostream errStream(&errBuf);
+    t_streams.Out = &outStream;
+    t_streams.Err = &errStream;
+    const int rc = RunCommand(args);
+    t_streams = ThreadStreams();
+
+    if (watch.TakeWritten()) {
+        g_snapshot = FirmwareSnapshot();
+    }
+    return EncodeServiceReply(rc, outBuf.str(), errBuf.str());
+}
+
+int ServeLoop(HANDLE stop, DWORD maxAgeMs) {
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, FALSE };
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(SERVICE_PIPE_SDDL, SDDL_REVISION_1,
+                                                              &sa.lpSecurityDescriptor, nullptr)) {
+        Err() << L"Cannot build the pipe security descriptor: " << LastErrorMessage() << L"\n";
         return 1;
     }
 
-    std::wcout << L"BootOrder bytes: " << orderRaw.size() << L"\n";
+    WriteWatchEfiBackend watch(*g_backend);
+    EfiVarBackend* previous = g_backend;
+    g_backend = &watch;
 
-    const auto order = GetBootOrder();
-    size_t index = 0;
-    for (const auto id : order) {
-        DWORD varAttrs = 0;
-        const auto name = MakeBootVarName(id);
-        const auto data = ReadEfiVar(name, varAttrs);
+    // One instance, reused for every client: it exists for the whole run, so a
+    // client arriving between two requests waits on ERROR_PIPE_BUSY instead of
+    // finding no pipe. Creating it as the first instance fails if another
+    // process already owns the name.
+    const HANDLE pipe = CreateNamedPipeW(
+        SERVICE_PIPE_NAME, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1, SERVICE_MAX_REQUEST, SERVICE_MAX_REQUEST, 0, &sa);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        Err() << L"Cannot create " << SERVICE_PIPE_NAME << L" (is another server running?): "
+                   << LastErrorMessage() << L"\n";
+        g_backend = previous;
+        LocalFree(sa.lpSecurityDescriptor);
+        return 1;
+    }
 
-        std::wcout << L"[" << ++index << L"] "
-                   << name
-                   << L" size=" << data.size()
-                   << L" attrs=0x" << std::hex << varAttrs << std::dec
-                   << L"\n";
+    OVERLAPPED ov = {};
+    ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    std::vector<BYTE> request(SERVICE_MAX_REQUEST);
+    LONGLONG loadedAt = 0;
+
+    while (WaitForSingleObject(stop, 0) != WAIT_OBJECT_0) {
+        DWORD got = 0;
+        if (FinishPipeIo(pipe, ov, ConnectNamedPipe(pipe, &ov), stop, INFINITE, nullptr) &&
+            FinishPipeIo(pipe, ov, ReadFile(pipe, request.data(), SERVICE_MAX_REQUEST, nullptr, &ov),
+                         stop, SERVICE_IO_TIMEOUT_MS, &got)) {
+            const auto reply = HandleServiceRequest(request.data(), got, watch, maxAgeMs, loadedAt);
+            if (FinishPipeIo(pipe, ov, WriteFile(pipe, reply.data(), static_cast<DWORD>(reply.size()), nullptr, &ov),
+                             stop, SERVICE_IO_TIMEOUT_MS, nullptr)) {
+                FlushFileBuffers(pipe);
+            }
+        }
+        DisconnectNamedPipe(pipe);
     }
 
+    CloseHandle(pipe);
+    CloseHandle(ov.hEvent);
+    g_backend = previous;
+    LocalFree(sa.lpSecurityDescriptor);
     return 0;
 }
 
-void PrintHelp() {
-    std::wcout
-        << L"Booteja  Windows UEFI Boot utility\n\n"
-        << L"Usage: booteja <command> [options]\n\n"
-        << L"Commands:\n"
-        << L"  list                              List Boot#### entries and BootOrder\n"
-        << L"  order                             Show BootOrder\n"
-        << L"  order set <id[,id,...]>           Set BootOrder (hex IDs or BootXXXX)\n"
-        << L"  select <id>                       Make ID first in BootOrder (default)\n"
-        << L"  next <id>                         Set BootNext one-time target\n"
-        << L"  enable <id> / disable <id>        Toggle LOAD_OPTION_ACTIVE\n"
-        << L"  rename <id> \"New Label\"          Rename entry description\n"
-        << L"  dump                              Raw sizes/attrs diagnostic\n"
-        << L"\nExamples:\n"
-        << L"  booteja list\n"
-        << L"  booteja order\n"
-        << L"  booteja select 0003\n"
-        << L"  booteja next 0004\n"
-        << L"  booteja order set 0004,0001,0003,0002\n"
-        << L"  booteja rename 0002 \"Ubuntu NVMe\"\n";
+// State shared with the service control handler.
+static SERVICE_STATUS_HANDLE g_serviceStatusHandle = nullptr;
+static SERVICE_STATUS g_serviceStatus = {};
+static HANDLE g_serviceStop = nullptr;
+static EfiVarBackend* g_serviceBackend = nullptr;
+static DWORD g_serviceMaxAgeMs = DEFAULT_SNAPSHOT_MAX_AGE_MS;
 
-    std::wcout.flush();
+void ReportServiceState(DWORD state, DWORD exitCode = NO_ERROR) {
+    g_serviceStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+    g_serviceStatus.dwCurrentState = state;
+    g_serviceStatus.dwControlsAccepted = state == SERVICE_RUNNING ? SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN : 0;
+    g_serviceStatus.dwWin32ExitCode = exitCode;
+    SetServiceStatus(g_serviceStatusHandle, &g_serviceStatus);
 }
 
-int wmain(int argc, wchar_t** argv) {
-    _setmode(_fileno(stdout), _O_U16TEXT);
-    _setmode(_fileno(stderr), _O_U16TEXT);
+DWORD WINAPI ServiceControlHandler(DWORD control, DWORD, LPVOID, LPVOID) {
+    if (control == SERVICE_CONTROL_STOP || control == SERVICE_CONTROL_SHUTDOWN) {
+        ReportServiceState(SERVICE_STOP_PENDING);
+        SetEvent(g_serviceStop);
+        return NO_ERROR;
+    }
+    return control == SERVICE_CONTROL_INTERROGATE ? NO_ERROR : ERROR_CALL_NOT_IMPLEMENTED;
+}
 
-    std::wcout << L"Booteja (Windows / UEFI)\n";
-    if (!EnableSystemEnvironmentPrivilege()) {
-        std::wcerr << L"Warning: Could not enable SeSystemEnvironmentPrivilege. Run elevated on a UEFI system.\n";
+// Runs on a dispatcher thread, which has its own thread_local state.
+void WINAPI ServiceMain(DWORD, LPWSTR*) {
+    g_serviceStatusHandle = RegisterServiceCtrlHandlerExW(SERVICE_NAME, ServiceControlHandler, nullptr);
+    if (!g_serviceStatusHandle) {
+        return;
     }
+    ReportServiceState(SERVICE_RUNNING);
+    g_backend = g_serviceBackend;
+    const int rc = ServeLoop(g_serviceStop, g_serviceMaxAgeMs);
+    ReportServiceState(SERVICE_STOPPED, rc == 0 ? NO_ERROR : ERROR_SERVICE_SPECIFIC_ERROR);
+}
 
-    if (argc < 2) {
-        PrintHelp();
-        return 0;
+int InstallService(DWORD maxAgeMs) {
+    wchar_t exe[MAX_PATH];
+    if (!GetModuleFileNameW(nullptr, exe, MAX_PATH)) {
+        Err() << L"Cannot locate booteja.exe: " << LastErrorMessage() << L"\n";
+        return 1;
     }
+    const std::wstring command = L"\"" + std::wstring(exe) + L"\" serve --max-age " + std::to_wstring(maxAgeMs);
 
-    std::wstring cmd = argv[1];
-    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::towlower);
+    const SC_HANDLE scm = OpenSCManagerW(nullptr, nullptr, SC_MANAGER_CREATE_SERVICE);
+    const SC_HANDLE svc = scm ? CreateServiceW(scm, SERVICE_NAME, SERVICE_DISPLAY_NAME, SERVICE_ALL_ACCESS,
+                                               SERVICE_WIN32_OWN_PROCESS, SERVICE_AUTO_START, SERVICE_ERROR_NORMAL,
+                                               command.c_str(), nullptr, nullptr, nullptr, nullptr, nullptr)
+                              : nullptr;
+    const bool ok = svc && StartServiceW(svc, 0, nullptr);
+    if (!ok) {
+        Err() << L"Install failed: " << LastErrorMessage() << L"\n";
+    }
+    if (svc) {
+        CloseServiceHandle(svc);
+    }
+    if (scm) {
+        CloseServiceHandle(scm);
+    }
+    if (ok) {
+        Out() << L"Service '" << SERVICE_NAME << L"' installed and started.\n";
+    }
+    return ok ? 0 : 3;
+}
 
-    if (cmd == L"list") {
-        return cmd_list();
+int UninstallService() {
+    const SC_HANDLE scm = OpenSCManagerW(nullptr, nullptr, SC_MANAGER_CONNECT);
+    const SC_HANDLE svc = scm ? OpenServiceW(scm, SERVICE_NAME, SERVICE_STOP | DELETE) : nullptr;
+    SERVICE_STATUS status = {};
+    if (svc) {
+        ControlService(svc, SERVICE_CONTROL_STOP, &status);
+    }
+    const bool ok = svc && DeleteService(svc);
+    if (!ok) {
+        Err() << L"Uninstall failed: " << LastErrorMessage() << L"\n";
+    }
+    if (svc) {
+        CloseServiceHandle(svc);
+    }
+    if (scm) {
+        CloseServiceHandle(scm);
+    }
+    if (ok) {
+        Out() << L"Service '" << SERVICE_NAME << L"' removed.\n";
     }
+    return ok ? 0 : 3;
+}
 
-    if (cmd == L"order") {
-        if (argc >= 3) {
-            std::wstring sub = argv[2];
-            std::transform(sub.begin(), sub.end(), sub.begin(), ::towlower);
-            if (sub == L"set" && argc >= 4) {
-                return cmd_order_set(argv[3]);
+BOOL WINAPI StopServeOnConsoleCtrl(DWORD) {
+    SetEvent(g_serviceStop);
+    return TRUE;
+}
+
+// Under the service control manager this becomes the service; started from a
+// console it serves in the foreground until Ctrl+C.
+int cmd_serve(const std::vector<std::wstring>& args) {
+    DWORD maxAgeMs = DEFAULT_SNAPSHOT_MAX_AGE_MS;
+    bool install = false;
+    bool uninstall = false;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == L"--max-age" && i + 1 < args.size()) {
+            wchar_t* end = nullptr;
+            maxAgeMs = wcstoul(args[++i].c_str(), &end, 10);
+            if (*end != L'\0') {
+                Err() << L"--max-age takes milliseconds.\n";
+                return 2;
             }
+        } else if (args[i] == L"--install") {
+            install = true;
+        } else if (args[i] == L"--uninstall") {
+            uninstall = true;
+        } else {
+            Err() << L"Unknown serve option: " << args[i] << L"\n";
+            return 2;
         }
-        return cmd_order_show();
     }
+    if (install) {
+        return InstallService(maxAgeMs);
+    }
+    if (uninstall) {
+        return UninstallService();
+    }
+
+    g_serviceStop = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    g_serviceBackend = g_backend;
+    g_serviceMaxAgeMs = maxAgeMs;
 
-    if (cmd == L"select" && argc >= 3) {
-        return cmd_select(argv[2]);
+    wchar_t name[] = L"Booteja";
+    const SERVICE_TABLE_ENTRYW table[] = { { name, ServiceMain }, { nullptr, nullptr } };
+    if (StartServiceCtrlDispatcherW(table)) {
+        return 0;
+    }
+    if (GetLastError() != ERROR_FAILED_SERVICE_CONTROLLER_CONNECT) {
+        Err() << L"Service dispatcher failed: " << LastErrorMessage() << L"\n";
+        return 1;
     }
 
-    if (cmd == L"next" && argc >= 3) {
-        return cmd_next(argv[2]);
+    SetConsoleCtrlHandler(StopServeOnConsoleCtrl, TRUE);
+    Out() << L"Serving on " << SERVICE_PIPE_NAME << L" (snapshot max age " << maxAgeMs << L" ms); Ctrl+C stops.\n";
+    Out().flush();
+    return ServeLoop(g_serviceStop, maxAgeMs);
+}
+
+// Sends one command to a running "booteja serve" and replays its output.
+int CallService(const std::vector<std::wstring>& args) {
+    if (args.empty()) {
+        Err() << L"--service needs a command.\n";
+        return 2;
     }
 
-    if (cmd == L"enable" && argc >= 3) {
-        return cmd_enable_disable(argv[2], true);
+    // Busy means another client is being served; not found means the service
+    // is still starting. Both are retried until SERVICE_CLIENT_WAIT_MS.
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    const LONGLONG start = QpcNow();
+    for (;;) {
+        pipe = CreateFileW(SERVICE_PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (pipe != INVALID_HANDLE_VALUE) {
+            break;
+        }
+        const DWORD err = GetLastError();
+        const double waitedMs = QpcToMicros(QpcNow() - start) / 1000.0;
+        if ((err != ERROR_PIPE_BUSY && err != ERROR_FILE_NOT_FOUND) || waitedMs >= SERVICE_CLIENT_WAIT_MS) {
+            Err() << L"Cannot reach the booteja service: " << LastErrorMessage(err) << L"\n";
+            return 1;
+        }
+        if (err != ERROR_PIPE_BUSY ||
+            !WaitNamedPipeW(SERVICE_PIPE_NAME, SERVICE_CLIENT_WAIT_MS - static_cast<DWORD>(waitedMs))) {
+            Sleep(SERVICE_CLIENT_RETRY_MS);
+        }
     }
 
-    if (cmd == L"disable" && argc >= 3) {
-        return cmd_enable_disable(argv[2], false);
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    SetNamedPipeHandleState(pipe, &mode, nullptr, nullptr);
+
+    const auto request = EncodeServiceRequest(args);
+    std::vector<BYTE> reply;
+    DWORD wrote = 0;
+    bool ok = WriteFile(pipe, request.data(), static_cast<DWORD>(request.size()), &wrote, nullptr) != FALSE;
+    while (ok) {
+        BYTE chunk[16 * 1024];
+        DWORD got = 0;
+        const BOOL done = ReadFile(pipe, chunk, sizeof(chunk), &got, nullptr);
+        reply.insert(reply.end(), chunk, chunk + got);
+        if (done) {
+            break;
+        }
+        ok = GetLastError() == ERROR_MORE_DATA;
     }
+    const DWORD err = GetLastError();
+    CloseHandle(pipe);
 
-    if (cmd == L"rename" && argc >= 4) {
-        std::wstring label = argv[3];
-        for (int i = 4; i < argc; ++i) {
-            label += L" ";
-            label += argv[i];
+    int rc = 1;
+    std::wstring out;
+    std::wstring errText;
+    if (!ok) {
+        Err() << L"Service request failed: " << LastErrorMessage(err) << L"\n";
+        return 1;
+    }
+    if (!DecodeServiceReply(reply.data(), reply.size(), rc, out, errText)) {
+        Err() << L"Malformed reply from the booteja service.\n";
+        return 1;
+    }
+    Out() << out;
+    Err() << errText;
+    return rc;
+}
+
+struct GlobalOptions {
+    std::wstring ReplayPath;
+    std::wstring VarStorePath;
+    std::wstring ImagesPattern;
+    unsigned Jobs = 0;    // 0: one per logical processor
+    bool UseService = false;
+    bool Quiet = false;    // no banner
+    bool ReplayLatency = true;
+    bool Trace = false;
+    bool TraceToStderr = true;
+};
+
+// Consumes leading --options and leaves the command and its arguments.
+bool ParseGlobalOptions(std::vector<std::wstring>& args, GlobalOptions& opts) {
+    size_t i = 0;
+    for (; i < args.size() && (args[i].compare(0, 2, L"--") == 0 || args[i] == L"-q"); ++i) {
+        if (args[i] == L"--replay" && i + 1 < args.size()) {
+            opts.ReplayPath = args[++i];
+        } else if (args[i] == L"--vars" && i + 1 < args.size()) {
+            opts.VarStorePath = args[++i];
+        } else if (args[i] == L"--images" && i + 1 < args.size()) {
+            opts.ImagesPattern = args[++i];
+        } else if (args[i] == L"--quiet" || args[i] == L"-q") {
+            opts.Quiet = true;
+        } else if (args[i] == L"--service") {
+            opts.UseService = true;
+        } else if (args[i] == L"--jobs" && i + 1 < args.size()) {
+            wchar_t* end = nullptr;
+            const unsigned long jobs = wcstoul(args[++i].c_str(), &end, 10);
+            if (*end != L'\0' || jobs == 0 || jobs > 1024) {
+                Err() << L"--jobs takes a thread count from 1 to 1024.\n";
+                return false;
+            }
+            opts.Jobs = static_cast<unsigned>(jobs);
+        } else if (args[i] == L"--no-latency") {
+            opts.ReplayLatency = false;
+        } else if (args[i] == L"--trace") {
+            opts.Trace = true;
+        } else if (args[i] == L"--trace=etw") {
+            opts.Trace = true;
+            opts.TraceToStderr = false;
+        } else {
+            Err() << L"Unknown option: " << args[i] << L"\n";
+            return false;
         }
-        return cmd_rename(argv[2], label);
     }
+    args.erase(args.begin(), args.begin() + i);
 
-    if (cmd == L"dump") {
-        return cmd_dump();
+    if (!opts.ReplayPath.empty() && !opts.VarStorePath.empty()) {
+        Err() << L"--replay and --vars cannot be combined.\n";
+        return false;
+    }
+    if (!opts.ImagesPattern.empty() && (!opts.ReplayPath.empty() || !opts.VarStorePath.empty() || opts.Trace)) {
+        Err() << L"--images cannot be combined with --replay, --vars or --trace.\n";
+        return false;
+    }
+    if (opts.UseService && (!opts.ReplayPath.empty() || !opts.VarStorePath.empty() || !opts.ImagesPattern.empty())) {
+        Err() << L"--service cannot be combined with --replay, --vars or --images.\n";
+        return false;
     }
+    return true;
+}
 
-    PrintHelp();
+// Commands that may write boot variables; only these roll back a pending
+// journal on their own, so reads and help never take the privilege for it.
+bool WritesFirmware(const std::vector<std::wstring>& args) {
+    std::wstring cmd = args[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::towlower);
+    const bool planOnly = std::find(args.begin(), args.end(), L"--plan") != args.end();
+    if (cmd == L"order") {
+        return args.size() >= 3 && _wcsicmp(args[1].c_str(), L"set") == 0;
+    }
+    if (cmd == L"timeout") {
+        return args.size() >= 2 && args[1] != L"--format" && _wcsicmp(args[1].c_str(), L"get") != 0;
+    }
+    if (cmd == L"apply" || cmd == L"import") {
+        return !planOnly;
+    }
+    static const wchar_t* const writers[] = {
+        L"select", L"next", L"enable", L"disable", L"rename", L"create", L"remove", L"batch", L"serve" };
+    return std::any_of(std::begin(writers), std::end(writers), [&](const wchar_t* w) { return cmd == w; });
+}
+
+#ifdef BOOTEJA_FUZZ
+// libFuzzer entry point over the parsers that read untrusted firmware bytes.
+// Build without the console entry point and seed with 'bench parse --seeds':
+//   cl /std:c++14 /EHsc /Zi /fsanitize=fuzzer,address /DBOOTEJA_FUZZ Booteja.cpp
+// The owning and zero-copy load option parsers must agree on every input.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    const std::vector<BYTE> blob(data, data + size);
+
+    ParsedLoadOption plo;
+    LoadOptionView lo;
+    const bool owned = ParseLoadOption(blob, plo);
+    const bool viewed = ParseLoadOptionView(blob.data(), blob.size(), lo);
+    if (owned != viewed) {
+        abort();
+    }
+
+    std::wstring text;
+    if (viewed) {
+        std::wstring description;
+        AppendUcs2(description, lo.Description);
+        if (description != plo.Description || lo.DevicePath.Size != plo.DevicePath.size() ||
+            lo.OptionalData.Size != plo.OptionalData.size()) {
+            abort();
+        }
+        AppendDevicePathText(text, lo.DevicePath);
+        IsWellFormedDevicePath(lo.DevicePath);
+        GUID partition = {};
+        std::wstring file;
+        FindEspFileNodes(lo.DevicePath, partition, file);
+    }
+
+    // The whole input as a bare device path, a signature database and a PE image.
+    text.clear();
+    AppendDevicePathText(text, { blob.data(), blob.size() });
+    std::vector<SignatureList> lists;
+    ParseSignatureLists(blob, lists);
+    BYTE digest[SHA256_DIGEST_SIZE];
+    std::wstring error;
+    AuthenticodeSha256(blob.data(), blob.size(), digest, error);
     return 0;
 }
+#else
+int wmain(int argc, wchar_t** argv) {
+    // stdout goes through ConsoleStreamBuf, which writes UTF-16 itself; only
+    // std::wcerr still uses the CRT stream.
+    _setmode(_fileno(stderr), _O_U16TEXT);
+
+    ConsoleStreamBuf consoleOut(GetStdHandle(STD_OUTPUT_HANDLE));
+    ScopedStreamBuf bufferedOut(std::wcout, &consoleOut);
+
+    std::vector<std::wstring> args(argv + 1, argv + argc);
+    GlobalOptions opts;
+    if (!ParseGlobalOptions(args, opts)) {
+        return 2;
+    }
+
+    // Keep stdout parseable when a machine-readable format was asked for.
+    const auto format = std::find(args.begin(), args.end(), L"--format");
+    std::wstring formatValue = (format != args.end() && format + 1 != args.end()) ? *(format + 1) : L"text";
+    std::transform(formatValue.begin(), formatValue.end(), formatValue.begin(), ::towlower);
+    if (formatValue == L"text" && opts.ImagesPattern.empty() && !opts.Quiet) {
+        Out() << L"Booteja (Windows / UEFI)\n";
+    }
+
+    // Offline files only: no privilege needed, and stdout carries one NDJSON
+    // record per image.
+    if (!opts.ImagesPattern.empty()) {
+        const int rc = cmd_images(opts.ImagesPattern, opts.Jobs, args, &consoleOut);
+        Out().flush();
+        return rc;
+    }
+
+    // The service holds the privilege; the client needs none.
+    if (opts.UseService) {
+        const int rc = CallService(args);
+        Out().flush();
+        return rc;
+    }
+
+    TimedWideStreamBuf timedOut(&consoleOut);
+    std::unique_ptr<ScopedStreamBuf> timedScope;
+    if (opts.Trace) {
+        g_trace.Enable(opts.TraceToStderr);
+        timedScope.reset(new ScopedStreamBuf(std::wcout, &timedOut));
+    }
+
+    static ReplayEfiBackend replay;
+    static VarStoreEfiBackend varStore;
+    if (!opts.ReplayPath.empty()) {
+        if (!replay.Load(opts.ReplayPath, opts.ReplayLatency)) {
+            return 1;
+        }
+        g_backend = &replay;
+    } else if (!opts.VarStorePath.empty()) {
+        if (!varStore.Open(opts.VarStorePath)) {
+            return 1;
+        }
+        g_backend = &varStore;
+    } else {
+        g_journalPath = DefaultJournalPath();
+    }
+
+    static TracingEfiBackend tracing(*g_backend);
+    if (opts.Trace) {
+        g_backend = &tracing;
+    }
+
+    // A commit cut off by a crash or power loss is rolled back before the
+    // next command that writes; 'recover' reports on it first.
+    if (!args.empty() && _wcsicmp(args[0].c_str(), L"recover") != 0 && JournalExists()) {
+        if (WritesFirmware(args)) {
+            RecoverJournal();
+        } else {
+            Err() << L"Note: an interrupted commit is journaled in '" << g_journalPath
+                       << L"'; the next write command or 'booteja recover' rolls it back.\n";
+        }
+    }
+
+    int rc = RunCommand(args);
+    if (!varStore.Flush()) {
+        Err() << L"Flushing '" << opts.VarStorePath << L"' failed: " << LastErrorMessage() << L"\n";
+        rc = rc == 0 ? 4 : rc;
+    }
+
+    Out().flush();
+    g_trace.Summary();
+    return rc;
+}
+#endif